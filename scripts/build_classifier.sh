@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Build classifier_bench (src/classifier_bench.cpp) against a parameters header
+# written by export_gate_classifier() or export_fisher_classifier()
+# (src/exportclassifier.cpp). No ROOT needed; the header and the events file
+# are looked up in src/ unless a path is given.
+#   scripts/build_classifier.sh [params header]
+#   src/classifier_bench [events file] [repeats]
+
+cd "$(dirname "$0")/../src" || exit 1
+
+PARAMS="${1:-psd_classifier_params.h}"
+if [ ! -f "$PARAMS" ]; then
+	echo "No $PARAMS; run export_gate_classifier() or export_fisher_classifier() first"
+	exit 1
+fi
+
+echo "Building classifier_bench with $PARAMS..."
+c++ -O3 -march=native -std=c++17 -I. -DPSD_CLASSIFIER_PARAMS="\"$(realpath "$PARAMS")\"" \
+	classifier_bench.cpp -o classifier_bench || exit 1
+echo "Built src/classifier_bench."
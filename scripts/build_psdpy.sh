@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Build the psdpy Python module (src/psdpy.cpp) used by plotmatrix.ipynb.
+# Needs ROOT (see lr) and pybind11 (pip install --user pybind11) for the
+# python3 that runs the notebook. The module is written next to the notebook.
+
+cd "$(dirname "$0")/../src" || exit 1
+
+echo "Building psdpy..."
+c++ -O3 -march=native -shared -fPIC $(python3 -m pybind11 --includes) $(root-config --cflags) \
+	psdpy.cpp -o psdpy$(python3-config --extension-suffix) $(root-config --libs) || exit 1
+echo "Built src/psdpy$(python3-config --extension-suffix)."
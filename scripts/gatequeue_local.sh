@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Run a sharded gate scan on this machine with several worker processes.
+# The same queue directory can be shared with workers started on other nodes.
+#
+# Usage: gatequeue_local.sh <queueDir> <file1> <file2> [nWorkers] [gates|chunks]
+
+QUEUE=$1
+FILE1=$2
+FILE2=$3
+NWORKERS=${4:-4}
+MODE=${5:-gates}
+
+echo "Creating queue in $QUEUE ($MODE)..."
+root -l -b <<EOF2
+.L gatequeue.cpp+
+gatequeue_init("$QUEUE", "$FILE1", "$FILE2", "$MODE")
+.q
+EOF2
+
+echo "Starting $NWORKERS workers..."
+for i in $(seq 1 $NWORKERS); do
+root -l -b > "$QUEUE/worker_$i.log" 2>&1 <<EOF2 &
+.L gatequeue.cpp+
+gatequeue_worker("$QUEUE")
+.q
+EOF2
+done
+wait
+echo "All workers finished."
+
+root -l -b <<EOF2
+.L gatequeue.cpp+
+gatequeue_merge("$QUEUE", "output.txt")
+.q
+EOF2
+echo "Merged result written to output.txt."
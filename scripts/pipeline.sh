@@ -0,0 +1,170 @@
+#!/bin/bash
+
+# Run the processing stages listed in pipeline.txt as a dependency graph.
+#
+# Each stage gets a key: the hash of its call, the code of its macro (and the
+# local headers it includes), the recorded runs of the stages it depends on
+# and the identity (path, size, mtime) of its external inputs. A stage whose
+# key matches its last successful run, and whose output exists, is skipped;
+# anything else is rerun, which in turn invalidates everything downstream.
+# Stages whose dependencies are done run concurrently, except that a stage
+# never runs alongside one writing a file it reads or writes. A stage reads
+# its inputs and the files its dependencies write, so e.g. a stage reading
+# the adjusted file waits for every t0 stage rewriting it, and the reverse.
+#
+# Usage: pipeline.sh [stagesFile] [maxJobs]
+#   FORCE="t0_010 scan" pipeline.sh   reruns the named stages regardless of their key
+# State (keys and logs) is kept in .pipeline/ in the current directory.
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+STAGES=${1:-$HERE/pipeline.txt}
+MAXJOBS=${2:-$(nproc)}
+SRC=${SRC:-$HERE/../src}
+STATE=${STATE:-.pipeline}
+mkdir -p "$STATE"
+
+trim() { local s="$*"; s="${s#"${s%%[![:space:]]*}"}"; echo "${s%"${s##*[![:space:]]}"}"; }
+
+names=(); deps=(); inputs=(); writes=(); macros=(); calls=()
+while IFS='|' read -r name dep input write macro call; do
+	name=$(trim "$name")
+	[[ -z "$name" || "$name" == \#* ]] && continue
+	names+=("$name"); deps+=("$(trim "$dep")"); inputs+=("$(trim "$input")")
+	writes+=("$(trim "$write")"); macros+=("$(trim "$macro")"); calls+=("$(trim "$call")")
+done < "$STAGES"
+N=${#names[@]}
+
+index_of() {
+	for ((k = 0; k < N; ++k)); do [[ "${names[$k]}" == "$1" ]] && { echo $k; return; }; done
+	echo -1
+}
+
+# Macro source plus the local headers it includes, recursively
+code_files() {
+	local f=$1
+	echo "$f"
+	for h in $(sed -n 's/^#include "\(.*\)"/\1/p' "$SRC/$f"); do
+		[[ -f "$SRC/$h" ]] && code_files "$h"
+	done
+}
+
+stage_key() {
+	local i=$1
+	{
+		echo "call ${calls[$i]}"
+		for f in $(code_files "${macros[$i]}" | sort -u); do
+			echo "code $f $(sha256sum < "$SRC/$f" | cut -d' ' -f1)"
+		done
+		for d in ${deps[$i]//,/ }; do
+			[[ "$d" == "-" ]] || echo "dep $d $(cat "$STATE/$d.done" 2>/dev/null)"
+		done
+		for f in ${inputs[$i]//,/ }; do
+			[[ "$f" == "-" ]] || echo "input $f $(stat -c '%s %Y' "$f" 2>/dev/null)"
+		done
+	} | sha256sum | cut -d' ' -f1
+}
+
+run_stage() {
+	local i=$1
+	root -l -b > "$STATE/${names[$i]}.log" 2>&1 <<EOF
+.L $SRC/${macros[$i]}+
+${calls[$i]}
+.q
+EOF
+	local status=$?
+	# The macros report failures on stderr rather than through the exit code
+	if [[ $status -eq 0 ]] && grep -q "^Error" "$STATE/${names[$i]}.log"; then status=1; fi
+	return $status
+}
+
+# state: pending, running, done, failed
+declare -A state pids keys
+for ((i = 0; i < N; ++i)); do
+	state[$i]=pending
+	for d in ${deps[$i]//,/ }; do
+		if [[ "$d" != "-" && $(index_of "$d") -lt 0 ]]; then
+			echo "Stage ${names[$i]}: unknown dependency $d"
+			exit 1
+		fi
+	done
+done
+
+# Files stage $1 reads: its inputs and the outputs of its dependencies
+reads_of() {
+	local i=$1
+	for f in ${inputs[$i]//,/ }; do [[ "$f" == "-" ]] || echo "$f"; done
+	for d in ${deps[$i]//,/ }; do [[ "$d" == "-" ]] || echo "${writes[$(index_of "$d")]}"; done
+}
+
+# Whether a running stage writes a file stage $1 uses, or reads one it writes
+busy_stage() {
+	local i=$1 j f
+	for j in "${!pids[@]}"; do
+		[[ "${writes[$j]}" == "${writes[$i]}" ]] && return 0
+		while read -r f; do [[ "$f" == "${writes[$j]}" ]] && return 0; done < <(reads_of $i)
+		while read -r f; do [[ "$f" == "${writes[$i]}" ]] && return 0; done < <(reads_of $j)
+	done
+	return 1
+}
+
+nFailed=0
+while true; do
+	progress=0
+	for ((i = 0; i < N; ++i)); do
+		[[ ${state[$i]} == pending ]] || continue
+		ready=1
+		for d in ${deps[$i]//,/ }; do
+			[[ "$d" == "-" ]] && continue
+			case ${state[$(index_of "$d")]} in
+				done) ;;
+				failed) state[$i]=failed; nFailed=$((nFailed + 1)); echo "Skipping ${names[$i]}: $d failed"; ready=0; progress=1; break ;;
+				*) ready=0 ;;
+			esac
+		done
+		[[ $ready -eq 1 ]] || continue
+		busy_stage $i && continue
+		[[ ${#pids[@]} -lt $MAXJOBS ]] || break
+
+		key=$(stage_key $i)
+		previous=$(cut -d' ' -f1 "$STATE/${names[$i]}.done" 2>/dev/null)
+		if [[ "$key" == "$previous" && -e "${writes[$i]}" && " $FORCE " != *" ${names[$i]} "* ]]; then
+			echo "Up to date: ${names[$i]}"
+			state[$i]=done
+		else
+			echo "Running ${names[$i]}: ${calls[$i]}"
+			rm -f "$STATE/${names[$i]}.done"
+			run_stage $i &
+			pids[$i]=$!
+			keys[$i]=$key
+			state[$i]=running
+		fi
+		progress=1
+	done
+
+	if [[ ${#pids[@]} -eq 0 ]]; then
+		[[ $progress -eq 1 ]] && continue
+		break
+	fi
+
+	wait -n
+	for j in "${!pids[@]}"; do
+		kill -0 "${pids[$j]}" 2>/dev/null && continue
+		if wait "${pids[$j]}"; then
+			# Key plus run time: a rerun always changes what dependents hash
+			echo "${keys[$j]} $(date +%s%N)" > "$STATE/${names[$j]}.done"
+			state[$j]=done
+			echo "Finished ${names[$j]}"
+		else
+			state[$j]=failed
+			nFailed=$((nFailed + 1))
+			echo "FAILED ${names[$j]} (see $STATE/${names[$j]}.log)"
+		fi
+		unset "pids[$j]"
+	done
+done
+
+for ((i = 0; i < N; ++i)); do
+	[[ ${state[$i]} == pending ]] && echo "Not run: ${names[$i]} (dependency cycle?)" && nFailed=$((nFailed + 1))
+done
+[[ $nFailed -eq 0 ]] && echo "Pipeline complete." || echo "Pipeline finished with $nFailed failed or skipped stages."
+[[ $nFailed -eq 0 ]]
@@ -1,6 +1,11 @@
 #!/bin/bash
 
+# Reruns every stage unconditionally. pipeline.sh runs the same stages
+# (pipeline.txt) and skips those whose inputs, code and parameters are unchanged.
+
 # Run the bsl_adjust.c commands
+# bslAdjust(0, 6200) would store only record samples 0-6199, enough for the
+# gate scan (up to 6100) and the averages (6000) at ~40% less storage.
 echo "Starting bsl_adjust.c: executing bslAdjust()..."
 root -l -b <<EOF
 .L bsl_adjust.c
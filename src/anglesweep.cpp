@@ -0,0 +1,221 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "pulseproc.h"
+#include "prefilter.h"
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Batch FOM scan over a whole angle sweep.
+//
+// manifest: one dataset per line, "label path-to-raw.root" (raw "tree"/"pulsedata",
+//           as read by bslAdjust()). Lines starting with '#' are ignored.
+// pairList: optional file of "labelA labelB" lines; empty means every pair.
+//
+// Each dataset is read once and taken through baseline, CFD and QDC in memory.
+// Per-dataset per-gate ratio fits are done once and shared by every pair, so
+// the cost grows with the number of datasets rather than the number of pairs.
+// Each pair gets its own output_<A>_<B>.txt in the gatematrix "t1 t2 fom" format.
+
+struct SweepDataset {
+	std::string label;
+	std::string path;
+	ChargeTable charges;
+	bool ok = false;
+};
+
+static bool readSweepManifest(const char* manifest, std::vector<SweepDataset>& datasets)
+{
+	std::ifstream in(manifest);
+	if (!in.is_open()) {
+		std::cerr << "Error opening manifest: " << manifest << std::endl;
+		return false;
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#') continue;
+		std::istringstream ss(line);
+		SweepDataset d;
+		if (ss >> d.label >> d.path) {
+			datasets.push_back(d);
+		}
+	}
+	return !datasets.empty();
+}
+
+// Baseline -> CFD -> align -> edge charges for every event of one raw file
+static bool processSweepDataset(SweepDataset& d, const GateGrid& grid, double cfdFraction, const char* filter)
+{
+	WaveformFilter prefilter(filter);
+
+	TFile* sourceFile = TFile::Open(d.path.c_str(), "READ");
+	if (!sourceFile || sourceFile->IsZombie()) {
+		std::cerr << "Error opening file: " << d.path << std::endl;
+		return false;
+	}
+	TTree* sourceTree = dynamic_cast<TTree*>(sourceFile->Get("tree"));
+	if (!sourceTree) {
+		std::cerr << "Error getting source tree from " << d.path << std::endl;
+		sourceFile->Close();
+		return false;
+	}
+
+	std::vector<double> pd(kNSamples), adjusted(kNSamples), filtered(kNSamples), aligned(kNSamples);
+	sourceTree->SetBranchAddress("pulsedata", pd.data());
+
+	Long64_t nEntries = sourceTree->GetEntries();
+	d.charges.grid = grid;
+	d.charges.resize(nEntries);
+
+	for (Long64_t i = 0; i < nEntries; ++i) {
+		sourceTree->GetEntry(i);
+		double baseline = computeBaseline(pd.data());
+		subtractBaseline(pd.data(), baseline, adjusted.data());
+		// Optional pre-filter feeds both CFD and integration, in memory
+		const double* pulse = adjusted.data();
+		if (prefilter.active()) {
+			prefilter.apply(adjusted.data(), filtered.data(), kNSamples);
+			pulse = filtered.data();
+		}
+		double t0_value = cfdTime(pulse, kNSamples, cfdFraction);
+		alignPulse(pulse, kNSamples, t0_value, aligned.data());
+		edgeCharges(aligned.data(), grid, d.charges.row(i));
+	}
+
+	sourceFile->Close();
+	delete sourceFile;
+	return true;
+}
+
+void anglesweep(const char* manifest = "sweep_manifest.txt", const char* pairList = "",
+				double cfdFraction = 0.1, int nBins = 500, unsigned int nThreads = 0,
+				const char* filter = "")
+{
+	ROOT::EnableThreadSafety();
+
+	if (!WaveformFilter(filter).ok()) return;
+
+	std::vector<SweepDataset> datasets;
+	if (!readSweepManifest(manifest, datasets)) {
+		std::cerr << "No datasets in manifest" << std::endl;
+		return;
+	}
+
+	GateGrid grid;
+	const int nEdges = grid.nSteps;
+	const size_t nData = datasets.size();
+
+	// --- Stage 1: baseline/CFD/QDC, one dataset per job ---
+	std::cout << "Processing " << nData << " datasets on " << workerCount(nThreads) << " threads..." << std::endl;
+	std::mutex logMutex;
+	parallelFor(nData, nThreads, [&](size_t k, unsigned int) {
+		datasets[k].ok = processSweepDataset(datasets[k], grid, cfdFraction, filter);
+		std::lock_guard<std::mutex> guard(logMutex);
+		std::cout << "Dataset " << datasets[k].label << ": " << datasets[k].charges.nEvents << " events" << std::endl;
+	});
+
+	// --- Stage 2: common histogram range per gate across all datasets ---
+	// qratio() takes the range from the pair it compares. To make one fit
+	// per dataset reusable by every pair, the range is shared by the sweep:
+	// the widest 5th-95th percentile band of any dataset, padded by 20%.
+	std::vector<double> p5(nData * nEdges * nEdges), p95(nData * nEdges * nEdges);
+	auto gateIndex = [&](size_t k, int i1, int i2) { return (k * nEdges + i1) * nEdges + i2; };
+
+	parallelFor(nData * nEdges, nThreads, [&](size_t job, unsigned int) {
+		size_t k = job / nEdges;
+		int i1 = job % nEdges;
+		if (!datasets[k].ok) return;
+		std::vector<double> ratios;
+		for (int i2 = i1 + 1; i2 < nEdges; ++i2) {
+			collectRatios(datasets[k].charges, i1, i2, ratios);
+			ratioPercentiles(ratios, p5[gateIndex(k, i1, i2)], p95[gateIndex(k, i1, i2)]);
+		}
+	});
+
+	std::vector<double> lowRange(nEdges * nEdges, 0.0), highRange(nEdges * nEdges, 0.0);
+	for (int i1 = 0; i1 < nEdges; ++i1) {
+		for (int i2 = i1 + 1; i2 < nEdges; ++i2) {
+			bool first = true;
+			double lo = 0.0, hi = 0.0;
+			for (size_t k = 0; k < nData; ++k) {
+				if (!datasets[k].ok) continue;
+				double a = p5[gateIndex(k, i1, i2)], b = p95[gateIndex(k, i1, i2)];
+				if (first || a < lo) lo = a;
+				if (first || b > hi) hi = b;
+				first = false;
+			}
+			paddedRange(lo, hi, lowRange[i1 * nEdges + i2], highRange[i1 * nEdges + i2]);
+		}
+	}
+
+	// --- Stage 3: one Gaussian fit per dataset per gate ---
+	std::vector<GateStats> stats(nData * nEdges * nEdges);
+	parallelFor(nData * nEdges, nThreads, [&](size_t job, unsigned int) {
+		size_t k = job / nEdges;
+		int i1 = job % nEdges;
+		if (!datasets[k].ok) return;
+		std::vector<double> ratios;
+		for (int i2 = i1 + 1; i2 < nEdges; ++i2) {
+			collectRatios(datasets[k].charges, i1, i2, ratios);
+			stats[gateIndex(k, i1, i2)] = fitRatios(ratios, nBins,
+													lowRange[i1 * nEdges + i2], highRange[i1 * nEdges + i2]);
+		}
+	});
+
+	// --- Stage 4: FOM matrix for each requested pair (no event data touched) ---
+	std::vector<std::pair<size_t, size_t>> pairs;
+	if (pairList && pairList[0] != '\0') {
+		std::ifstream in(pairList);
+		if (!in.is_open()) {
+			std::cerr << "Error opening pair list: " << pairList << std::endl;
+			return;
+		}
+		std::string a, b;
+		while (in >> a >> b) {
+			size_t ia = nData, ib = nData;
+			for (size_t k = 0; k < nData; ++k) {
+				if (datasets[k].label == a) ia = k;
+				if (datasets[k].label == b) ib = k;
+			}
+			if (ia == nData || ib == nData) {
+				std::cerr << "Unknown dataset in pair: " << a << " " << b << std::endl;
+				continue;
+			}
+			pairs.emplace_back(ia, ib);
+		}
+	} else {
+		for (size_t a = 0; a < nData; ++a)
+			for (size_t b = a + 1; b < nData; ++b)
+				pairs.emplace_back(a, b);
+	}
+
+	for (const auto& p : pairs) {
+		const SweepDataset& d1 = datasets[p.first];
+		const SweepDataset& d2 = datasets[p.second];
+		if (!d1.ok || !d2.ok) continue;
+
+		std::string outName = "output_" + d1.label + "_" + d2.label + ".txt";
+		std::ofstream txtOut(outName.c_str());
+		for (int i1 = 0; i1 < nEdges; ++i1) {
+			for (int i2 = 0; i2 < nEdges; ++i2) {
+				int t1 = grid.edge(i1), t2 = grid.edge(i2);
+				if (t1 >= t2) {
+					txtOut << t1 << " " << t2 << " 0" << std::endl;
+					continue;
+				}
+				txtOut << t1 << " " << t2 << " "
+					   << fom(stats[gateIndex(p.first, i1, i2)], stats[gateIndex(p.second, i1, i2)]) << std::endl;
+			}
+		}
+		std::cout << "Wrote " << outName << std::endl;
+	}
+
+	std::cout << "Angle sweep complete: " << nData << " datasets, " << pairs.size() << " pairs." << std::endl;
+}
@@ -5,51 +5,58 @@
 #include "TLegend.h"
 #include "TLine.h"
 #include <iostream>
+#include <vector>
+
+#include "pulseproc.h"
+#include "prefetchreader.h"
+#include "reduce.h"
 
 void plot() {
 
     const int nSamples = 6000;
 
     // --- Process degrees_10 file ---
-    TFile* file1 = TFile::Open("/shared/storage/physnp/jm2912/degrees_10_adjusted.root", "READ");
-    TTree* tree1 = dynamic_cast<TTree*>(file1->Get("adjustedTree"));
+    PrefetchReader reader1("/shared/storage/physnp/jm2912/degrees_10_adjusted.root", "adjustedTree");
+    int aligned1 = reader1.addBranch("t0aligned_cfd0.10");
+    if (!reader1.start()) return;
 
-    int nEntries1 = tree1->GetEntries();
+    int nEntries1 = reader1.entries();
     double pulse1[nSamples];
-    tree1->SetBranchAddress("t0aligned_cfd0.10", pulse1);
 
-    double sum1[nSamples] = {0};
-    for (int i = 0; i < nEntries1; ++i) {
-        tree1->GetEntry(i);
-        for (int j = 0; j < nSamples; ++j) {
-            sum1[j] += pulse1[j];
+    VectorSum sum1(nSamples);
+    while (const EventBatch* batch = reader1.next()) {
+        for (int b = 0; b < batch->size; ++b) {
+            expandWindow(batch->get(aligned1, b), reader1.length(aligned1), 0, pulse1, nSamples);
+            sum1.add(pulse1);
         }
     }
+    std::vector<double> total1 = sum1.result();
 
     double avg1[nSamples];
     for (int j = 0; j < nSamples; ++j) {
-        avg1[j] = sum1[j] / nEntries1;
+        avg1[j] = total1[j] / nEntries1;
     }
 
     // --- Process degrees_30 file ---
-    TFile* file2 = TFile::Open("/shared/storage/physnp/jm2912/degrees_30_adjusted.root", "READ");
-    TTree* tree2 = dynamic_cast<TTree*>(file2->Get("adjustedTree"));
+    PrefetchReader reader2("/shared/storage/physnp/jm2912/degrees_30_adjusted.root", "adjustedTree");
+    int aligned2 = reader2.addBranch("t0aligned_cfd0.10");
+    if (!reader2.start()) return;
 
-    int nEntries2 = tree2->GetEntries();
+    int nEntries2 = reader2.entries();
     double pulse2[nSamples];
-    tree2->SetBranchAddress("t0aligned_cfd0.10", pulse2);
 
-    double sum2[nSamples] = {0};
-    for (int i = 0; i < nEntries2; ++i) {
-        tree2->GetEntry(i);
-        for (int j = 0; j < nSamples; ++j) {
-            sum2[j] += pulse2[j];
+    VectorSum sum2(nSamples);
+    while (const EventBatch* batch = reader2.next()) {
+        for (int b = 0; b < batch->size; ++b) {
+            expandWindow(batch->get(aligned2, b), reader2.length(aligned2), 0, pulse2, nSamples);
+            sum2.add(pulse2);
         }
     }
+    std::vector<double> total2 = sum2.result();
 
     double avg2[nSamples];
     for (int j = 0; j < nSamples; ++j) {
-        avg2[j] = sum2[j] / nEntries2;
+        avg2[j] = total2[j] / nEntries2;
     }
 
     // --- Prepare the x-axis values ---
@@ -94,8 +101,4 @@ void plot() {
     line2->Draw();
 
     c1->SaveAs("average_plot.png");
-
-    // Close files
-    file1->Close();
-    file2->Close();
 }
\ No newline at end of file
@@ -0,0 +1,166 @@
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Bootstrap uncertainties on the FOM of every gate and on the best gate.
+//
+// Each replica reweights every event with a Poisson(1) weight. The weight of
+// an event in a replica is a hash of (seed, replica, dataset, event), so all
+// gates of one replica see the same resampled events and the per-replica best
+// gate is meaningful, while gates can still be processed independently on
+// any thread. Events are reduced to edge charges once (gatescan.h); the trees
+// are not re-read per replica or per gate.
+//
+// A replica whose fit failed for either dataset has no FOM for that gate: it
+// is left out of the gate's mean and spread and of that replica's best-gate
+// vote.
+//
+// Output (bootstrap_output.txt): t1 t2 fom fom_mean fom_std best_fraction n_valid
+// where best_fraction is the share of replicas in which this gate had the
+// highest FOM and n_valid the number of replicas with a valid fit.
+
+// splitmix64
+static inline uint64_t bootstrapHash(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Poisson(1) draw by inverse CDF from a hashed uniform
+static inline double poissonWeight(uint64_t seed, int replica, int dataset, Long64_t event)
+{
+	uint64_t h = bootstrapHash(seed ^ bootstrapHash((uint64_t(replica) << 33) ^ (uint64_t(dataset) << 32) ^ uint64_t(event)));
+	double u = (h >> 11) * (1.0 / 9007199254740992.0);  // 53-bit uniform in [0,1)
+	double p = 0.36787944117144233;                     // e^-1
+	double cdf = p;
+	int k = 0;
+	while (u > cdf && k < 20) {
+		++k;
+		p /= k;
+		cdf += p;
+	}
+	return k;
+}
+
+void bootstrap(const char* fileLocation1, const char* fileLocation2,
+			   int nReplicas = 200, const char* branch = "t0aligned_cfd0.10",
+			   int nBins = 500, unsigned int nThreads = 0, unsigned long seed = 12345,
+			   const char* outputName = "bootstrap_output.txt")
+{
+	ROOT::EnableThreadSafety();
+
+	GateGrid grid;
+	ChargeTable tables[2];
+	if (!readChargeTable(fileLocation1, branch, grid, tables[0])) return;
+	if (!readChargeTable(fileLocation2, branch, grid, tables[1])) return;
+
+	const int nEdges = grid.nSteps;
+	const size_t nGates = nEdges * nEdges;
+	std::vector<double> nominal(nGates, 0.0);
+	std::vector<double> replicaFom(nGates * nReplicas, 0.0);
+	std::vector<char> replicaValid(nGates * nReplicas, 0);
+	std::vector<char> isGate(nGates, 0);
+
+	std::cout << "Bootstrapping " << nReplicas << " replicas over " << nGates << " gates on "
+			  << workerCount(nThreads) << " threads..." << std::endl;
+
+	parallelFor(nGates, nThreads, [&](size_t gate, unsigned int) {
+		int i1 = gate / nEdges, i2 = gate % nEdges;
+		if (grid.edge(i1) >= grid.edge(i2)) return;
+
+		std::vector<double> ratios[2], weights;
+		std::vector<Long64_t> events[2];
+		for (int d = 0; d < 2; ++d) collectRatios(tables[d], i1, i2, ratios[d], events[d]);
+		if (ratios[0].empty() || ratios[1].empty()) return;
+		isGate[gate] = 1;
+
+		// The binning is fixed by the nominal sample for all replicas
+		double lowRange, highRange;
+		pairRange(ratios[0], ratios[1], lowRange, highRange);
+
+		GateStats nominalStats[2];
+		for (int d = 0; d < 2; ++d) nominalStats[d] = fitRatios(ratios[d], nBins, lowRange, highRange);
+		nominal[gate] = fom(nominalStats[0], nominalStats[1]);
+
+		FastHist fh(nBins, lowRange, highRange);
+		for (int r = 0; r < nReplicas; ++r) {
+			GateStats s[2];
+			for (int d = 0; d < 2; ++d) {
+				weights.resize(ratios[d].size());
+				for (size_t k = 0; k < weights.size(); ++k) {
+					weights[k] = poissonWeight(seed, r, d, events[d][k]);
+				}
+				fh.reset(nBins, lowRange, highRange);
+				fh.fill(ratios[d].data(), weights.data(), ratios[d].size());
+				// Seeding from the nominal fit keeps the replica fits short
+				s[d] = fitHist(fh, nominalStats[d]);
+			}
+			replicaFom[gate * nReplicas + r] = fom(s[0], s[1]);
+			replicaValid[gate * nReplicas + r] = s[0].valid && s[1].valid;
+		}
+	});
+
+	// Best gate of each replica
+	std::vector<int> bestCount(nGates, 0);
+	for (int r = 0; r < nReplicas; ++r) {
+		size_t best = nGates;
+		for (size_t g = 0; g < nGates; ++g) {
+			if (!replicaValid[g * nReplicas + r]) continue;
+			if (best == nGates || replicaFom[g * nReplicas + r] > replicaFom[best * nReplicas + r]) best = g;
+		}
+		if (best < nGates) ++bestCount[best];
+	}
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+
+	size_t nominalBest = nGates;
+	std::vector<double> mean(nGates, 0.0), stdDev(nGates, 0.0);
+	for (size_t g = 0; g < nGates; ++g) {
+		int t1 = grid.edge(g / nEdges), t2 = grid.edge(g % nEdges);
+		if (!isGate[g]) {
+			txtOut << t1 << " " << t2 << " 0 0 0 0 0" << std::endl;
+			continue;
+		}
+		double sum = 0.0, sum2 = 0.0;
+		int nValid = 0;
+		for (int r = 0; r < nReplicas; ++r) {
+			if (!replicaValid[g * nReplicas + r]) continue;
+			double f = replicaFom[g * nReplicas + r];
+			sum += f;
+			sum2 += f * f;
+			++nValid;
+		}
+		mean[g] = nValid > 0 ? sum / nValid : 0.0;
+		double var = nValid > 1 ? (sum2 - sum * mean[g]) / (nValid - 1) : 0.0;
+		stdDev[g] = var > 0 ? std::sqrt(var) : 0.0;
+		txtOut << t1 << " " << t2 << " " << nominal[g] << " " << mean[g] << " " << stdDev[g] << " "
+			   << double(bestCount[g]) / nReplicas << " " << nValid << std::endl;
+		if (nominalBest == nGates || nominal[g] > nominal[nominalBest]) nominalBest = g;
+	}
+
+	if (nominalBest < nGates) {
+		// Gates whose FOM is within one standard deviation of the best are not distinguishable from it
+		int nCompatible = 0;
+		for (size_t g = 0; g < nGates; ++g) {
+			if (isGate[g] && nominal[nominalBest] - nominal[g] <= stdDev[nominalBest]) ++nCompatible;
+		}
+		std::cout << "Best gate t1=" << grid.edge(nominalBest / nEdges) << " t2=" << grid.edge(nominalBest % nEdges)
+				  << ": FOM = " << nominal[nominalBest] << " +/- " << stdDev[nominalBest]
+				  << ", best in " << 100.0 * bestCount[nominalBest] / nReplicas << "% of replicas, "
+				  << nCompatible << " gates within 1 sigma." << std::endl;
+	}
+	std::cout << "Bootstrap results written to " << outputName << std::endl;
+}
@@ -2,83 +2,205 @@
 #include "TTree.h"
 #include "TH1D.h"
 #include "TLegend.h"
+#include "TROOT.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
 
-void bslAdjust()
+#include "pulseproc.h"
+#include "prefetchreader.h"
+#include "threadpool.h"
+#include "memorybudget.h"
+#include "incremental.h"
+
+// Output of one entry range, filled by a worker and written in order
+struct BslChunk {
+	std::vector<double> baselines;
+	std::vector<double> adjusted;     // nEvents x roiLength
+	std::vector<int> offsets;
+};
+
+// roiStart/roiLength: store only a window of each record. With roiFromCfd the
+// window starts roiStart samples after the CFD time (so roiStart = -1000 puts
+// the CFD point at index 1000 of the window), otherwise at record index roiStart.
+// The window start of every event is stored in roi_offset, and the settings in
+// the tree's user info, from which t0() sizes the aligned branch so the whole
+// window survives alignment (see alignedLength() in pulseproc.h). A CFD window
+// may not start more than 1000 samples before the CFD time, where alignment
+// would push it out of the record. The defaults keep the full 10000-sample
+// record.
+// nThreads: worker threads (0 = one per core). Entry ranges follow the source
+// tree's clusters and are processed in parallel; the output tree is filled on
+// this thread in the original event order.
+// append: keep the existing output and process only the source entries after
+// the ones already adjusted (see incremental.h). Only the adjusted branches
+// are filled for the new entries; rerun the later stages with incremental to
+// extend theirs. The ROI settings must be those of the existing output.
+void bslAdjust(int roiStart = 0, int roiLength = 10000, bool roiFromCfd = false, double cfdFraction = 0.1,
+			   unsigned int nThreads = 0, bool append = false)
 {
-	// Open the ROOT file and retrieve the TTree
-	TFile* sourceFile = TFile::Open("/shared/storage/physnp/sp1357/MPhys_and_BSc/SummerProject17/data_NaI/degrees_10.root", "READ");
-		
-	TTree* sourceTree = dynamic_cast<TTree*>(sourceFile->Get("tree"));
-	if (!sourceTree) {
-		std::cerr << "Error getting source tree" << std::endl;
-		sourceFile->Close();
+	if (roiLength <= 0 || roiLength > kNSamples || (!roiFromCfd && (roiStart < 0 || roiStart + roiLength > kNSamples)) ||
+		(roiFromCfd && roiStart < -kAlignIndex)) {
+		std::cerr << "Invalid region of interest: start " << roiStart << ", length " << roiLength << std::endl;
 		return;
 	}
 
-	// Create a new output file
-	TFile* outputFile = TFile::Open("/shared/storage/physnp/jm2912/degrees_10_adjusted.root", "RECREATE");
+	ROOT::EnableThreadSafety();
+	const char* sourceLocation = "/shared/storage/physnp/sp1357/MPhys_and_BSc/SummerProject17/data_NaI/degrees_10.root";
+
+	// One read handle per worker
+	static const int nSamples = 10000;
+	nThreads = workerCount(nThreads);
+	std::vector<TreeHandle> inputs(nThreads);
+	std::vector<std::vector<double>> pd(nThreads, std::vector<double>(nSamples));
+	for (unsigned int t = 0; t < nThreads; ++t) {
+		if (!inputs[t].open(sourceLocation, "tree", nThreads)) {
+			std::cerr << "Error getting source tree" << std::endl;
+			return;
+		}
+		inputs[t].select("pulsedata", pd[t].data());
+	}
+
+	// Create a new output file, or open the existing one to append to
+	TFile* outputFile = TFile::Open("/shared/storage/physnp/jm2912/degrees_10_adjusted.root", append ? "UPDATE" : "RECREATE");
 	if (!outputFile || outputFile->IsZombie()) {
 		std::cerr << "Error creating output file" << std::endl;
-		sourceFile->Close();
 		return;
 	}
-	
-	// Create a new tree from scratch instead of cloning
-	TTree* newTree = new TTree("adjustedTree", "Tree with baseline-adjusted data");
+
+	// Append to the existing tree, or create a new one from scratch instead of cloning
+	TTree* newTree = append ? dynamic_cast<TTree*>(outputFile->Get("adjustedTree")) : nullptr;
+	const bool appending = newTree != nullptr;
+	if (!appending) newTree = new TTree("adjustedTree", "Tree with baseline-adjusted data");
 
 	// Set up variables and branch addresses
-	static const int nSamples = 10000;
-	double pd[nSamples];
 	double baselineadjusted[nSamples];
-	double baselines; 
-	
-	// Connect to source tree
-	sourceTree->SetBranchAddress("pulsedata", pd);
+	double baselines;
+	int roiOffset = 0;
+	bool cropped = roiLength < nSamples;
 
 	// Add only the branches we need to the new tree
-	newTree->Branch("baselines", &baselines, "baselines/D");
-	newTree->Branch("baseline_adjusted", baselineadjusted, "baseline_adjusted[10000]/D");
-
-	// Loop over entries in the source TTree
-	Long64_t nEntries = sourceTree->GetEntries();
-	std::cout << "Processing " << nEntries << " entries..." << std::endl;
-	
-	for (Long64_t i = 0; i < nEntries; ++i) {
-		sourceTree->GetEntry(i);
-
-		// Compute baseline from the first 100 samples
-		double baseline = 0.0;
-		int baselineSamples = 100;
-		for (int j = 0; j < baselineSamples; ++j) {
-			baseline += pd[j];
+	StageBranches outputs(newTree);
+	outputs.add("baselines", &baselines, "baselines/D");
+	outputs.add("baseline_adjusted", baselineadjusted, Form("baseline_adjusted[%d]/D", roiLength));
+	if (cropped) {
+		outputs.add("roi_offset", &roiOffset, "roi_offset/I");
+		std::cout << "Storing " << roiLength << " samples per event from "
+				  << (roiFromCfd ? "CFD time " : "record index ") << (roiStart >= 0 ? "+" : "") << roiStart << std::endl;
+	}
+	Long64_t firstEntry = 0;
+	if (appending) {
+		firstEntry = outputs.resume();
+		std::string roi = cropped ? Form("%s %d", roiFromCfd ? "cfd" : "record", roiStart) : "";
+		if (firstEntry < 0 || (!cropped && newTree->GetBranch("roi_offset")) || (cropped && recordedRoi(newTree) != roi)) {
+			std::cerr << "Error: the existing output was made with other ROI settings or by an incomplete run; rerun without append" << std::endl;
+			outputFile->Close();
+			return;
 		}
+	} else {
+		outputs.create();
+	}
+
+	// Entry ranges of at most 256 events (about 20 MB of output each)
+	Long64_t nEntries = inputs[0].tree->GetEntries();
+	if (firstEntry > nEntries) {
+		std::cerr << "Error: the output has more entries (" << firstEntry << ") than the source (" << nEntries << ")" << std::endl;
+		outputFile->Close();
+		return;
+	}
+	std::vector<std::pair<Long64_t, Long64_t>> ranges = clusterRanges(inputs[0].tree, 256, firstEntry);
+	std::vector<BslChunk> chunks(ranges.size());
+	std::cout << "Processing " << nEntries - firstEntry << " entries in " << ranges.size() << " ranges on "
+			  << nThreads << " threads..." << std::endl;
+
+	std::atomic<bool> readError{false};
+	Long64_t nFilled = firstEntry;
+	// Chunks in flight: up to two per thread, fewer if the memory budget is tight
+	size_t window = std::max<size_t>(1, std::min<size_t>(2 * nThreads, chunkEvents(256 * roiLength * sizeof(double), 0.25, 1)));
+	orderedParallel(ranges.size(), nThreads, window, [&](size_t c, unsigned int t) {
+		if (readError) return;   // the run is abandoned
+		TreeHandle& in = inputs[t];
+		BslChunk& out = chunks[c];
+		Long64_t first = ranges[c].first, last = ranges[c].second;
+		size_t n = last - first;
+		out.baselines.resize(n);
+		out.adjusted.resize(n * roiLength);
+		out.offsets.assign(n, 0);
+		std::vector<double> work(cropped && roiFromCfd ? nSamples : 0);
 
-		baseline /= baselineSamples;
+		in.range(first, last);
+		for (size_t e = 0; e < n; ++e) {
+			if (in.tree->GetEntry(first + e) <= 0) {
+				readError = true;
+				out.baselines.resize(e);
+				return;
+			}
 
-		// Adjust baseline
-		for (Long64_t k = 0; k < nSamples; ++k) {
-			baselineadjusted[k] = pd[k] - baseline; 
+			// Compute baseline from the first 100 samples
+			double baseline = computeBaseline(pd[t].data());
+
+			// Window start in the record, kept inside the record
+			int offset = 0;
+			if (cropped) {
+				offset = roiStart;
+				if (roiFromCfd) {
+					subtractBaseline(pd[t].data(), baseline, work.data(), nSamples);
+					double t0_value = cfdTime(work.data(), nSamples, cfdFraction);
+					offset += (t0_value >= 0) ? static_cast<int>(t0_value) : kAlignIndex;
+				}
+				offset = std::max(0, std::min(offset, nSamples - roiLength));
+			}
+
+			// Adjust baseline
+			subtractBaseline(pd[t].data() + offset, baseline, &out.adjusted[e * roiLength], roiLength);
+			out.baselines[e] = baseline;
+			out.offsets[e] = offset;
+		}
+	}, [&](size_t c) {
+		// Fill the new tree in event order and release the chunk
+		BslChunk& out = chunks[c];
+		for (size_t e = 0; e < out.baselines.size(); ++e) {
+			baselines = out.baselines[e];
+			roiOffset = out.offsets[e];
+			std::copy(&out.adjusted[e * roiLength], &out.adjusted[e * roiLength] + roiLength, baselineadjusted);
+			// Appended entries fill only the adjusted branches (the later
+			// stages' branches are extended by their incremental reruns)
+			if (appending) {
+				outputs.fill();
+			} else {
+				newTree->Fill();
+			}
+			++nFilled;
 		}
+		std::vector<double>().swap(out.adjusted);
 
-		baselines = baseline;
-		
-		// Fill the new tree
-		newTree->Fill();
-		
 		// Progress update
-		if (i % 1000 == 0) {
-			std::cout << "Processed " << i << " entries" << std::endl;
+		if (c % 40 == 0) {
+			std::cout << "Processed " << ranges[c].second << " entries" << std::endl;
 		}
+	});
+	// Entries after a failed chunk would be misaligned: leave an appended
+	// file as it was and remove a partial new one
+	if (readError) {
+		std::cerr << "Error reading source tree; nothing written" << std::endl;
+		std::string outputName = outputFile->GetName();
+		outputFile->Close();
+		if (!appending) std::remove(outputName.c_str());
+		return;
 	}
 
 	// Write the new tree to the output file
+	if (appending) newTree->SetEntries(nFilled);
 	outputFile->cd();
-	newTree->Write();
+	outputs.commit();
+	if (cropped) recordRoi(newTree, roiFromCfd, roiStart);
+	newTree->Write("", TObject::kOverwrite);
 
 	// Clean up
 	outputFile->Close();
-	sourceFile->Close();
-	
+
 	std::cout << "Baseline adjustment completed. Output saved to /shared/storage/physnp/jm1912/degrees_10_adjusted.root" << std::endl;
-}
\ No newline at end of file
+}
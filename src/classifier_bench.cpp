@@ -0,0 +1,87 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <vector>
+
+// Throughput benchmark and check of an exported classifier (psdclassifier.h),
+// built without ROOT by scripts/build_classifier.sh:
+//   ./classifier_bench [events file] [repeats] [budget ns/event]
+// The events file is the one written with the parameters header by
+// exportclassifier.cpp. Prints the share of each training dataset assigned to
+// its own class, then the time per event over all events, repeated; exits
+// with status 2 if that is over the real-time budget.
+
+#ifndef PSD_CLASSIFIER_PARAMS
+#define PSD_CLASSIFIER_PARAMS "psd_classifier_params.h"
+#endif
+#include PSD_CLASSIFIER_PARAMS
+
+int main(int argc, char** argv)
+{
+	const char* eventsName = argc > 1 ? argv[1] : "psd_classifier_events.bin";
+	const int repeats = argc > 2 ? std::atoi(argv[2]) : 200;
+	const double budgetNs = argc > 3 ? std::atof(argv[3]) : 1000.0;
+
+	std::ifstream in(eventsName, std::ios::binary);
+	int32_t header[2] = {0, 0};
+	in.read(reinterpret_cast<char*>(header), sizeof(header));
+	const int nEvents = header[0], length = header[1];
+	if (!in.good() || nEvents <= 0 || length <= 0) {
+		std::fprintf(stderr, "Cannot read events from %s\n", eventsName);
+		return 1;
+	}
+	std::vector<int32_t> labels(nEvents);
+	std::vector<float> samples(size_t(nEvents) * length);
+	for (int e = 0; e < nEvents; ++e) {
+		in.read(reinterpret_cast<char*>(&labels[e]), sizeof(int32_t));
+		in.read(reinterpret_cast<char*>(&samples[size_t(e) * length]), length * sizeof(float));
+	}
+	if (!in.good()) {
+		std::fprintf(stderr, "Truncated events file %s\n", eventsName);
+		return 1;
+	}
+
+	const PsdClassifierParams params = psdExportedParams();
+
+	// Assignment of the training pulses
+	long n[2] = {0, 0}, correct[2] = {0, 0}, rejected[2] = {0, 0};
+	double confidence[2] = {0.0, 0.0};
+	for (int e = 0; e < nEvents; ++e) {
+		int c = labels[e] != 0;
+		PsdDecision d = psdClassify(&samples[size_t(e) * length], length, params);
+		++n[c];
+		if (d.cls < 0) {
+			++rejected[c];
+			continue;
+		}
+		if (d.cls == c) ++correct[c];
+		confidence[c] += d.confidence;
+	}
+	for (int c = 0; c < 2; ++c) {
+		long accepted = n[c] - rejected[c];
+		std::printf("%-40s %6ld events: %5.1f%% as own class, %ld without CFD crossing, mean confidence %.3f\n",
+					kPsdClassNames[c], n[c], n[c] ? 100.0 * correct[c] / n[c] : 0.0, rejected[c],
+					accepted ? confidence[c] / accepted : 0.0);
+	}
+
+	// Throughput
+	double sink = 0.0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; ++r) {
+		for (int e = 0; e < nEvents; ++e) {
+			PsdDecision d = psdClassify(&samples[size_t(e) * length], length, params);
+			sink += d.cls + d.confidence;
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	double perEvent = seconds / (double(repeats) * nEvents);
+	std::printf("%d x %d events in %.3f s: %.1f ns/event, %.2f M events/s (checksum %g)\n", repeats, nEvents,
+				seconds, 1e9 * perEvent, 1e-6 / perEvent, sink);
+	if (1e9 * perEvent > budgetNs) {
+		std::printf("OVER BUDGET: %.1f ns/event > %.0f ns/event\n", 1e9 * perEvent, budgetNs);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Energy-resolved gate scan: FOM(energy, t1, t2) in one pass over the events.
+//
+// energyEdges: comma separated slice edges, e.g. "0,2000,5000,10000,50000".
+// energyEdge:  grid edge whose charge is the event energy (fixed for all
+//              gates, so every gate sees the same events in a slice);
+//              -1 uses each gate's own long-gate charge Q2 instead.
+// calibGain/calibOffset: energy = calibOffset + calibGain * charge, so the
+//              slice edges can be given in calibrated units (e.g. keVee).
+//
+// Each event is reduced to its edge charges once (gatescan.h). For every gate
+// the ratios of both datasets are split into the energy slices in a single
+// sweep over the events, and each slice is fitted as qratio() would fit it,
+// with the range taken from that slice of both datasets.
+//
+// Output (energy_fom.txt): e_low e_high t1 t2 fom n1 n2
+// with n1/n2 the number of ratios of each dataset in the slice.
+
+// Slices with fewer ratios than this in either dataset get FOM 0
+static const size_t kMinSliceEvents = 50;
+
+static bool parseEnergyEdges(const char* spec, std::vector<double>& edges)
+{
+	std::stringstream ss(spec);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) edges.push_back(std::atof(item.c_str()));
+	}
+	if (edges.size() < 2 || !std::is_sorted(edges.begin(), edges.end()) ||
+		std::adjacent_find(edges.begin(), edges.end()) != edges.end()) {
+		std::cerr << "Need at least two increasing energy edges: " << spec << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Slice index of energy e, or -1 outside the edges
+static inline int energySlice(const std::vector<double>& edges, double e)
+{
+	if (!(e >= edges.front()) || e >= edges.back()) return -1;
+	return std::upper_bound(edges.begin(), edges.end(), e) - edges.begin() - 1;
+}
+
+// Q2/Q1 for gate (i1, i2) with the qratio() cuts, split by energy slice
+static void collectSlicedRatios(const ChargeTable& table, int i1, int i2, int energyEdge,
+								double calibGain, double calibOffset, const std::vector<double>& edges,
+								std::vector<std::vector<double>>& ratios)
+{
+	for (auto& r : ratios) r.clear();
+	int eIndex = energyEdge < 0 ? i2 : energyEdge;
+	for (Long64_t i = 0; i < table.nEvents; ++i) {
+		const double* q = table.row(i);
+		if (q[i1] == 0.0) continue;
+		double r = q[i2] / q[i1];
+		if (!std::isfinite(r)) continue;
+		int s = energySlice(edges, calibOffset + calibGain * q[eIndex]);
+		if (s >= 0) ratios[s].push_back(r);
+	}
+}
+
+void energyfom(const char* fileLocation1, const char* fileLocation2,
+			   const char* energyEdges = "0,2000,5000,10000,20000,50000", int energyEdge = -1,
+			   double calibGain = 1.0, double calibOffset = 0.0,
+			   const char* branch = "t0aligned_cfd0.10", int nBins = 500, unsigned int nThreads = 0,
+			   const char* outputName = "energy_fom.txt")
+{
+	ROOT::EnableThreadSafety();
+
+	std::vector<double> edges;
+	if (!parseEnergyEdges(energyEdges, edges)) return;
+	const int nSlices = edges.size() - 1;
+
+	GateGrid grid;
+	if (energyEdge >= grid.nSteps) {
+		std::cerr << "Energy edge " << energyEdge << " outside the gate grid" << std::endl;
+		return;
+	}
+	ChargeTable tables[2];
+	if (!readChargeTable(fileLocation1, branch, grid, tables[0])) return;
+	if (!readChargeTable(fileLocation2, branch, grid, tables[1])) return;
+
+	const int nEdges = grid.nSteps;
+	const size_t nGates = nEdges * nEdges;
+	std::vector<double> cube(nGates * nSlices, 0.0);
+	std::vector<size_t> counts(nGates * nSlices * 2, 0);
+
+	std::cout << "Scanning " << nGates << " gates in " << nSlices << " energy slices on "
+			  << workerCount(nThreads) << " threads..." << std::endl;
+
+	parallelFor(nGates, nThreads, [&](size_t gate, unsigned int) {
+		int i1 = gate / nEdges, i2 = gate % nEdges;
+		if (grid.edge(i1) >= grid.edge(i2)) return;
+
+		std::vector<std::vector<double>> ratios[2];
+		for (int d = 0; d < 2; ++d) {
+			ratios[d].resize(nSlices);
+			collectSlicedRatios(tables[d], i1, i2, energyEdge, calibGain, calibOffset, edges, ratios[d]);
+		}
+
+		for (int s = 0; s < nSlices; ++s) {
+			std::vector<double>& r1 = ratios[0][s];
+			std::vector<double>& r2 = ratios[1][s];
+			counts[(gate * nSlices + s) * 2] = r1.size();
+			counts[(gate * nSlices + s) * 2 + 1] = r2.size();
+			if (r1.size() < kMinSliceEvents || r2.size() < kMinSliceEvents) continue;
+
+			double lowRange, highRange;
+			pairRange(r1, r2, lowRange, highRange);
+			cube[gate * nSlices + s] = fom(fitRatios(r1, nBins, lowRange, highRange),
+										   fitRatios(r2, nBins, lowRange, highRange));
+		}
+	});
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	for (int s = 0; s < nSlices; ++s) {
+		size_t best = nGates;
+		for (size_t g = 0; g < nGates; ++g) {
+			int t1 = grid.edge(g / nEdges), t2 = grid.edge(g % nEdges);
+			double f = cube[g * nSlices + s];
+			txtOut << edges[s] << " " << edges[s + 1] << " " << t1 << " " << t2 << " " << f << " "
+				   << counts[(g * nSlices + s) * 2] << " " << counts[(g * nSlices + s) * 2 + 1] << std::endl;
+			if (t1 < t2 && (best == nGates || f > cube[best * nSlices + s])) best = g;
+		}
+		if (best < nGates && cube[best * nSlices + s] > 0) {
+			std::cout << "Energy [" << edges[s] << ", " << edges[s + 1] << "): best t1=" << grid.edge(best / nEdges)
+					  << " t2=" << grid.edge(best % nEdges) << ", FOM = " << cube[best * nSlices + s] << std::endl;
+		} else {
+			std::cout << "Energy [" << edges[s] << ", " << edges[s + 1] << "): too few events" << std::endl;
+		}
+	}
+	std::cout << "Energy-resolved FOM written to " << outputName << std::endl;
+}
@@ -0,0 +1,334 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstdint>
+
+#include "pulseproc.h"
+#include "gatescan.h"
+#include "fisher.h"
+#include "prefetchreader.h"
+#include "psdclassifier.h"
+
+// Export a chosen discriminator as a standalone classifier (psdclassifier.h).
+//
+//   export_gate_classifier(file1, file2, start, t1, tail, t2)
+//   export_fisher_classifier(file1, file2, "fisher_weights.txt")
+//
+// Both take the two training datasets (class 0 and class 1) and write:
+//   outputName   a header with every constant baked in: baseline samples, CFD
+//                fraction, polarity and search window of the pulses, the gate
+//                or weights, and the Gaussian of each class's discriminant
+//                (fitted as qratio() fits it, or projected by fisher_train())
+//   eventsName   the first nBenchEvents pulses of each file as raw records for
+//                classifier_bench.cpp (int32 nEvents, int32 length, then per
+//                event an int32 class and length float samples)
+// The standalone discriminant of those pulses is checked against the one
+// computed from the aligned branch, as the ROOT macros do it.
+//
+// Build and run the benchmark with scripts/build_classifier.sh.
+
+// Samples searched before the earliest and after the latest training t0
+static const int kSearchLead = 20;
+static const int kSearchPeak = 300;
+
+// Search window of the training pulses: 0.1% to 99.9% of their t0
+static bool trainingWindow(const char* const files[2], double cfdFraction, PsdClassifierParams& p)
+{
+	std::string t0Name = Form("t0_cfd%.2f", cfdFraction);
+	std::vector<double> t0s;
+	for (int d = 0; d < 2; ++d) {
+		TreeHandle h;
+		if (!h.open(files[d], "adjustedTree")) return false;
+		if (!h.tree->GetBranch(t0Name.c_str())) {
+			std::cerr << "Error: no branch " << t0Name << " in " << files[d] << "; run t0() first" << std::endl;
+			return false;
+		}
+		double t0 = -1;
+		h.select(t0Name.c_str(), &t0);
+		Long64_t n = h.tree->GetEntries();
+		for (Long64_t i = 0; i < n; ++i) {
+			if (h.tree->GetEntry(i) <= 0) {
+				std::cerr << "Error reading " << files[d] << std::endl;
+				return false;
+			}
+			if (t0 >= 0) t0s.push_back(t0);
+		}
+	}
+	if (t0s.empty()) {
+		std::cerr << "No pulses with a CFD time in the training files" << std::endl;
+		return false;
+	}
+	size_t lo = static_cast<size_t>(0.001 * t0s.size());
+	size_t hi = std::min(t0s.size() - 1, static_cast<size_t>(0.999 * t0s.size()));
+	std::nth_element(t0s.begin(), t0s.begin() + lo, t0s.end());
+	double t0Low = t0s[lo];
+	std::nth_element(t0s.begin(), t0s.begin() + hi, t0s.end());
+	double t0High = t0s[hi];
+	p.searchBegin = std::max(p.baselineSamples, static_cast<int>(t0Low) - kSearchLead);
+	p.searchEnd = std::min(kNSamples, static_cast<int>(t0High) + 1 + kSearchPeak);
+	return true;
+}
+
+// Read the first nEvents records of each file, set the polarity from them,
+// compare the standalone discriminant with macroValue(aligned pulse) and
+// write them for the benchmark
+static bool exportEvents(const char* const files[2], const std::string& alignedBranch, int nEvents,
+						 const char* eventsName, PsdClassifierParams& p,
+						 const std::function<double(const double*)>& macroValue)
+{
+	std::vector<std::vector<double>> records;
+	std::vector<double> expected;
+	std::vector<int32_t> labels;
+	int nNegative = 0;
+	for (int d = 0; d < 2; ++d) {
+		PrefetchReader reader(files[d], "adjustedTree");
+		int inputIndex = reader.addBranch("baseline_adjusted");
+		int offsetIndex = reader.addBranch("roi_offset", true);
+		int alignedIndex = reader.addBranch(alignedBranch.c_str());
+		if (!reader.start(0, nEvents)) return false;
+		std::vector<double> aligned(kNSamples);
+		while (const EventBatch* batch = reader.next()) {
+			for (int b = 0; b < batch->size; ++b) {
+				records.emplace_back(kNSamples);
+				double* w = records.back().data();
+				int offset = reader.has(offsetIndex) ? static_cast<int>(*batch->get(offsetIndex, b)) : 0;
+				expandWindow(batch->get(inputIndex, b), reader.length(inputIndex), offset, w);
+				expandWindow(batch->get(alignedIndex, b), reader.length(alignedIndex), 0, aligned.data());
+				expected.push_back(macroValue(aligned.data()));
+				labels.push_back(d);
+				double threshold;
+				int j = cfdCrossing(w, kNSamples, p.cfdFraction, threshold);
+				if (j >= 0 && threshold < 0) ++nNegative;
+			}
+		}
+		if (reader.failed()) {
+			std::cerr << "Error reading " << files[d] << std::endl;
+			return false;
+		}
+	}
+	p.polarity = 2 * nNegative > static_cast<int>(records.size()) ? -1 : 1;
+
+	// Same discriminant as the macros, up to rounding, for pulses inside the window
+	int nAgree = 0, nCompared = 0;
+	for (size_t e = 0; e < records.size(); ++e) {
+		if (!std::isfinite(expected[e])) continue;
+		++nCompared;
+		PsdDecision dec = psdClassify(records[e].data(), kNSamples, p);
+		if (dec.cls >= 0 && std::fabs(dec.discriminant - expected[e]) <= 1e-6 * (1.0 + std::fabs(expected[e]))) {
+			++nAgree;
+		}
+	}
+	std::cout << "Standalone discriminant matches the macros for " << nAgree << " of " << nCompared
+			  << " exported pulses" << std::endl;
+
+	std::ofstream out(eventsName, std::ios::binary);
+	int32_t header[2] = {static_cast<int32_t>(records.size()), kNSamples};
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+	std::vector<float> samples(kNSamples);
+	for (size_t e = 0; e < records.size(); ++e) {
+		std::copy(records[e].begin(), records[e].end(), samples.begin());
+		out.write(reinterpret_cast<const char*>(&labels[e]), sizeof(int32_t));
+		out.write(reinterpret_cast<const char*>(samples.data()), kNSamples * sizeof(float));
+	}
+	if (!out.good()) {
+		std::cerr << "Error writing " << eventsName << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static std::string baseName(const char* path)
+{
+	std::string s = path;
+	size_t slash = s.rfind('/');
+	return slash == std::string::npos ? s : s.substr(slash + 1);
+}
+
+static bool writeParamsHeader(const char* outputName, const char* const files[2], const PsdClassifierParams& p,
+							  const std::vector<double>& weights, const std::string& origin, double expectedFom)
+{
+	std::ofstream out(outputName);
+	if (!out.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return false;
+	}
+	out << std::setprecision(17);
+	out << "// Generated by " << origin << "; do not edit.\n";
+	out << "// Class 0: " << files[0] << "\n// Class 1: " << files[1] << "\n";
+	out << "// Expected FOM: " << expectedFom << "\n";
+	out << "#ifndef PSD_CLASSIFIER_PARAMS_H\n#define PSD_CLASSIFIER_PARAMS_H\n\n";
+	out << "#include \"psdclassifier.h\"\n\n";
+	out << "static const char* const kPsdClassNames[2] = {\"" << baseName(files[0]) << "\", \""
+		<< baseName(files[1]) << "\"};\n";
+	if (!weights.empty()) {
+		out << "\nstatic const double kPsdExportedWeights[" << weights.size() << "] = {";
+		for (size_t k = 0; k < weights.size(); ++k) out << (k % 4 ? " " : "\n\t") << weights[k] << ",";
+		out << "\n};\n";
+	}
+	out << "\ninline PsdClassifierParams psdExportedParams()\n{\n";
+	out << "\tPsdClassifierParams p;\n";
+	out << "\tp.kind = " << (p.kind == kPsdGate ? "kPsdGate" : "kPsdWeights") << ";\n";
+	out << "\tp.baselineSamples = " << p.baselineSamples << ";\n";
+	out << "\tp.cfdFraction = " << p.cfdFraction << ";\n";
+	out << "\tp.polarity = " << p.polarity << ";\n";
+	out << "\tp.searchBegin = " << p.searchBegin << ";\n";
+	out << "\tp.searchEnd = " << p.searchEnd << ";\n";
+	out << "\tp.alignIndex = " << p.alignIndex << ";\n";
+	if (p.kind == kPsdGate) {
+		out << "\tp.start = " << p.start << ";\n\tp.t1 = " << p.t1 << ";\n";
+		out << "\tp.tail = " << p.tail << ";\n\tp.t2 = " << p.t2 << ";\n";
+	} else {
+		out << "\tp.weights = kPsdExportedWeights;\n";
+		out << "\tp.weightsBegin = " << p.weightsBegin << ";\n\tp.weightsEnd = " << p.weightsEnd << ";\n";
+		out << "\tp.weightsBin = " << p.weightsBin << ";\n";
+		out << "\tp.weightSum = " << p.weightSum << ";\n";
+		out << "\tp.normalise = " << (p.normalise ? "true" : "false") << ";\n";
+	}
+	for (int c = 0; c < 2; ++c) {
+		out << "\tp.mean[" << c << "] = " << p.mean[c] << ";\n\tp.sigma[" << c << "] = " << p.sigma[c] << ";\n";
+	}
+	out << "\treturn p;\n}\n\n#endif\n";
+	return out.good();
+}
+
+void export_gate_classifier(const char* fileLocation1, const char* fileLocation2,
+							int start = kAlignIndex, int t1 = 1300, int tail = -1, int t2 = 6100,
+							double cfdFraction = 0.1, const char* outputName = "psd_classifier_params.h",
+							const char* eventsName = "psd_classifier_events.bin", int nBenchEvents = 250,
+							int nBins = 500)
+{
+	if (tail < 0) tail = start;
+	if (start < 0 || start >= t1 || tail >= t2 || std::max(t1, t2) > kNSamples) {
+		std::cerr << "Invalid gate: start " << start << ", t1 " << t1 << ", tail " << tail << ", t2 " << t2 << std::endl;
+		return;
+	}
+	ROOT::EnableThreadSafety();
+	const char* files[2] = {fileLocation1, fileLocation2};
+	std::string alignedBranch = Form("t0aligned_cfd%.2f", cfdFraction);
+
+	PsdClassifierParams p;
+	p.kind = kPsdGate;
+	p.baselineSamples = kBaselineSamples;
+	p.cfdFraction = cfdFraction;
+	p.alignIndex = kAlignIndex;
+	p.start = start;
+	p.t1 = t1;
+	p.tail = tail;
+	p.t2 = t2;
+
+	// Gaussian of each class's Q2/Q1, binned and fitted as qratio() does
+	std::vector<int> points = {start, t1, tail, t2};
+	std::sort(points.begin(), points.end());
+	points.erase(std::unique(points.begin(), points.end()), points.end());
+	std::vector<double> ratios[2];
+	for (int d = 0; d < 2; ++d) {
+		CumulativeTable table;
+		if (!readCumulativeTable(files[d], alignedBranch.c_str(), points, table)) return;
+		collectRatios(table, table.index(start), table.index(t1), table.index(tail), table.index(t2), ratios[d]);
+	}
+	if (ratios[0].empty() || ratios[1].empty()) {
+		std::cerr << "No ratios for this gate" << std::endl;
+		return;
+	}
+	double lowRange, highRange;
+	pairRange(ratios[0], ratios[1], lowRange, highRange);
+	GateStats stats[2];
+	for (int d = 0; d < 2; ++d) {
+		stats[d] = fitRatios(ratios[d], nBins, lowRange, highRange);
+		if (!stats[d].valid || !(std::fabs(stats[d].sigma) > 0)) {
+			std::cerr << "Fit of " << files[d] << " failed" << std::endl;
+			return;
+		}
+		p.mean[d] = stats[d].mean;
+		p.sigma[d] = std::fabs(stats[d].sigma);
+	}
+	double expectedFom = fom(stats[0], stats[1]);
+
+	if (!trainingWindow(files, cfdFraction, p)) return;
+	auto macroValue = [&](const double* pulse) {
+		double q1 = 0.0, q2 = 0.0;
+		for (int j = start; j < t1; ++j) q1 += pulse[j];
+		for (int j = tail; j < t2; ++j) q2 += pulse[j];
+		return q1 != 0.0 ? q2 / q1 : NAN;
+	};
+	if (!exportEvents(files, alignedBranch, nBenchEvents, eventsName, p, macroValue)) return;
+	if (!writeParamsHeader(outputName, files, p, std::vector<double>(),
+						   Form("export_gate_classifier(start %d, t1 %d, tail %d, t2 %d)", start, t1, tail, t2),
+						   expectedFom)) return;
+
+	std::cout << "Q2/Q1: " << p.mean[0] << " +- " << p.sigma[0] << " vs " << p.mean[1] << " +- " << p.sigma[1]
+			  << ", FOM " << expectedFom << std::endl;
+	std::cout << "Pulses searched in record samples [" << p.searchBegin << ", " << p.searchEnd << "), polarity "
+			  << p.polarity << std::endl;
+	std::cout << "Classifier written to " << outputName << ", benchmark events to " << eventsName << std::endl;
+}
+
+void export_fisher_classifier(const char* fileLocation1, const char* fileLocation2,
+							  const char* weightsFile = "fisher_weights.txt", double cfdFraction = 0.1,
+							  const char* outputName = "psd_classifier_params.h",
+							  const char* eventsName = "psd_classifier_events.bin", int nBenchEvents = 250)
+{
+	FisherWeightsFile fw;
+	if (!readFisherWeights(weightsFile, fw)) return;
+	if (!fw.hasModel || !(fw.sigma[0] > 0) || !(fw.sigma[1] > 0) || fw.end > kNSamples) {
+		std::cerr << "No class model in " << weightsFile << "; rerun fisher_train()" << std::endl;
+		return;
+	}
+	ROOT::EnableThreadSafety();
+	const char* files[2] = {fileLocation1, fileLocation2};
+	std::string alignedBranch = Form("t0aligned_cfd%.2f", cfdFraction);
+
+	PsdClassifierParams p;
+	p.kind = kPsdWeights;
+	p.baselineSamples = kBaselineSamples;
+	p.cfdFraction = cfdFraction;
+	p.alignIndex = kAlignIndex;
+	// fisher_train() weights are constant within each bin, so one weight per
+	// bin; any file that is not falls back to bins of one sample. The
+	// classifier multiplies in float, so the weights are rounded to float and
+	// the check below uses the same ones.
+	int width = std::max(1, fw.binWidth);
+	for (int j = fw.start; j < fw.end && width > 1; ++j) {
+		if (fw.weights[j - fw.start] != fw.weights[j - fw.start - (j - fw.start) % width]) width = 1;
+	}
+	std::vector<double> weights;
+	for (int j = fw.start; j < fw.end; j += width) weights.push_back(static_cast<float>(fw.weights[j - fw.start]));
+	p.weights = weights.data();
+	p.weightsBegin = fw.start;
+	p.weightsEnd = fw.end;
+	p.weightsBin = width;
+	p.weightSum = 0.0;
+	for (int j = fw.start; j < fw.end; ++j) p.weightSum += weights[(j - fw.start) / width];
+	p.normalise = fw.normalise;
+	for (int c = 0; c < 2; ++c) {
+		p.mean[c] = fw.mean[c];
+		p.sigma[c] = fw.sigma[c];
+	}
+
+	if (!trainingWindow(files, cfdFraction, p)) return;
+	auto macroValue = [&](const double* pulse) {
+		double dot = 0.0, total = 0.0;
+		for (int j = fw.start; j < fw.end; ++j) {
+			dot += weights[(j - fw.start) / width] * pulse[j];
+			total += pulse[j];
+		}
+		return fw.normalise ? (total != 0.0 ? dot / total : 0.0) : dot;
+	};
+	if (!exportEvents(files, alignedBranch, nBenchEvents, eventsName, p, macroValue)) return;
+	if (!writeParamsHeader(outputName, files, p, weights, Form("export_fisher_classifier(%s)", weightsFile),
+						   fw.fom)) return;
+
+	std::cout << "Discriminant: " << p.mean[0] << " +- " << p.sigma[0] << " vs " << p.mean[1] << " +- "
+			  << p.sigma[1] << ", expected FOM " << fw.fom << std::endl;
+	std::cout << "Pulses searched in record samples [" << p.searchBegin << ", " << p.searchEnd << "), polarity "
+			  << p.polarity << std::endl;
+	std::cout << "Classifier written to " << outputName << ", benchmark events to " << eventsName << std::endl;
+}
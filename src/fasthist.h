@@ -0,0 +1,173 @@
+#ifndef FASTHIST_H
+#define FASTHIST_H
+
+#include "TH1D.h"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "threadpool.h"
+#include "reduce.h"
+
+// Fixed-width histogram for the scan loops.
+// TH1D::Fill is a virtual call per value with axis lookup and statistics
+// updates; here values are binned a block at a time with a branch-free index
+// computation the compiler can vectorise, then counted in a second pass.
+// Convert with toTH1D() only when a plot or fit needs a ROOT histogram.
+
+struct FastHist {
+	int nBins = 0;
+	double low = 0.0;
+	double high = 0.0;
+	double scale = 0.0;              // nBins / (high - low)
+	std::vector<double> counts;      // [0] underflow, [1..nBins], [nBins+1] overflow
+	std::vector<double> sumw2;       // per-bin sum of squared weights, empty until a weighted fill
+	double entries = 0.0;
+	// In-range statistics, as TH1 keeps them: sumw, sumw2, sumwx, sumwx2
+	double stats[4] = {0.0, 0.0, 0.0, 0.0};
+
+	FastHist() {}
+	FastHist(int n, double lo, double hi) { reset(n, lo, hi); }
+
+	void reset(int n, double lo, double hi)
+	{
+		nBins = n;
+		low = lo;
+		high = hi;
+		scale = nBins / (high - low);
+		counts.assign(nBins + 2, 0.0);
+		sumw2.clear();
+		entries = 0.0;
+		std::fill(stats, stats + 4, 0.0);
+	}
+
+	// Bin number with TAxis::FindBin conventions (NaN goes to overflow)
+	int bin(double x) const
+	{
+		if (x < low) return 0;
+		if (!(x < high)) return nBins + 1;
+		return 1 + static_cast<int>((x - low) * scale);
+	}
+
+	void fill(const double* x, size_t n)
+	{
+		static const size_t kBlock = 256;
+		int idx[kBlock];
+		for (size_t start = 0; start < n; start += kBlock) {
+			size_t m = std::min(kBlock, n - start);
+			const double* xb = x + start;
+			double sw = 0.0, swx = 0.0, swx2 = 0.0;
+
+			// Index pass: no calls, no early exits, vectorisable
+			for (size_t k = 0; k < m; ++k) {
+				double v = xb[k];
+				bool inRange = (v >= low) && (v < high);
+				double t = inRange ? (v - low) * scale : 0.0;
+				int b = 1 + static_cast<int>(t);
+				b = inRange ? std::min(b, nBins) : (v < low ? 0 : nBins + 1);
+				idx[k] = b;
+				double w = inRange ? 1.0 : 0.0;
+				double vv = inRange ? v : 0.0;
+				sw += w;
+				swx += vv;
+				swx2 += vv * vv;
+			}
+			// Count pass
+			for (size_t k = 0; k < m; ++k) {
+				counts[idx[k]] += 1.0;
+			}
+
+			stats[0] += sw;
+			stats[1] += sw;
+			stats[2] += swx;
+			stats[3] += swx2;
+			entries += m;
+		}
+	}
+
+	void fill(const std::vector<double>& x) { fill(x.data(), x.size()); }
+
+	// Weighted fill, e.g. for bootstrap replicas. Bin errors become sqrt(sum w^2),
+	// as after TH1::Sumw2(); unit weights filled so far count 1 each.
+	void fill(const double* x, const double* w, size_t n)
+	{
+		if (sumw2.empty()) sumw2 = counts;
+		for (size_t k = 0; k < n; ++k) {
+			double v = x[k];
+			bool inRange = (v >= low) && (v < high);
+			int b = inRange ? std::min(1 + static_cast<int>((v - low) * scale), nBins) : (v < low ? 0 : nBins + 1);
+			counts[b] += w[k];
+			sumw2[b] += w[k] * w[k];
+			double wk = inRange ? w[k] : 0.0;
+			double vv = inRange ? v : 0.0;
+			stats[0] += wk;
+			stats[1] += wk * wk;
+			stats[2] += wk * vv;
+			stats[3] += wk * vv * vv;
+		}
+		entries += n;
+	}
+
+	// Histograms must have the same binning
+	void merge(const FastHist& other)
+	{
+		if (!other.sumw2.empty() && sumw2.empty()) sumw2 = counts;
+		if (!sumw2.empty()) {
+			const std::vector<double>& add = other.sumw2.empty() ? other.counts : other.sumw2;
+			for (size_t b = 0; b < sumw2.size(); ++b) sumw2[b] += add[b];
+		}
+		for (size_t b = 0; b < counts.size(); ++b) counts[b] += other.counts[b];
+		for (int s = 0; s < 4; ++s) stats[s] += other.stats[s];
+		entries += other.entries;
+	}
+
+	double maximum() const { return nBins > 0 ? *std::max_element(counts.begin() + 1, counts.end() - 1) : 0.0; }
+	double mean() const { return stats[0] > 0 ? stats[2] / stats[0] : 0.0; }
+	double rms() const
+	{
+		if (stats[0] <= 0) return 0.0;
+		double m = mean();
+		double v = stats[3] / stats[0] - m * m;
+		return v > 0 ? std::sqrt(v) : 0.0;
+	}
+
+	// Copy into a TH1D (not attached to any directory) for fitting or drawing
+	TH1D* toTH1D(const char* name, const char* title = "") const
+	{
+		TH1D* h = new TH1D(name, title, nBins, low, high);
+		h->SetDirectory(nullptr);
+		for (int b = 0; b < nBins + 2; ++b) {
+			h->SetBinContent(b, counts[b]);
+		}
+		if (!sumw2.empty()) {
+			h->Sumw2();
+			for (int b = 0; b < nBins + 2; ++b) {
+				h->SetBinError(b, std::sqrt(sumw2[b]));
+			}
+		}
+		double st[4] = {stats[0], stats[1], stats[2], stats[3]};
+		h->PutStats(st);
+		h->SetEntries(entries);
+		return h;
+	}
+};
+
+// Fill from several threads: the values are binned in fixed blocks of
+// kFillChunk into sub-histograms, merged in a fixed pairwise order (see
+// reduce.h), so the statistics are the same bits for any thread count.
+inline void fillParallel(FastHist& h, const double* x, size_t n, unsigned int nThreads = 0)
+{
+	static const size_t kFillChunk = 1 << 16;
+	FastHist sum;
+	bool filled = deterministicReduce(
+		n, kFillChunk, nThreads,
+		[&](size_t begin, size_t end) {
+			FastHist part(h.nBins, h.low, h.high);
+			part.fill(x + begin, end - begin);
+			return part;
+		},
+		[](FastHist& a, const FastHist& b) { a.merge(b); }, sum);
+	if (filled) h.merge(sum);
+}
+
+#endif
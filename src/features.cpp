@@ -0,0 +1,90 @@
+#include "TFile.h"
+#include "TTree.h"
+#include <iostream>
+#include <string>
+
+#include "pulseproc.h"
+#include "pulsefeatures.h"
+#include "prefetchreader.h"
+#include "incremental.h"
+
+// Pulse-shape features of every aligned pulse in one read of the file,
+// written as scalar branches psd_<name> (see pulsefeatures.h), e.g.
+//   features("degrees_10_adjusted.root", "rise,tailtotal,tot")
+// The branches can be compared between datasets with func_hist().
+// incremental: if the branches exist, process only the entries after the
+// ones they already hold (see incremental.h).
+void features(const char* fileLocation, const char* featureList = "all",
+			  const char* branch = "t0aligned_cfd0.10",
+			  int tailStart = 1300, int end = 6100, double totFraction = 0.2, bool incremental = false)
+{
+	FeatureConfig cfg;
+	if (!cfg.select(featureList)) {
+		std::cerr << "Unknown feature in list: " << featureList << std::endl;
+		return;
+	}
+	cfg.tailStart = tailStart;
+	cfg.end = end;
+	cfg.totFraction = totFraction;
+	if (cfg.start < 0 || cfg.start > cfg.tailStart || cfg.tailStart >= cfg.end || cfg.end > kNSamples) {
+		std::cerr << "Invalid feature window [" << cfg.start << ", " << cfg.end << ") with tail from "
+				  << cfg.tailStart << std::endl;
+		return;
+	}
+
+	TFile* file = TFile::Open(fileLocation, "UPDATE");
+	if (!file || file->IsZombie()) {
+		std::cerr << "Error opening file: " << fileLocation << std::endl;
+		return;
+	}
+	TTree* tree = dynamic_cast<TTree*>(file->Get("adjustedTree"));
+	if (!tree) {
+		std::cerr << "Error getting tree" << std::endl;
+		file->Close();
+		return;
+	}
+
+	if (!branchComplete(tree, branch)) {
+		file->Close();
+		return;
+	}
+	double values[kNFeatures] = {0};
+	StageBranches outputs(tree);
+	std::cout << "Creating branches:";
+	for (int f = 0; f < kNFeatures; ++f) {
+		if (!cfg.enabled[f]) continue;
+		std::string name = std::string("psd_") + kFeatureNames[f];
+		outputs.add(name, &values[f], name + "/D");
+		std::cout << " " << name;
+	}
+	std::cout << std::endl;
+	Long64_t firstEntry = outputs.open(incremental);
+
+	// Pulses are read ahead on a separate read-only handle
+	PrefetchReader reader(fileLocation, "adjustedTree");
+	int alignedIndex = reader.addBranch(branch);
+	if (!reader.start(firstEntry)) {
+		file->Close();
+		return;
+	}
+
+	std::vector<double> pulse(kNSamples);
+	while (const EventBatch* batch = reader.next()) {
+		for (int b = 0; b < batch->size; ++b) {
+			expandWindow(batch->get(alignedIndex, b), reader.length(alignedIndex), 0, pulse.data());
+			pulseFeatures(pulse.data(), cfg, values);
+			outputs.fill();
+		}
+	}
+	if (reader.failed()) {
+		std::cerr << "Error reading " << fileLocation << "; no branches written" << std::endl;
+		file->Close();
+		return;
+	}
+
+	outputs.commit();
+	tree->Write("", TObject::kOverwrite);
+	file->Close();
+
+	std::cout << "Pulse features written for " << reader.entries() << " events." << std::endl;
+}
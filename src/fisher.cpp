@@ -0,0 +1,165 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "gatescan.h"
+#include "fisher.h"
+#include "threadpool.h"
+#include "prefetchreader.h"
+#include "incremental.h"
+
+// Gate weights from the Fisher discriminant of two reference datasets,
+// instead of a scan over box gates (see fisher.h).
+//
+// fisher_train() reads the aligned pulses of both files once (the two in
+// parallel), accumulating the mean and covariance of their binned shapes,
+// and solves for the bin weights. The weights are written per sample,
+// together with the window and the expected FOM: the projected class means
+// and widths give (mu1 - mu2) / (2.355 (sigma1 + sigma2)), as qratio() would
+// measure it on Gaussian distributions.
+//
+// fisher_apply() writes the discriminant of every pulse of a file as a scalar
+// branch, one dot product per event, so its FOM can be measured with
+// func_hist():
+//   fisher_train("degrees_10_adjusted.root", "degrees_30_adjusted.root");
+//   fisher_apply("degrees_10_adjusted.root"); fisher_apply("degrees_30_adjusted.root");
+//   func_hist("degrees_10_adjusted.root", "degrees_30_adjusted.root", "fisher", true, 500, lo, hi);
+// with lo, hi around the discriminant means fisher_train() prints.
+
+void fisher_train(const char* fileLocation1, const char* fileLocation2,
+				  const char* branch = "t0aligned_cfd0.10",
+				  int start = kAlignIndex, int end = 6100, int binWidth = 50, bool normalise = true,
+				  double ridge = 1e-3, const char* outputName = "fisher_weights.txt", unsigned int nThreads = 0)
+{
+	if (start < 0 || end <= start || end > kNSamples || binWidth <= 0) {
+		std::cerr << "Invalid window [" << start << ", " << end << ") or bin width " << binWidth << std::endl;
+		return;
+	}
+	ROOT::EnableThreadSafety();
+	const int nBins = (end - start + binWidth - 1) / binWidth;
+
+	const char* files[2] = {fileLocation1, fileLocation2};
+	ClassMoments moments[2];
+	std::vector<char> readOk(2, 0);
+	std::cout << "Training on " << nBins << " bins of " << binWidth << " samples over [" << start << ", " << end
+			  << ")..." << std::endl;
+	parallelFor(2, nThreads, [&](size_t d, unsigned int) {
+		moments[d].reset(nBins);
+		std::vector<double> x(nBins);
+		readOk[d] = forEachAlignedPulse(files[d], branch, end, 0, -1, [](Long64_t) {},
+										[&](Long64_t, const double* pulse) {
+			if (binnedShape(pulse, start, end, binWidth, normalise, x.data())) moments[d].add(x.data());
+		});
+	});
+	if (!readOk[0] || !readOk[1]) return;
+
+	std::vector<double> weights;
+	double mu[2], sigma[2];
+	if (!fisherWeights(moments[0], moments[1], ridge, weights, mu, sigma)) {
+		std::cerr << "Fisher solve failed (" << moments[0].n << " and " << moments[1].n
+				  << " pulses); try a larger ridge or bin width" << std::endl;
+		return;
+	}
+	double expectedFom = (mu[0] - mu[1]) / (2.355 * (sigma[0] + sigma[1]));
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	txtOut << "# start " << start << " end " << end << " binWidth " << binWidth << " normalise " << normalise
+		   << " fom " << expectedFom << " mean " << mu[0] << " " << mu[1] << " sigma " << sigma[0] << " " << sigma[1]
+		   << "\n";
+	txtOut << "sample weight\n";
+	for (int j = start; j < end; ++j) txtOut << j << " " << weights[(j - start) / binWidth] << "\n";
+	txtOut.close();
+
+	std::cout << "Pulses: " << moments[0].n << " and " << moments[1].n << std::endl;
+	std::cout << "Discriminant: " << mu[0] << " +- " << sigma[0] << " vs " << mu[1] << " +- " << sigma[1]
+			  << ", expected FOM " << expectedFom << std::endl;
+	std::cout << "Weights written to " << outputName << std::endl;
+}
+
+// Discriminant branch for every pulse of fileLocation (0 for pulses with no
+// charge in the window when normalised)
+// incremental: if the branch exists, process only the entries after the ones
+// it already holds (see incremental.h).
+void fisher_apply(const char* fileLocation, const char* weightsFile = "fisher_weights.txt",
+				  const char* branch = "t0aligned_cfd0.10", const char* outputBranch = "fisher",
+				  bool incremental = false)
+{
+	FisherWeightsFile fw;
+	if (!readFisherWeights(weightsFile, fw)) return;
+	if (fw.end > kNSamples) {
+		std::cerr << "Weights window ends beyond the record: " << fw.end << std::endl;
+		return;
+	}
+	const int start = fw.start, end = fw.end;
+	const bool normalise = fw.normalise;
+	const std::vector<double>& weights = fw.weights;
+
+	TFile* file = TFile::Open(fileLocation, "UPDATE");
+	if (!file || file->IsZombie()) {
+		std::cerr << "Error opening file: " << fileLocation << std::endl;
+		return;
+	}
+	TTree* tree = dynamic_cast<TTree*>(file->Get("adjustedTree"));
+	if (!tree) {
+		std::cerr << "Error getting tree" << std::endl;
+		file->Close();
+		return;
+	}
+
+	if (!branchComplete(tree, branch)) {
+		file->Close();
+		return;
+	}
+	double value = 0.0;
+	StageBranches outputs(tree);
+	outputs.add(outputBranch, &value, Form("%s/D", outputBranch));
+	Long64_t firstEntry = outputs.open(incremental);
+
+	PrefetchReader reader(fileLocation, "adjustedTree");
+	int alignedIndex = reader.addBranch(branch);
+	if (!reader.start(firstEntry)) {
+		file->Close();
+		return;
+	}
+
+	std::vector<double> pulse(kNSamples);
+	Long64_t nZero = 0;
+	while (const EventBatch* batch = reader.next()) {
+		for (int b = 0; b < batch->size; ++b) {
+			expandWindow(batch->get(alignedIndex, b), reader.length(alignedIndex), 0, pulse.data());
+			double dot = 0.0, total = 0.0;
+			for (int j = start; j < end; ++j) {
+				dot += weights[j - start] * pulse[j];
+				total += pulse[j];
+			}
+			if (normalise) {
+				if (total == 0.0) ++nZero;
+				value = total != 0.0 ? dot / total : 0.0;
+			} else {
+				value = dot;
+			}
+			outputs.fill();
+		}
+	}
+	if (reader.failed()) {
+		std::cerr << "Error reading " << fileLocation << "; no branches written" << std::endl;
+		file->Close();
+		return;
+	}
+
+	outputs.commit();
+	tree->Write("", TObject::kOverwrite);
+	file->Close();
+
+	std::cout << "Branch " << outputBranch << " written for " << reader.entries() << " events";
+	if (nZero > 0) std::cout << " (" << nZero << " with no charge in the window)";
+	std::cout << "." << std::endl;
+}
@@ -0,0 +1,211 @@
+#ifndef FISHER_H
+#define FISHER_H
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Fisher linear discriminant on binned pulse shapes.
+//
+// An aligned pulse is reduced to the charge in bins of binWidth samples over
+// [start, end), divided by the total charge in that window when normalised
+// (so the discriminant, like Q2/Q1, does not depend on the pulse height).
+// ClassMoments collects the mean and covariance of these vectors for one
+// dataset in a single pass; fisherWeights() solves
+//   (S1 + S2 + ridge) w = m1 - m2
+// for the bin weights that best separate the two means relative to their
+// spread. The discriminant of a pulse is then the dot product of the weights
+// with its (normalised) samples, a qdc()-style weighted gate.
+
+// Bin charges of pulse over [start, end); false if normalised and the total is 0
+inline bool binnedShape(const double* pulse, int start, int end, int binWidth, bool normalise, double* x)
+{
+	int nBins = (end - start + binWidth - 1) / binWidth;
+	double total = 0.0;
+	for (int b = 0; b < nBins; ++b) {
+		double sum = 0.0;
+		for (int j = start + b * binWidth; j < std::min(end, start + (b + 1) * binWidth); ++j) sum += pulse[j];
+		x[b] = sum;
+		total += sum;
+	}
+	if (!normalise) return true;
+	if (total == 0.0 || !std::isfinite(total)) return false;
+	for (int b = 0; b < nBins; ++b) x[b] /= total;
+	return true;
+}
+
+// Count, mean and covariance of vectors of length dim. Sums are taken about
+// the first vector added, which keeps the covariance accurate when the
+// spread is small next to the mean.
+struct ClassMoments {
+	int dim = 0;
+	double n = 0.0;
+	std::vector<double> shift, sum, outer;   // outer: dim x dim, upper triangle
+
+	void reset(int d)
+	{
+		dim = d;
+		n = 0.0;
+		shift.assign(d, 0.0);
+		sum.assign(d, 0.0);
+		outer.assign(size_t(d) * d, 0.0);
+	}
+
+	void add(const double* x)
+	{
+		if (n == 0.0) std::copy(x, x + dim, shift.begin());
+		n += 1.0;
+		for (int a = 0; a < dim; ++a) {
+			double da = x[a] - shift[a];
+			sum[a] += da;
+			double* row = &outer[size_t(a) * dim];
+			for (int b = a; b < dim; ++b) row[b] += da * (x[b] - shift[b]);
+		}
+	}
+
+	double mean(int a) const { return shift[a] + sum[a] / n; }
+
+	// Population covariance, full symmetric matrix
+	void covariance(std::vector<double>& c) const
+	{
+		c.assign(size_t(dim) * dim, 0.0);
+		for (int a = 0; a < dim; ++a) {
+			for (int b = a; b < dim; ++b) {
+				double v = outer[size_t(a) * dim + b] / n - (sum[a] / n) * (sum[b] / n);
+				c[size_t(a) * dim + b] = v;
+				c[size_t(b) * dim + a] = v;
+			}
+		}
+	}
+};
+
+// Solve a x = b for symmetric positive definite a (n x n, overwritten by its
+// Cholesky factor); b is replaced by x. False if a is not positive definite.
+inline bool choleskySolve(std::vector<double>& a, int n, std::vector<double>& b)
+{
+	for (int j = 0; j < n; ++j) {
+		double d = a[size_t(j) * n + j];
+		for (int k = 0; k < j; ++k) d -= a[size_t(j) * n + k] * a[size_t(j) * n + k];
+		if (!(d > 0.0)) return false;
+		d = std::sqrt(d);
+		a[size_t(j) * n + j] = d;
+		for (int i = j + 1; i < n; ++i) {
+			double s = a[size_t(i) * n + j];
+			for (int k = 0; k < j; ++k) s -= a[size_t(i) * n + k] * a[size_t(j) * n + k];
+			a[size_t(i) * n + j] = s / d;
+		}
+	}
+	for (int i = 0; i < n; ++i) {
+		double s = b[i];
+		for (int k = 0; k < i; ++k) s -= a[size_t(i) * n + k] * b[k];
+		b[i] = s / a[size_t(i) * n + i];
+	}
+	for (int i = n - 1; i >= 0; --i) {
+		double s = b[i];
+		for (int k = i + 1; k < n; ++k) s -= a[size_t(k) * n + i] * b[k];
+		b[i] = s / a[size_t(i) * n + i];
+	}
+	return true;
+}
+
+// Discriminant mean and width of one class for weights w
+inline void projectMoments(const ClassMoments& m, const std::vector<double>& cov, const std::vector<double>& w,
+						   double& mu, double& sigma)
+{
+	const int d = m.dim;
+	mu = 0.0;
+	double var = 0.0;
+	for (int a = 0; a < d; ++a) {
+		mu += w[a] * m.mean(a);
+		double cw = 0.0;
+		for (int b = 0; b < d; ++b) cw += cov[size_t(a) * d + b] * w[b];
+		var += w[a] * cw;
+	}
+	sigma = var > 0 ? std::sqrt(var) : 0.0;
+}
+
+// Fisher weights separating class 1 from class 2, unit length and signed so
+// class 1 projects higher. ridge is added to the diagonal in units of the mean
+// variance; it keeps the solve stable when bins are (nearly) dependent, as
+// normalised bins always are. mu/sigma: projected mean and width per class.
+inline bool fisherWeights(const ClassMoments& c1, const ClassMoments& c2, double ridge, std::vector<double>& w,
+						  double mu[2], double sigma[2])
+{
+	const int d = c1.dim;
+	if (d <= 0 || c2.dim != d || c1.n < 2 || c2.n < 2) return false;
+
+	std::vector<double> cov1, cov2;
+	c1.covariance(cov1);
+	c2.covariance(cov2);
+	std::vector<double> scatter(size_t(d) * d);
+	double trace = 0.0;
+	for (size_t k = 0; k < scatter.size(); ++k) scatter[k] = cov1[k] + cov2[k];
+	for (int a = 0; a < d; ++a) trace += scatter[size_t(a) * d + a];
+	double lambda = std::max(ridge, 1e-12) * (trace > 0 ? trace / d : 1.0);
+	for (int a = 0; a < d; ++a) scatter[size_t(a) * d + a] += lambda;
+
+	w.resize(d);
+	for (int a = 0; a < d; ++a) w[a] = c1.mean(a) - c2.mean(a);
+	if (!choleskySolve(scatter, d, w)) return false;
+
+	double norm = 0.0;
+	for (double v : w) norm += v * v;
+	norm = std::sqrt(norm);
+	if (!(norm > 0.0)) return false;
+	for (double& v : w) v /= norm;
+
+	projectMoments(c1, cov1, w, mu[0], sigma[0]);
+	projectMoments(c2, cov2, w, mu[1], sigma[1]);
+	if (mu[0] < mu[1]) {
+		for (double& v : w) v = -v;
+		mu[0] = -mu[0];
+		mu[1] = -mu[1];
+	}
+	return true;
+}
+
+// Weights file written by fisher_train(): the window, the per-sample weights
+// and the projected class means and widths it expects
+struct FisherWeightsFile {
+	int start = 0, end = 0, binWidth = 0;
+	bool normalise = true;
+	double fom = 0.0;
+	bool hasModel = false;        // mean and sigma given (older files have only the fom)
+	double mean[2] = {0.0, 0.0};
+	double sigma[2] = {0.0, 0.0};
+	std::vector<double> weights;  // weights[j - start]
+};
+
+inline bool readFisherWeights(const char* weightsFile, FisherWeightsFile& fw)
+{
+	std::ifstream in(weightsFile);
+	if (!in.is_open()) {
+		std::cerr << "Failed to open " << weightsFile << std::endl;
+		return false;
+	}
+	std::string line;
+	int norm = 0;
+	int nRead = std::getline(in, line) ? std::sscanf(line.c_str(),
+		"# start %d end %d binWidth %d normalise %d fom %lf mean %lf %lf sigma %lf %lf", &fw.start, &fw.end,
+		&fw.binWidth, &norm, &fw.fom, &fw.mean[0], &fw.mean[1], &fw.sigma[0], &fw.sigma[1]) : 0;
+	if (nRead < 4 || fw.start < 0 || fw.end <= fw.start) {
+		std::cerr << "Invalid weights header in " << weightsFile << std::endl;
+		return false;
+	}
+	fw.normalise = norm != 0;
+	fw.hasModel = nRead == 9;
+	std::getline(in, line);
+	fw.weights.assign(fw.end - fw.start, 0.0);
+	int sample;
+	double w;
+	while (in >> sample >> w) {
+		if (sample >= fw.start && sample < fw.end) fw.weights[sample - fw.start] = w;
+	}
+	return true;
+}
+
+#endif
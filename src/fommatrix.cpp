@@ -0,0 +1,178 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "gatescan.h"
+#include "threadpool.h"
+#include "prefetchreader.h"
+#include "incremental.h"
+
+// FOM of every gate of the grid (output.txt, "t1 t2 fom" as gatematrix writes
+// it) from histograms that can be extended as runs are appended.
+//
+// The Q2/Q1 distribution of each gate and dataset is kept binned in
+// outputName.state (see incremental.h), with the range qratio() picks from
+// the data of the first run. With incremental, only the entries added to the
+// files since then are reduced to edge charges and binned into the stored
+// histograms, and every gate is refitted from the merged histograms: adding
+// an hour of data reads an hour of pulses. The ranges stay those of the first
+// run; if the new data moves a noticeable share of a gate's ratios outside
+// them, run once without incremental to re-bin everything.
+
+// Stored histogram: low, high, entries, the 4 statistics, then the counts
+static const int kHistHeader = 7;
+
+static void packHist(const FastHist& h, double* out)
+{
+	out[0] = h.low;
+	out[1] = h.high;
+	out[2] = h.entries;
+	std::copy(h.stats, h.stats + 4, out + 3);
+	std::copy(h.counts.begin(), h.counts.end(), out + kHistHeader);
+}
+
+static void unpackHist(const double* in, int nBins, FastHist& h)
+{
+	h.reset(nBins, in[0], in[1]);
+	h.entries = in[2];
+	std::copy(in + 3, in + 7, h.stats);
+	std::copy(in + kHistHeader, in + kHistHeader + nBins + 2, h.counts.begin());
+}
+
+// Entries of the adjusted tree, or -1 if it cannot be read or branch has not
+// been extended to all of them
+static Long64_t adjustedEntries(const char* fileLocation, const char* branch)
+{
+	TreeHandle handle;
+	if (!handle.open(fileLocation, "adjustedTree")) return -1;
+	if (!handle.tree->GetBranch(branch)) {
+		std::cerr << "Error: no branch " << branch << " in " << fileLocation << std::endl;
+		return -1;
+	}
+	return branchComplete(handle.tree, branch) ? handle.tree->GetEntries() : -1;
+}
+
+void fommatrix(const char* fileLocation1, const char* fileLocation2, bool incremental = false,
+			   const char* branch = "t0aligned_cfd0.10", int nBins = 500, unsigned int nThreads = 0,
+			   const char* outputName = "output.txt")
+{
+	ROOT::EnableThreadSafety();
+
+	GateGrid grid;
+	const int nEdges = grid.nSteps;
+	std::vector<std::pair<int, int>> gates;
+	for (int i1 = 0; i1 < nEdges; ++i1) {
+		for (int i2 = 0; i2 < nEdges; ++i2) {
+			if (grid.edge(i1) < grid.edge(i2)) gates.emplace_back(i1, i2);
+		}
+	}
+	const size_t histSize = kHistHeader + nBins + 2;
+
+	const char* files[2] = {fileLocation1, fileLocation2};
+	Long64_t nEntries[2];
+	for (int d = 0; d < 2; ++d) {
+		nEntries[d] = adjustedEntries(files[d], branch);
+		if (nEntries[d] < 0) return;
+	}
+
+	// Histograms of the entries already binned, if they can be extended
+	const std::string statePath = std::string(outputName) + ".state";
+	const std::string id1 = fileIdentity(fileLocation1), id2 = fileIdentity(fileLocation2);
+	SummaryState state(Form("fommatrix %s %s %s %s branch %s bins %d grid %d %d %d %d", fileLocation1, id1.c_str(),
+							fileLocation2, id2.c_str(), branch, nBins, grid.t0, grid.tMin, grid.tMax, grid.nSteps));
+	Long64_t firstEntry[2] = {0, 0};
+	bool extending = incremental && state.load(statePath);
+	for (int d = 0; d < 2 && extending; ++d) {
+		extending = state.array(Form("hist%d", d)).size() == gates.size() * histSize &&
+					state.watermark(files[d]) <= nEntries[d];
+	}
+	if (extending) {
+		for (int d = 0; d < 2; ++d) firstEntry[d] = state.watermark(files[d]);
+		std::cout << "Adding entries " << firstEntry[0] << "-" << nEntries[0] << " and " << firstEntry[1] << "-"
+				  << nEntries[1] << " to the stored histograms" << std::endl;
+	} else {
+		for (int d = 0; d < 2; ++d) state.array(Form("hist%d", d)).assign(gates.size() * histSize, 0.0);
+	}
+
+	// Edge charges of the new entries only
+	ChargeTable tables[2];
+	std::vector<char> readOk(2, 0);
+	parallelFor(2, nThreads, [&](size_t d, unsigned int) {
+		readOk[d] = readChargeTable(files[d], branch, grid, tables[d], firstEntry[d], nEntries[d]);
+	});
+	if (!readOk[0] || !readOk[1]) return;
+
+	std::cout << "Binning " << tables[0].nEvents << " + " << tables[1].nEvents << " new events into "
+			  << gates.size() << " gates on " << workerCount(nThreads) << " threads..." << std::endl;
+
+	std::vector<double>* hists[2] = {&state.array("hist0"), &state.array("hist1")};
+	std::vector<double> foms(gates.size(), 0.0);
+	std::vector<double> outside(gates.size(), 0.0);
+	parallelFor(gates.size(), nThreads, [&](size_t g, unsigned int) {
+		std::vector<double> ratios[2];
+		for (int d = 0; d < 2; ++d) collectRatios(tables[d], gates[g].first, gates[g].second, ratios[d]);
+
+		FastHist h[2];
+		double newOutside = 0.0, newTotal = 0.0;
+		for (int d = 0; d < 2; ++d) {
+			double* stored = &(*hists[d])[g * histSize];
+			if (extending) {
+				unpackHist(stored, nBins, h[d]);
+			} else if (d == 0) {
+				double lowRange = 0.0, highRange = 0.0;
+				if (!ratios[0].empty() && !ratios[1].empty()) pairRange(ratios[0], ratios[1], lowRange, highRange);
+				h[0].reset(nBins, lowRange, highRange);
+				h[1].reset(nBins, lowRange, highRange);
+			}
+			FastHist added(nBins, h[d].low, h[d].high);
+			if (h[d].high > h[d].low) added.fill(ratios[d]);
+			newOutside += added.counts[0] + added.counts[nBins + 1];
+			newTotal += added.entries;
+			h[d].merge(added);
+			packHist(h[d], stored);
+		}
+		outside[g] = newTotal > 0 ? newOutside / newTotal : 0.0;
+		foms[g] = fom(fitHist(h[0]), fitHist(h[1]));
+	});
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	size_t g = 0, best = 0, nShifted = 0;
+	for (int i1 = 0; i1 < nEdges; ++i1) {
+		for (int i2 = 0; i2 < nEdges; ++i2) {
+			int t1 = grid.edge(i1), t2 = grid.edge(i2);
+			if (t1 >= t2) {
+				txtOut << t1 << " " << t2 << " 0" << std::endl;
+				continue;
+			}
+			txtOut << t1 << " " << t2 << " " << foms[g] << std::endl;
+			if (foms[g] > foms[best]) best = g;
+			// qratio()'s padded range leaves about 2% of Gaussian ratios outside
+			if (extending && outside[g] > 0.05) ++nShifted;
+			++g;
+		}
+	}
+	txtOut.close();
+
+	for (int d = 0; d < 2; ++d) state.setWatermark(files[d], nEntries[d]);
+	state.save(statePath);
+
+	if (nShifted > 0) {
+		std::cout << "Warning: in " << nShifted << " gates more than 5% of the new ratios fall outside the stored "
+				  << "ranges; rerun without incremental to re-bin" << std::endl;
+	}
+	if (!gates.empty()) {
+		std::cout << "Best gate t1=" << grid.edge(gates[best].first) << " t2=" << grid.edge(gates[best].second)
+				  << ": FOM = " << foms[best] << std::endl;
+	}
+	std::cout << "FOM matrix written to " << outputName << " (" << nEntries[0] << " and " << nEntries[1]
+			  << " events)" << std::endl;
+}
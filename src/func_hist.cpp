@@ -7,77 +7,30 @@
 #include <cmath>
 #include <vector>
 #include <algorithm>
+#include <sstream>
+#include <string>
 #include <TClass.h>
 
 #include "TCanvas.h"
 #include "TLegend.h"
 
-void func_hist(const char* fileLocation1, const char* fileLocation2,
-			    const char* BranchAddress,  
-			    bool plot = false,
-			    int nBins = 500, double lowRange = 1000, double highRange = 1200,
-				const char* plotName = "func_hist.png"
-			    ) {
-
-	std::cout << plot << std::endl;
-	// Open file1 and get tree
-	TFile* file1 = TFile::Open(fileLocation1, "READ");
-	if (!file1 || file1->IsZombie()) {
-		std::cerr << "Error opening file1: " << fileLocation1 << std::endl;
-		return;
-	}
-	TTree* tree1 = dynamic_cast<TTree*>(file1->Get("adjustedTree"));
-	if (!tree1) {
-		std::cerr << "Error getting tree from file1" << std::endl;
-		file1->Close();
-		return;
-	}
-	
-	// Open file2 and get tree
-	TFile* file2 = TFile::Open(fileLocation2, "READ");
-	if (!file2 || file2->IsZombie()) {
-		std::cerr << "Error opening file2: " << fileLocation2 << std::endl;
-		file1->Close();
-		return;
-	}
-	TTree* tree2 = dynamic_cast<TTree*>(file2->Get("adjustedTree"));
-	if (!tree2) {
-		std::cerr << "Error getting tree from file2" << std::endl;
-		file1->Close();
-		file2->Close();
-		return;
-	}
-	
-	double p1, p2;
-	
-	tree1->SetBranchAddress(BranchAddress, &p1);
-	Long64_t nEntries1 = tree1->GetEntries();
-
-	tree2->SetBranchAddress(BranchAddress, &p2);
-	Long64_t nEntries2 = tree2->GetEntries();
+#include "fasthist.h"
+#include "memorybudget.h"
+#include "prefetchreader.h"
 
-
-	TH1D* h1 = new TH1D("h1", "", nBins, lowRange, highRange);
-	TH1D* h2 = new TH1D("h2", "", nBins, lowRange, highRange);
-	
-	// Fill histograms with the p1 and p2
-    for (Long64_t i = 0; i < nEntries1; ++i) {
-        tree1->GetEntry(i);
-        h1->Fill(p1);
-    }
-
-    for (Long64_t i = 0; i < nEntries2; ++i) {
-        tree2->GetEntry(i);
-        h2->Fill(p2);
-    }
+// Fit both distributions, return the FOM and optionally plot them
+static double fitAndPlot(const FastHist& f1, const FastHist& f2, const char* title, bool plot, const char* plotName)
+{
+	TH1D* h1 = f1.toTH1D("h1");
+	TH1D* h2 = f2.toTH1D("h2");
 
 
 	// Fit Gaussians to calculate parameters
-	TF1* g1 = new TF1("g1", "gaus", lowRange, highRange);
+	TF1* g1 = new TF1("g1", "gaus", f1.low, f1.high);
 	g1->SetParameters(h1->GetMaximum(), h1->GetMean(), h1->GetRMS());
 	h1->Fit(g1, "Q"); // Q = quiet mode
 	
-	TF1* g2 = new TF1("g2", "gaus", lowRange, highRange);
+	TF1* g2 = new TF1("g2", "gaus", f1.low, f1.high);
 	g2->SetParameters(h2->GetMaximum(), h2->GetMean(), h2->GetRMS());
 	h2->Fit(g2, "Q"); // Q = quiet mode
 	
@@ -94,7 +47,7 @@ void func_hist(const char* fileLocation1, const char* fileLocation2,
 	if (plot == true){
 		// Plot both histograms
 		std::cout << "Plotting histograms..." << std::endl;
-		h1->SetTitle(BranchAddress);
+		h1->SetTitle(title);
 		h1->SetLineColor(kRed);
 		g1->SetLineColor(kRed);
 		h2->SetLineColor(kBlue);
@@ -123,28 +76,179 @@ void func_hist(const char* fileLocation1, const char* fileLocation2,
 	delete h2;
 	delete g1;
 	delete g2;
+	return fom;
+}
+
+void func_hist(const char* fileLocation1, const char* fileLocation2,
+			    const char* BranchAddress,  
+			    bool plot = false,
+			    int nBins = 500, double lowRange = 1000, double highRange = 1200,
+				const char* plotName = "func_hist.png"
+			    ) {
+
+	std::cout << plot << std::endl;
+	// Open file1 and get tree
+	TFile* file1 = TFile::Open(fileLocation1, "READ");
+	if (!file1 || file1->IsZombie()) {
+		std::cerr << "Error opening file1: " << fileLocation1 << std::endl;
+		return;
+	}
+	TTree* tree1 = dynamic_cast<TTree*>(file1->Get("adjustedTree"));
+	if (!tree1) {
+		std::cerr << "Error getting tree from file1" << std::endl;
+		file1->Close();
+		return;
+	}
+	
+	// Open file2 and get tree
+	TFile* file2 = TFile::Open(fileLocation2, "READ");
+	if (!file2 || file2->IsZombie()) {
+		std::cerr << "Error opening file2: " << fileLocation2 << std::endl;
+		file1->Close();
+		return;
+	}
+	TTree* tree2 = dynamic_cast<TTree*>(file2->Get("adjustedTree"));
+	if (!tree2) {
+		std::cerr << "Error getting tree from file2" << std::endl;
+		file1->Close();
+		file2->Close();
+		return;
+	}
+	
+	double p1, p2;
+	
+	tree1->SetBranchAddress(BranchAddress, &p1);
+	Long64_t nEntries1 = tree1->GetEntries();
+
+	tree2->SetBranchAddress(BranchAddress, &p2);
+	Long64_t nEntries2 = tree2->GetEntries();
+
+
+	// Read the values a budget-sized chunk at a time and bin each chunk in
+	// one batched pass; the range is fixed, so nothing else is kept
+	Long64_t chunk = chunkEvents(sizeof(double), 0.1);
+	std::vector<double> values;
+	values.reserve(std::min(chunk, std::max(nEntries1, nEntries2)));
+
+	FastHist f1(nBins, lowRange, highRange);
+	FastHist f2(nBins, lowRange, highRange);
+	for (Long64_t first = 0; first < nEntries1; first += chunk) {
+		values.clear();
+		for (Long64_t i = first; i < std::min(first + chunk, nEntries1); ++i) {
+			tree1->GetEntry(i);
+			values.push_back(p1);
+		}
+		fillParallel(f1, values.data(), values.size());
+	}
+	for (Long64_t first = 0; first < nEntries2; first += chunk) {
+		values.clear();
+		for (Long64_t i = first; i < std::min(first + chunk, nEntries2); ++i) {
+			tree2->GetEntry(i);
+			values.push_back(p2);
+		}
+		fillParallel(f2, values.data(), values.size());
+	}
+
+	fitAndPlot(f1, f2, BranchAddress, plot, plotName);
+
 	file1->Close();
 	file2->Close();
 }
 
+// One histogram of func_hist_multi(): "branch:nBins:low:high:plotName"
+struct HistSpec {
+	std::string branch;
+	int nBins = 500;
+	double low = 0.0;
+	double high = 0.0;
+	std::string plotName;
+};
+
+// Specs separated by ';'; the plot name defaults to <branch>.png
+static bool parseHistSpecs(const char* specList, std::vector<HistSpec>& specs)
+{
+	std::stringstream list(specList);
+	std::string item;
+	while (std::getline(list, item, ';')) {
+		if (item.empty()) continue;
+		std::vector<std::string> fields;
+		std::stringstream ss(item);
+		std::string field;
+		while (std::getline(ss, field, ':')) fields.push_back(field);
+		if (fields.size() < 4 || fields.size() > 5) {
+			std::cerr << "Invalid histogram spec \"" << item << "\" (branch:nBins:low:high[:plot])" << std::endl;
+			return false;
+		}
+		HistSpec spec;
+		spec.branch = fields[0];
+		spec.nBins = std::atoi(fields[1].c_str());
+		spec.low = std::atof(fields[2].c_str());
+		spec.high = std::atof(fields[3].c_str());
+		spec.plotName = fields.size() == 5 ? fields[4] : spec.branch + ".png";
+		if (spec.nBins <= 0 || !(spec.high > spec.low)) {
+			std::cerr << "Invalid binning in histogram spec \"" << item << "\"" << std::endl;
+			return false;
+		}
+		specs.push_back(spec);
+	}
+	return !specs.empty();
+}
+
+// Fill one histogram per spec in a single read of the file, with only the
+// spec branches enabled
+static bool fillHists(const char* fileLocation, const std::vector<HistSpec>& specs, std::vector<FastHist>& hists)
+{
+	PrefetchReader reader(fileLocation, "adjustedTree");
+	std::vector<int> index;
+	for (const HistSpec& spec : specs) index.push_back(reader.addBranch(spec.branch.c_str()));
+	if (!reader.start()) return false;
+
+	hists.clear();
+	for (const HistSpec& spec : specs) hists.emplace_back(spec.nBins, spec.low, spec.high);
+	while (const EventBatch* batch = reader.next()) {
+		for (size_t k = 0; k < specs.size(); ++k) {
+			hists[k].fill(batch->get(index[k], 0), batch->size);
+		}
+	}
+	if (reader.failed()) {
+		std::cerr << "Error reading " << fileLocation << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// func_hist() for any number of scalar branches at the cost of one pass per
+// file, e.g. func_hist_multi(f1, f2, "Amp:500:0:1000;Tau:500:1000:1200:tau.png").
+// Writes "branch fom" per spec to outputName.
+void func_hist_multi(const char* fileLocation1, const char* fileLocation2, const char* specList,
+					 bool plot = true, const char* outputName = "func_hist_fom.txt")
+{
+	std::vector<HistSpec> specs;
+	if (!parseHistSpecs(specList, specs)) {
+		std::cerr << "No histograms to fill" << std::endl;
+		return;
+	}
+
+	std::vector<FastHist> hists1, hists2;
+	if (!fillHists(fileLocation1, specs, hists1)) return;
+	if (!fillHists(fileLocation2, specs, hists2)) return;
+
+	std::ofstream txtOut(outputName);
+	for (size_t k = 0; k < specs.size(); ++k) {
+		double fom = fitAndPlot(hists1[k], hists2[k], specs[k].branch.c_str(), plot, specs[k].plotName.c_str());
+		std::cout << specs[k].branch << ": FOM " << fom << std::endl;
+		txtOut << specs[k].branch << " " << fom << std::endl;
+	}
+}
+
 void plot_all_params() {
-	// Plot Amp, Tau, Amp1, Tau1, Amp2, Tau2
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Amp", true, 500, 0, 1000, "Amp.png");
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Tau", true, 500, 1000, 1200, "Tau.png");
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Amp1", true, 500, 0, 1000, "Amp1.png");
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Tau1", true, 500, 1000, 1200, "Tau1.png");
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Amp2", true, 500, 0, 1000, "Amp2.png");
-	func_hist("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
-			  "/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
-			  "Tau2", true, 500, 1000, 1200, "Tau2.png");
-}
\ No newline at end of file
+	// Plot Amp, Tau, Amp1, Tau1, Amp2, Tau2 from one pass over each file
+	func_hist_multi("/shared/storage/physnp/jm2912/degrees_10_adjusted.root",
+					"/shared/storage/physnp/jm2912/degrees_30_adjusted.root",
+					"Amp:500:0:1000:Amp.png;"
+					"Tau:500:1000:1200:Tau.png;"
+					"Amp1:500:0:1000:Amp1.png;"
+					"Tau1:500:1000:1200:Tau1.png;"
+					"Amp2:500:0:1000:Amp2.png;"
+					"Tau2:500:1000:1200:Tau2.png");
+}
@@ -10,7 +10,7 @@
 #include "TSystem.h"  // for gSystem->Load()
 
 // Declarations for external functions provided in qdc_c.so and qratio_c.so
-extern void qdc(const char* filename, int t1, int t2);
+extern void qdc(const char* filename, int t1, int t2, const char* filter = "", bool incremental = false);
 extern void qratio(const char* file1, const char* file2, const char* Q1BranchName, const char* Q2BranchName, bool plot = false, int nBins = 500, double lowRange = -1, double highRange = -1);
 
 // Mutexes for protecting shared resources
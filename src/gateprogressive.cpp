@@ -0,0 +1,175 @@
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Gate scan over the (t1, t2) grid that spends full statistics only on gates
+// that can still be the best.
+//
+// Every gate is first scored on a random subsample of firstEvents events per
+// dataset: FOM and its uncertainty from the errors of the two Gaussian fits
+// (fomError()). A gate whose FOM + nSigma x error is below the highest
+// FOM - nSigma x error of any gate cannot be the best and is dropped; the
+// others are scored again on growth times as many events, down to the full
+// datasets, where the FOM is the one qratio() gives. A gate whose fit failed
+// has an infinite error: it is kept, and does not set the bound for others.
+// The subsamples are nested prefixes of one shuffled order per dataset, so
+// each stage only adds events to the previous one.
+//
+// The histograms of a subsample of n events have sqrt(n) bins (at least 20,
+// at most nBins), so sparse bins do not bias the fits; the full data uses
+// nBins as qratio() does. Both datasets are read once into edge-charge tables
+// (gatescan.h); the per-gate work, which dominates a full scan, scales with
+// the number of gates still competitive at each stage.
+//
+// Output: "t1 t2 fom error events" for every grid point, as gatematrix lays
+// them out; dropped gates keep the estimate of the last subsample they were
+// scored on (events per dataset), gates with t1 >= t2 are "t1 t2 0 0 0".
+
+void gateprogressive(const char* fileLocation1, const char* fileLocation2,
+					 Long64_t firstEvents = 2000, int growth = 4, double nSigma = 3.0,
+					 const char* branch = "t0aligned_cfd0.10", int nBins = 500, unsigned int nThreads = 0,
+					 unsigned long seed = 12345, const char* outputName = "progressive_output.txt")
+{
+	if (firstEvents <= 0 || growth < 2 || nSigma < 0) {
+		std::cerr << "Invalid schedule: firstEvents " << firstEvents << ", growth " << growth << ", nSigma "
+				  << nSigma << std::endl;
+		return;
+	}
+	ROOT::EnableThreadSafety();
+
+	GateGrid grid;
+	const char* files[2] = {fileLocation1, fileLocation2};
+	ChargeTable tables[2];
+	std::vector<char> readOk(2, 0);
+	parallelFor(2, nThreads, [&](size_t d, unsigned int) {
+		readOk[d] = readChargeTable(files[d], branch, grid, tables[d]);
+	});
+	if (!readOk[0] || !readOk[1]) return;
+	const Long64_t nEvents[2] = {tables[0].nEvents, tables[1].nEvents};
+	const Long64_t nMax = std::max(nEvents[0], nEvents[1]);
+	if (nEvents[0] == 0 || nEvents[1] == 0) {
+		std::cerr << "No events in " << (nEvents[0] == 0 ? fileLocation1 : fileLocation2) << std::endl;
+		return;
+	}
+
+	const int nEdges = grid.nSteps;
+	std::vector<std::pair<int, int>> gates;
+	for (int i1 = 0; i1 < nEdges; ++i1) {
+		for (int i2 = 0; i2 < nEdges; ++i2) {
+			if (grid.edge(i1) < grid.edge(i2)) gates.emplace_back(i1, i2);
+		}
+	}
+
+	// One random order per dataset; stage n takes its first n events
+	std::vector<Long64_t> order[2];
+	for (int d = 0; d < 2; ++d) {
+		order[d].resize(nEvents[d]);
+		std::iota(order[d].begin(), order[d].end(), Long64_t(0));
+		std::mt19937_64 rng(seed + d);
+		std::shuffle(order[d].begin(), order[d].end(), rng);
+	}
+
+	std::vector<double> foms(gates.size(), 0.0);
+	std::vector<double> errors(gates.size(), std::numeric_limits<double>::infinity());
+	std::vector<Long64_t> scoredOn(gates.size(), 0);
+	std::vector<size_t> alive(gates.size());
+	std::iota(alive.begin(), alive.end(), size_t(0));
+
+	std::vector<std::vector<double>> r1(workerCount(nThreads)), r2(workerCount(nThreads));
+	double work = 0.0;   // events x gates scored
+	std::cout << "Scoring " << gates.size() << " gates on " << nEvents[0] << " + " << nEvents[1] << " events, "
+			  << workerCount(nThreads) << " threads..." << std::endl;
+
+	for (Long64_t n = std::min(firstEvents, nMax);; n = std::min(n * growth, nMax)) {
+		// Events of this stage, sorted so the tables are read forward
+		bool all[2];
+		std::vector<Long64_t> sample[2];
+		for (int d = 0; d < 2; ++d) {
+			all[d] = n >= nEvents[d];
+			if (all[d]) continue;
+			sample[d].assign(order[d].begin(), order[d].begin() + n);
+			std::sort(sample[d].begin(), sample[d].end());
+		}
+		const bool full = all[0] && all[1];
+		const int stageBins = full ? nBins : std::max(20, std::min(nBins, static_cast<int>(std::sqrt(double(n)))));
+
+		parallelFor(alive.size(), nThreads, [&](size_t k, unsigned int t) {
+			size_t g = alive[k];
+			int i1 = gates[g].first, i2 = gates[g].second;
+			std::vector<double>* ratios[2] = {&r1[t], &r2[t]};
+			for (int d = 0; d < 2; ++d) {
+				if (all[d]) {
+					collectRatios(tables[d], i1, i2, *ratios[d]);
+				} else {
+					collectRatios(tables[d], i1, i2, sample[d], *ratios[d]);
+				}
+			}
+			scoredOn[g] = n;
+			if (r1[t].empty() || r2[t].empty()) {
+				foms[g] = 0.0;
+				errors[g] = full ? 0.0 : std::numeric_limits<double>::infinity();
+				return;
+			}
+			double lowRange, highRange;
+			pairRange(r1[t], r2[t], lowRange, highRange);
+			GateStats s1 = fitRatios(r1[t], stageBins, lowRange, highRange);
+			GateStats s2 = fitRatios(r2[t], stageBins, lowRange, highRange);
+			foms[g] = fom(s1, s2);
+			errors[g] = fomError(s1, s2);
+		});
+		work += double(alive.size()) * (std::min(n, nEvents[0]) + std::min(n, nEvents[1]));
+		if (full) break;
+
+		// Drop the gates that cannot reach the best lower bound
+		double bestLow = -std::numeric_limits<double>::infinity();
+		for (size_t g : alive) {
+			if (std::isfinite(errors[g])) bestLow = std::max(bestLow, foms[g] - nSigma * errors[g]);
+		}
+		std::vector<size_t> kept;
+		for (size_t g : alive) {
+			if (!(foms[g] + nSigma * errors[g] < bestLow)) kept.push_back(g);
+		}
+		std::cout << n << " events: " << alive.size() << " gates scored, " << kept.size()
+				  << " still competitive (best lower bound " << bestLow << ")" << std::endl;
+		alive.swap(kept);
+	}
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	size_t g = 0;
+	for (int i1 = 0; i1 < nEdges; ++i1) {
+		for (int i2 = 0; i2 < nEdges; ++i2) {
+			int t1 = grid.edge(i1), t2 = grid.edge(i2);
+			if (t1 >= t2) {
+				txtOut << t1 << " " << t2 << " 0 0 0" << std::endl;
+				continue;
+			}
+			txtOut << t1 << " " << t2 << " " << foms[g] << " " << errors[g] << " " << scoredOn[g] << std::endl;
+			++g;
+		}
+	}
+	txtOut.close();
+
+	if (!alive.empty()) {
+		size_t best = alive[0];
+		for (size_t a : alive) {
+			if (foms[a] > foms[best]) best = a;
+		}
+		std::cout << "Best gate t1=" << grid.edge(gates[best].first) << " t2=" << grid.edge(gates[best].second)
+				  << ": FOM = " << foms[best] << " (" << alive.size() << " gates scored on all events)" << std::endl;
+	}
+	std::cout << "Scored " << 100.0 * work / (double(gates.size()) * (nEvents[0] + nEvents[1]))
+			  << "% of the events x gates of a full scan; results written to " << outputName << std::endl;
+}
@@ -0,0 +1,415 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Sharded gate scan using a directory on shared storage as the work queue.
+//
+//   gatequeue_init()   coordinator: writes queue.cfg and one file per work unit in todo/
+//   gatequeue_worker() any number of processes on any node: claim, process, publish
+//   gatequeue_merge()  assembles output.txt ("t1 t2 fom", as gatematrix writes it)
+//
+// Layout of queueDir:
+//   queue.cfg            scan parameters
+//   todo/unit_NNNNN      unclaimed units
+//   claimed/unit_NNNNN   units being worked on; mtime is the worker's heartbeat
+//   done/unit_NNNNN      finished units
+//   results/unit_NNNNN.* published partial results
+//
+// A unit is claimed by rename(todo/X, claimed/X), which succeeds for exactly one
+// process. Results are written to a temporary name and renamed into place, so a
+// partial result is never visible. A claim whose heartbeat is older than the
+// lease is moved back to todo/, so units held by a dead worker are redone.
+//
+// Two kinds of unit:
+//   gates  - a block of t1 rows of the (t1,t2) grid; each worker reads both
+//            files once and fits its gates; result is text lines.
+//   chunks - an entry range of one file; result is its edge-charge table
+//            (binary), and the fits are done at merge time.
+
+struct QueueConfig {
+	std::string mode = "gates";
+	std::string file[2];
+	std::string branch = "t0aligned_cfd0.10";
+	GateGrid grid;
+	int nBins = 500;
+	int nUnits = 0;
+};
+
+static std::string queuePath(const std::string& dir, const std::string& sub, const std::string& name = "")
+{
+	return name.empty() ? dir + "/" + sub : dir + "/" + sub + "/" + name;
+}
+
+static std::string unitName(int unit)
+{
+	char buf[32];
+	std::snprintf(buf, sizeof(buf), "unit_%05d", unit);
+	return buf;
+}
+
+static bool fileExists(const std::string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+// Write to a temporary file next to path, then rename over it
+static bool publishText(const std::string& path, const std::string& text)
+{
+	std::string tmp = path + ".tmp." + std::to_string(getpid());
+	{
+		std::ofstream out(tmp.c_str());
+		out << text;
+		if (!out.good()) return false;
+	}
+	return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+static bool writeQueueConfig(const std::string& dir, const QueueConfig& cfg)
+{
+	std::ostringstream out;
+	out << "mode " << cfg.mode << "\n"
+		<< "file1 " << cfg.file[0] << "\n"
+		<< "file2 " << cfg.file[1] << "\n"
+		<< "branch " << cfg.branch << "\n"
+		<< "grid " << cfg.grid.t0 << " " << cfg.grid.tMin << " " << cfg.grid.tMax << " " << cfg.grid.nSteps << "\n"
+		<< "nBins " << cfg.nBins << "\n"
+		<< "nUnits " << cfg.nUnits << "\n";
+	return publishText(queuePath(dir, "queue.cfg"), out.str());
+}
+
+static bool readQueueConfig(const std::string& dir, QueueConfig& cfg)
+{
+	std::ifstream in(queuePath(dir, "queue.cfg").c_str());
+	if (!in.is_open()) {
+		std::cerr << "Error opening " << queuePath(dir, "queue.cfg") << std::endl;
+		return false;
+	}
+	std::string key;
+	while (in >> key) {
+		if (key == "mode") in >> cfg.mode;
+		else if (key == "file1") in >> cfg.file[0];
+		else if (key == "file2") in >> cfg.file[1];
+		else if (key == "branch") in >> cfg.branch;
+		else if (key == "grid") in >> cfg.grid.t0 >> cfg.grid.tMin >> cfg.grid.tMax >> cfg.grid.nSteps;
+		else if (key == "nBins") in >> cfg.nBins;
+		else if (key == "nUnits") in >> cfg.nUnits;
+	}
+	return true;
+}
+
+static std::vector<std::string> listUnits(const std::string& dir)
+{
+	std::vector<std::string> names;
+	DIR* d = opendir(dir.c_str());
+	if (!d) return names;
+	while (dirent* e = readdir(d)) {
+		std::string n = e->d_name;
+		if (n.compare(0, 5, "unit_") == 0) names.push_back(n);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end());
+	return names;
+}
+
+// Move claims whose heartbeat is older than the lease back to todo/
+static void reclaimStale(const std::string& dir, int leaseSeconds)
+{
+	time_t now = time(nullptr);
+	for (const std::string& n : listUnits(queuePath(dir, "claimed"))) {
+		struct stat st;
+		std::string claimed = queuePath(dir, "claimed", n);
+		if (stat(claimed.c_str(), &st) != 0) continue;
+		if (now - st.st_mtime > leaseSeconds) {
+			if (std::rename(claimed.c_str(), queuePath(dir, "todo", n).c_str()) == 0) {
+				std::cout << "Reclaimed stale unit " << n << std::endl;
+			}
+		}
+	}
+}
+
+void gatequeue_init(const char* queueDir, const char* fileLocation1, const char* fileLocation2,
+					const char* mode = "gates", int unitSize = 0,
+					const char* branch = "t0aligned_cfd0.10", int nBins = 500)
+{
+	std::string dir = queueDir;
+	QueueConfig cfg;
+	cfg.mode = mode;
+	cfg.file[0] = fileLocation1;
+	cfg.file[1] = fileLocation2;
+	cfg.branch = branch;
+	cfg.nBins = nBins;
+
+	if (cfg.mode != "gates" && cfg.mode != "chunks") {
+		std::cerr << "Unknown queue mode: " << cfg.mode << " (use gates or chunks)" << std::endl;
+		return;
+	}
+	if (fileExists(queuePath(dir, "queue.cfg"))) {
+		std::cerr << "Queue already exists in " << dir << std::endl;
+		return;
+	}
+	const char* subdirs[] = {"todo", "claimed", "done", "results"};
+	mkdir(dir.c_str(), 0775);
+	for (const char* s : subdirs) {
+		if (mkdir(queuePath(dir, s).c_str(), 0775) != 0 && errno != EEXIST) {
+			std::cerr << "Error creating " << queuePath(dir, s) << std::endl;
+			return;
+		}
+	}
+
+	// Each unit file holds the description of its work on one line
+	std::vector<std::string> units;
+	if (cfg.mode == "gates") {
+		int rowsPerUnit = unitSize > 0 ? unitSize : 1;
+		for (int i1 = 0; i1 < cfg.grid.nSteps; i1 += rowsPerUnit) {
+			units.push_back(Form("gates %d %d", i1, std::min(i1 + rowsPerUnit, cfg.grid.nSteps)));
+		}
+	} else {
+		Long64_t entriesPerUnit = unitSize > 0 ? unitSize : 50000;
+		for (int f = 0; f < 2; ++f) {
+			TFile* file = TFile::Open(cfg.file[f].c_str(), "READ");
+			TTree* tree = (file && !file->IsZombie()) ? dynamic_cast<TTree*>(file->Get("adjustedTree")) : nullptr;
+			if (!tree) {
+				std::cerr << "Error getting tree from " << cfg.file[f] << std::endl;
+				if (file) file->Close();
+				return;
+			}
+			Long64_t nEntries = tree->GetEntries();
+			for (Long64_t first = 0; first < nEntries; first += entriesPerUnit) {
+				units.push_back(Form("chunk %d %lld %lld", f, first, std::min(first + entriesPerUnit, nEntries)));
+			}
+			file->Close();
+		}
+	}
+
+	cfg.nUnits = units.size();
+	for (size_t u = 0; u < units.size(); ++u) {
+		if (!publishText(queuePath(dir, "todo", unitName(u)), units[u] + "\n")) {
+			std::cerr << "Error writing unit " << u << std::endl;
+			return;
+		}
+	}
+	// Config last: workers refuse to start without it, so they never see a half-built queue
+	if (!writeQueueConfig(dir, cfg)) {
+		std::cerr << "Error writing queue config" << std::endl;
+		return;
+	}
+	std::cout << "Queue " << dir << " created with " << cfg.nUnits << " " << cfg.mode << " units." << std::endl;
+}
+
+void gatequeue_worker(const char* queueDir, int leaseSeconds = 600, unsigned int nThreads = 1)
+{
+	ROOT::EnableThreadSafety();
+
+	std::string dir = queueDir;
+	QueueConfig cfg;
+	if (!readQueueConfig(dir, cfg)) return;
+
+	char host[256] = "localhost";
+	gethostname(host, sizeof(host) - 1);
+	std::string worker = std::string(host) + "." + std::to_string(getpid());
+
+	// Gate units all need both files in full; read them before claiming
+	// anything, so the read does not count against a unit's lease
+	ChargeTable tables[2];
+	if (cfg.mode == "gates") {
+		for (int f = 0; f < 2; ++f) {
+			if (!readChargeTable(cfg.file[f].c_str(), cfg.branch.c_str(), cfg.grid, tables[f])) return;
+		}
+	}
+	int nProcessed = 0;
+
+	while (true) {
+		reclaimStale(dir, leaseSeconds);
+
+		// Claim the first unit we can rename out of todo/
+		std::string unit;
+		for (const std::string& n : listUnits(queuePath(dir, "todo"))) {
+			if (std::rename(queuePath(dir, "todo", n).c_str(), queuePath(dir, "claimed", n).c_str()) == 0) {
+				// rename keeps the old mtime, so start the heartbeat now
+				utime(queuePath(dir, "claimed", n).c_str(), nullptr);
+				unit = n;
+				break;
+			}
+		}
+
+		if (unit.empty()) {
+			// Nothing left to claim; wait while other workers still hold units,
+			// since one of them may die and its unit come back to todo/
+			if (listUnits(queuePath(dir, "claimed")).empty()) break;
+			sleep(std::max(1, std::min(leaseSeconds / 10, 30)));
+			continue;
+		}
+
+		std::string claimed = queuePath(dir, "claimed", unit);
+		std::string kind;
+		std::ifstream(claimed.c_str()) >> kind;
+		if (kind.empty()) continue;  // lost the claim before reading it
+		std::string resultPath = queuePath(dir, "results", unit) + (kind == "chunk" ? ".bin" : ".txt");
+
+		// A unit reclaimed from a slow worker may already have been published
+		if (!fileExists(resultPath)) {
+			std::ifstream spec(claimed.c_str());
+			spec >> kind;
+			std::cout << worker << ": processing " << unit << " (" << kind << ")" << std::endl;
+
+			if (kind == "gates") {
+				int rowBegin, rowEnd;
+				spec >> rowBegin >> rowEnd;
+				const int nEdges = cfg.grid.nSteps;
+				std::vector<std::string> lines((rowEnd - rowBegin) * nEdges);
+				parallelFor(lines.size(), nThreads, [&](size_t job, unsigned int) {
+					int i1 = rowBegin + job / nEdges;
+					int i2 = job % nEdges;
+					int t1 = cfg.grid.edge(i1), t2 = cfg.grid.edge(i2);
+					if (t1 >= t2) {
+						lines[job] = std::to_string(t1) + " " + std::to_string(t2) + " 0\n";
+						return;
+					}
+					std::vector<double> r1, r2;
+					std::ostringstream line;
+					line << t1 << " " << t2 << " " << gateFom(tables[0], tables[1], i1, i2, cfg.nBins, r1, r2) << "\n";
+					lines[job] = line.str();
+					if (i2 == nEdges - 1) utime(claimed.c_str(), nullptr);  // heartbeat
+				});
+
+				std::string text;
+				for (const std::string& l : lines) text += l;
+				if (!publishText(resultPath, text)) {
+					std::cerr << "Error publishing " << resultPath << std::endl;
+					return;
+				}
+			} else if (kind == "chunk") {
+				int f;
+				Long64_t first, last;
+				spec >> f >> first >> last;
+				ChargeTable chunk;
+				if (!readChargeTable(cfg.file[f].c_str(), cfg.branch.c_str(), cfg.grid, chunk, first, last)) return;
+
+				std::string tmp = resultPath + ".tmp." + std::to_string(getpid());
+				{
+					std::ofstream out(tmp.c_str(), std::ios::binary);
+					Long64_t nEvents = chunk.nEvents;
+					int nEdges = chunk.grid.nSteps;
+					out.write(reinterpret_cast<const char*>(&f), sizeof(f));
+					out.write(reinterpret_cast<const char*>(&nEvents), sizeof(nEvents));
+					out.write(reinterpret_cast<const char*>(&nEdges), sizeof(nEdges));
+					out.write(reinterpret_cast<const char*>(chunk.q.data()), chunk.q.size() * sizeof(double));
+					if (!out.good()) {
+						std::cerr << "Error writing " << tmp << std::endl;
+						return;
+					}
+				}
+				if (std::rename(tmp.c_str(), resultPath.c_str()) != 0) {
+					std::cerr << "Error publishing " << resultPath << std::endl;
+					return;
+				}
+			} else {
+				std::cerr << "Unknown unit type in " << unit << ": " << kind << std::endl;
+				return;
+			}
+		}
+
+		// If our claim was reclaimed meanwhile this rename fails, which is harmless:
+		// the result is published and whoever redoes the unit will find it.
+		std::rename(claimed.c_str(), queuePath(dir, "done", unit).c_str());
+		++nProcessed;
+	}
+
+	std::cout << worker << ": no work left, processed " << nProcessed << " units." << std::endl;
+}
+
+void gatequeue_merge(const char* queueDir, const char* outputName = "output.txt", unsigned int nThreads = 0)
+{
+	ROOT::EnableThreadSafety();
+
+	std::string dir = queueDir;
+	QueueConfig cfg;
+	if (!readQueueConfig(dir, cfg)) return;
+
+	std::string ext = cfg.mode == "chunks" ? ".bin" : ".txt";
+	int nMissing = 0;
+	for (int u = 0; u < cfg.nUnits; ++u) {
+		if (!fileExists(queuePath(dir, "results", unitName(u)) + ext)) ++nMissing;
+	}
+	if (nMissing > 0) {
+		std::cerr << nMissing << " of " << cfg.nUnits << " units have no result yet ("
+				  << listUnits(queuePath(dir, "todo")).size() << " unclaimed, "
+				  << listUnits(queuePath(dir, "claimed")).size() << " claimed). Run more workers." << std::endl;
+		return;
+	}
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+
+	if (cfg.mode == "gates") {
+		for (int u = 0; u < cfg.nUnits; ++u) {
+			std::ifstream in((queuePath(dir, "results", unitName(u)) + ext).c_str());
+			txtOut << in.rdbuf();
+		}
+	} else {
+		// Concatenate the chunk tables of each file in unit order
+		ChargeTable tables[2];
+		for (int f = 0; f < 2; ++f) tables[f].grid = cfg.grid;
+		for (int u = 0; u < cfg.nUnits; ++u) {
+			std::ifstream in((queuePath(dir, "results", unitName(u)) + ext).c_str(), std::ios::binary);
+			int f = -1;
+			Long64_t nEvents = 0;
+			int nEdges = 0;
+			in.read(reinterpret_cast<char*>(&f), sizeof(f));
+			in.read(reinterpret_cast<char*>(&nEvents), sizeof(nEvents));
+			in.read(reinterpret_cast<char*>(&nEdges), sizeof(nEdges));
+			if (!in.good() || f < 0 || f > 1 || nEvents < 0 || nEdges != cfg.grid.nSteps) {
+				std::cerr << "Corrupt result for " << unitName(u) << std::endl;
+				return;
+			}
+			size_t offset = tables[f].q.size();
+			tables[f].q.resize(offset + nEvents * nEdges);
+			tables[f].nEvents += nEvents;
+			const std::streamsize bytes = nEvents * nEdges * sizeof(double);
+			in.read(reinterpret_cast<char*>(tables[f].q.data() + offset), bytes);
+			if (!in.good() || in.gcount() != bytes) {
+				std::cerr << "Truncated result for " << unitName(u) << ": " << in.gcount() << " of " << bytes
+						  << " bytes of charges" << std::endl;
+				return;
+			}
+		}
+
+		const int nEdges = cfg.grid.nSteps;
+		std::vector<double> foms(nEdges * nEdges, 0.0);
+		parallelFor(foms.size(), nThreads, [&](size_t job, unsigned int) {
+			int i1 = job / nEdges, i2 = job % nEdges;
+			if (cfg.grid.edge(i1) >= cfg.grid.edge(i2)) return;
+			std::vector<double> r1, r2;
+			foms[job] = gateFom(tables[0], tables[1], i1, i2, cfg.nBins, r1, r2);
+		});
+		for (int i1 = 0; i1 < nEdges; ++i1) {
+			for (int i2 = 0; i2 < nEdges; ++i2) {
+				int t1 = cfg.grid.edge(i1), t2 = cfg.grid.edge(i2);
+				if (t1 >= t2) txtOut << t1 << " " << t2 << " 0" << std::endl;
+				else txtOut << t1 << " " << t2 << " " << foms[i1 * nEdges + i2] << std::endl;
+			}
+		}
+	}
+
+	std::cout << "Merged " << cfg.nUnits << " units into " << outputName << std::endl;
+}
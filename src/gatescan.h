@@ -0,0 +1,361 @@
+#ifndef GATESCAN_H
+#define GATESCAN_H
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TH1D.h"
+#include "TF1.h"
+#include <iostream>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "pulseproc.h"
+#include "fasthist.h"
+#include "memorybudget.h"
+
+// In-memory gate scan engine.
+// Instead of writing a Q1/Q2 branch pair per gate (qdc.cpp) and re-reading
+// them (qratio.cpp), each aligned pulse is reduced once to its cumulative
+// charge at every grid edge. Q for any gate [t0, t) is then a table lookup.
+
+// Gate end points, laid out as in gatematrix.cpp
+struct GateGrid {
+	int t0 = kAlignIndex;   // integration start (aligned CFD point)
+	int tMin = 1100;
+	int tMax = 6100;
+	int nSteps = 51;
+
+	int edge(int i) const { return tMin + i * (tMax - tMin) / (nSteps - 1); }
+};
+
+// q[k] = sum of pulse[t0 .. edge(k)), i.e. what qdc() stores for a gate ending at edge(k)
+inline void edgeCharges(const double* pulse, const GateGrid& grid, double* q)
+{
+	double running = 0.0;
+	int j = grid.t0;
+	for (int k = 0; k < grid.nSteps; ++k) {
+		int end = grid.edge(k);
+		for (; j < end; ++j) {
+			running += pulse[j];
+		}
+		q[k] = running;
+	}
+}
+
+// Edge charges for every event of one dataset, row-major (event, edge).
+// Kept in a SpillArray, so tables beyond the memory budget live in a
+// mapped temporary file and are streamed by the per-gate scans.
+struct ChargeTable {
+	GateGrid grid;
+	Long64_t nEvents = 0;
+	SpillArray q;
+
+	void resize(Long64_t n) { nEvents = n; q.assign(n * grid.nSteps, 0.0); }
+	double* row(Long64_t i) { return &q[i * grid.nSteps]; }
+	const double* row(Long64_t i) const { return &q[i * grid.nSteps]; }
+};
+
+// Q2/Q1 for gate (edge i1, edge i2), with the same cuts as qratio()
+inline void collectRatios(const ChargeTable& table, int i1, int i2, std::vector<double>& ratios)
+{
+	ratios.clear();
+	ratios.reserve(table.nEvents);
+	for (Long64_t i = 0; i < table.nEvents; ++i) {
+		const double* q = table.row(i);
+		if (q[i1] != 0.0) {
+			double r = q[i2] / q[i1];
+			if (std::isfinite(r)) {
+				ratios.push_back(r);
+			}
+		}
+	}
+}
+
+// As collectRatios(), for the given events only (sorted, so the table is read forward)
+inline void collectRatios(const ChargeTable& table, int i1, int i2, const std::vector<Long64_t>& events,
+						  std::vector<double>& ratios)
+{
+	ratios.clear();
+	ratios.reserve(events.size());
+	for (Long64_t i : events) {
+		const double* q = table.row(i);
+		if (q[i1] != 0.0) {
+			double r = q[i2] / q[i1];
+			if (std::isfinite(r)) {
+				ratios.push_back(r);
+			}
+		}
+	}
+}
+
+// As collectRatios(), also recording which event each ratio came from
+inline void collectRatios(const ChargeTable& table, int i1, int i2, std::vector<double>& ratios,
+						  std::vector<Long64_t>& events)
+{
+	ratios.clear();
+	events.clear();
+	for (Long64_t i = 0; i < table.nEvents; ++i) {
+		const double* q = table.row(i);
+		if (q[i1] != 0.0) {
+			double r = q[i2] / q[i1];
+			if (std::isfinite(r)) {
+				ratios.push_back(r);
+				events.push_back(i);
+			}
+		}
+	}
+}
+
+// 5th and 95th percentile of ratios (reorders the vector)
+inline void ratioPercentiles(std::vector<double>& ratios, double& p5, double& p95)
+{
+	p5 = p95 = 0.0;
+	if (ratios.empty()) return;
+	size_t i5 = static_cast<size_t>(0.05 * ratios.size());
+	size_t i95 = static_cast<size_t>(0.95 * ratios.size());
+	std::nth_element(ratios.begin(), ratios.begin() + i5, ratios.end());
+	p5 = ratios[i5];
+	std::nth_element(ratios.begin(), ratios.begin() + i95, ratios.end());
+	p95 = ratios[i95];
+}
+
+// Histogram range qratio() would pick from the given percentiles (20% padding)
+inline void paddedRange(double p5, double p95, double& lowRange, double& highRange)
+{
+	double padding = 0.20 * (p95 - p5);
+	lowRange = p5 - padding;
+	highRange = p95 + padding;
+}
+
+// Gaussian fit of one dataset's ratio distribution for one gate
+struct GateStats {
+	double mean = 0.0;
+	double sigma = 0.0;
+	double meanError = 0.0;   // fit uncertainties
+	double sigmaError = 0.0;
+	bool valid = false;
+};
+
+// Gaussian fit of a binned ratio distribution, as qratio() does it, with
+// unique object names so it can be called from several threads (after
+// ROOT::EnableThreadSafety()). The fit is seeded from the histogram unless
+// a previous fit (seed.valid) is given. The result is valid only if the fit
+// converged with a finite, positive width.
+inline GateStats fitHist(const FastHist& fh, const GateStats& seed = GateStats())
+{
+	static std::atomic<long> counter(0);
+	long id = counter++;
+
+	GateStats stats;
+	if (fh.stats[0] <= 0 || !(fh.high > fh.low)) return stats;
+
+	std::unique_ptr<TH1D> h(fh.toTH1D(Form("h_gs_%ld", id)));
+
+	TF1 g(Form("g_gs_%ld", id), "gaus", fh.low, fh.high);
+	if (seed.valid) {
+		g.SetParameters(h->GetMaximum(), seed.mean, seed.sigma);
+	} else {
+		g.SetParameters(h->GetMaximum(), h->GetMean(), h->GetRMS());
+	}
+	int status = h->Fit(&g, "Q0N");
+
+	// gaus depends on sigma only through sigma^2, so its sign is arbitrary
+	stats.mean = g.GetParameter(1);
+	stats.sigma = std::fabs(g.GetParameter(2));
+	stats.meanError = g.GetParError(1);
+	stats.sigmaError = g.GetParError(2);
+	stats.valid = status == 0 && std::isfinite(stats.mean) && stats.sigma > 0 && std::isfinite(stats.sigma) &&
+				  std::isfinite(stats.meanError) && std::isfinite(stats.sigmaError);
+	return stats;
+}
+
+inline GateStats fitRatios(const std::vector<double>& ratios, int nBins, double lowRange, double highRange)
+{
+	if (ratios.empty() || !(highRange > lowRange)) return GateStats();
+	FastHist fh(nBins, lowRange, highRange);
+	fh.fill(ratios);
+	return fitHist(fh);
+}
+
+// qratio() figure of merit
+inline double fom(const GateStats& s1, const GateStats& s2)
+{
+	if (!s1.valid || !s2.valid) return 0.0;
+	double fwhm1 = 2.355 * std::fabs(s1.sigma);
+	double fwhm2 = 2.355 * std::fabs(s2.sigma);
+	return (s1.mean - s2.mean) / (fwhm1 + fwhm2);
+}
+
+// Uncertainty of fom(s1, s2) from the fit errors of the means and widths;
+// infinite if either fit failed, so such a gate is neither trusted nor pruned
+inline double fomError(const GateStats& s1, const GateStats& s2)
+{
+	if (!s1.valid || !s2.valid) return std::numeric_limits<double>::infinity();
+	double width = 2.355 * (std::fabs(s1.sigma) + std::fabs(s2.sigma));
+	if (!(width > 0)) return std::numeric_limits<double>::infinity();
+	double f = fom(s1, s2);
+	double var = s1.meanError * s1.meanError + s2.meanError * s2.meanError +
+				 f * f * 2.355 * 2.355 * (s1.sigmaError * s1.sigmaError + s2.sigmaError * s2.sigmaError);
+	return std::isfinite(var) ? std::sqrt(var) / width : std::numeric_limits<double>::infinity();
+}
+
+// qratio()'s automatic range: percentiles of both datasets together
+inline void pairRange(const std::vector<double>& r1, const std::vector<double>& r2,
+					  double& lowRange, double& highRange)
+{
+	std::vector<double> allRatios = r1;
+	allRatios.insert(allRatios.end(), r2.begin(), r2.end());
+	double p5, p95;
+	ratioPercentiles(allRatios, p5, p95);
+	paddedRange(p5, p95, lowRange, highRange);
+}
+
+// FOM of two ratio distributions, as qratio() computes it (the range is
+// taken from both together)
+inline double pairFom(const std::vector<double>& r1, const std::vector<double>& r2, int nBins)
+{
+	if (r1.empty() || r2.empty()) return 0.0;
+
+	double lowRange, highRange;
+	pairRange(r1, r2, lowRange, highRange);
+	return fom(fitRatios(r1, nBins, lowRange, highRange), fitRatios(r2, nBins, lowRange, highRange));
+}
+
+// FOM of one gate for a pair of datasets, as qratio() computes it.
+// r1/r2 are scratch buffers.
+inline double gateFom(const ChargeTable& c1, const ChargeTable& c2, int i1, int i2, int nBins,
+					  std::vector<double>& r1, std::vector<double>& r2)
+{
+	collectRatios(c1, i1, i2, r1);
+	collectRatios(c2, i1, i2, r2);
+	return pairFom(r1, r2, nBins);
+}
+
+// Charge table for gates with their own start points. Each event is reduced
+// to its cumulative charge at a sorted list of sample indices (points), so
+// the charge in [a, b) for any two points is c[b] - c[a]: Q1 = [start, t1)
+// and Q2 = [tail, t2) can then move independently of the aligned CFD point.
+struct CumulativeTable {
+	std::vector<int> points;
+	Long64_t nEvents = 0;
+	SpillArray c;
+
+	// Position of sample index t in points, or -1
+	int index(int t) const
+	{
+		auto it = std::lower_bound(points.begin(), points.end(), t);
+		return (it != points.end() && *it == t) ? it - points.begin() : -1;
+	}
+
+	void resize(Long64_t n) { nEvents = n; c.assign(n * points.size(), 0.0); }
+	double* row(Long64_t i) { return &c[i * points.size()]; }
+	const double* row(Long64_t i) const { return &c[i * points.size()]; }
+};
+
+// c[k] = sum of pulse[points[0] .. points[k])
+inline void cumulativeCharges(const double* pulse, const std::vector<int>& points, double* c)
+{
+	double running = 0.0;
+	int j = points.empty() ? 0 : points[0];
+	for (size_t k = 0; k < points.size(); ++k) {
+		for (; j < points[k]; ++j) {
+			running += pulse[j];
+		}
+		c[k] = running;
+	}
+}
+
+// Q2/Q1 with Q1 = [start, t1) and Q2 = [tail, t2) (point positions in the
+// table), with the same cuts as qratio()
+inline void collectRatios(const CumulativeTable& table, int start, int t1, int tail, int t2,
+						  std::vector<double>& ratios)
+{
+	ratios.clear();
+	ratios.reserve(table.nEvents);
+	for (Long64_t i = 0; i < table.nEvents; ++i) {
+		const double* c = table.row(i);
+		double q1 = c[t1] - c[start];
+		if (q1 != 0.0) {
+			double r = (c[t2] - c[tail]) / q1;
+			if (std::isfinite(r)) {
+				ratios.push_back(r);
+			}
+		}
+	}
+}
+
+// Read the aligned pulses of entries [first, last) of an adjusted file
+// (last < 0 means to the end), expanded up to sample maxSample: init(n) is
+// called with the number of entries, then fn(i, pulse) for i = 0 .. n-1.
+template <typename Init, typename Fn>
+inline bool forEachAlignedPulse(const char* fileLocation, const char* branchName, int maxSample,
+								Long64_t first, Long64_t last, Init init, Fn fn)
+{
+	TFile* file = TFile::Open(fileLocation, "READ");
+	if (!file || file->IsZombie()) {
+		std::cerr << "Error opening file: " << fileLocation << std::endl;
+		return false;
+	}
+	TTree* tree = dynamic_cast<TTree*>(file->Get("adjustedTree"));
+	if (!tree) {
+		std::cerr << "Error getting tree from " << fileLocation << std::endl;
+		file->Close();
+		return false;
+	}
+
+	std::vector<double> pulse(kNSamples);
+	tree->SetBranchStatus("*", false);
+	tree->SetBranchStatus(branchName, true);
+	WaveformBranch aligned;
+	if (!aligned.attach(tree, branchName)) {
+		file->Close();
+		return false;
+	}
+
+	Long64_t nEntries = tree->GetEntries();
+	if (last < 0 || last > nEntries) last = nEntries;
+	if (first > last) first = last;
+
+	init(last - first);
+	for (Long64_t i = first; i < last; ++i) {
+		tree->GetEntry(i);
+		aligned.expand(pulse.data(), maxSample);
+		fn(i - first, pulse.data());
+	}
+
+	file->Close();
+	delete file;
+	return true;
+}
+
+// Fill a ChargeTable from the aligned waveform branch of an adjusted file,
+// for entries [first, last) (last < 0 means to the end).
+inline bool readChargeTable(const char* fileLocation, const char* branchName, const GateGrid& grid,
+							ChargeTable& table, Long64_t first = 0, Long64_t last = -1)
+{
+	table.grid = grid;
+	return forEachAlignedPulse(fileLocation, branchName, grid.tMax, first, last,
+							   [&](Long64_t n) { table.resize(n); },
+							   [&](Long64_t i, const double* pulse) { edgeCharges(pulse, grid, table.row(i)); });
+}
+
+// Fill a CumulativeTable for the given sorted sample indices
+inline bool readCumulativeTable(const char* fileLocation, const char* branchName, const std::vector<int>& points,
+								CumulativeTable& table)
+{
+	if (points.empty() || points.front() < 0 || points.back() > kNSamples) {
+		std::cerr << "Invalid gate points" << std::endl;
+		return false;
+	}
+	table.points = points;
+	return forEachAlignedPulse(fileLocation, branchName, points.back(), 0, -1,
+							   [&](Long64_t n) { table.resize(n); },
+							   [&](Long64_t i, const double* pulse) { cumulativeCharges(pulse, table.points, table.row(i)); });
+}
+
+#endif
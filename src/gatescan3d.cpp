@@ -0,0 +1,248 @@
+#include "TROOT.h"
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+
+#include "gatescan.h"
+#include "threadpool.h"
+
+// Gate optimisation with movable start points.
+//
+// qdc() starts both gates at the aligned CFD point (1000) and the usual scan
+// only moves the end points. Here the short gate is [start, t1) and the long
+// gate [tail, t2), where tail is either the same start (a 3D scan over start,
+// t1, t2) or scanned on its own axis (4D). t1 and t2 run over the GateGrid
+// edges. Every event is reduced once to its cumulative charge at all start
+// and end points (CumulativeTable), so each gate's ratios are differences of
+// table entries.
+//
+// By default (prune <= 0) every gate is evaluated. With prune > 0 the space
+// is searched coarse to fine: every coarseStride-th point of each axis
+// first, then the neighbourhoods of the surviving points at half the stride,
+// down to single steps, until no neighbour of a surviving point is left
+// unevaluated. A gate survives if its FOM is within prune of the best so far
+// or if the fits cannot tell it from the best: FOM + nSigma x fomError() not
+// below the highest FOM - nSigma x error, as in gateprogressive. Refinement
+// still follows the coarse points, so an optimum narrower than the stride
+// can be missed; the output says when the search was pruned.
+//
+// starts, tails: "lo:hi:step" sample ranges ("" tails: tail = start)
+// Output: "start t1 tail t2 fom" for every evaluated gate, after a "#" line
+// with the pruning parameters if the search was pruned.
+
+static bool parseSampleRange(const char* spec, std::vector<int>& values)
+{
+	values.clear();
+	int lo, hi, step;
+	if (std::sscanf(spec, "%d:%d:%d", &lo, &hi, &step) != 3 || step <= 0 || hi < lo) {
+		std::cerr << "Invalid sample range \"" << spec << "\" (lo:hi:step)" << std::endl;
+		return false;
+	}
+	for (int t = lo; t <= hi; t += step) values.push_back(t);
+	return true;
+}
+
+void gatescan3d(const char* fileLocation1, const char* fileLocation2,
+				const char* starts = "950:1050:10", const char* tails = "",
+				int coarseStride = 4, double prune = 0.0, double nSigma = 3.0,
+				const char* branch = "t0aligned_cfd0.10", int nBins = 500, unsigned int nThreads = 0,
+				const char* outputName = "gate3d_output.txt")
+{
+	if (nSigma < 0) {
+		std::cerr << "Invalid nSigma " << nSigma << std::endl;
+		return;
+	}
+	ROOT::EnableThreadSafety();
+
+	GateGrid grid;
+	std::vector<int> startPoints, tailPoints, endPoints;
+	if (!parseSampleRange(starts, startPoints)) return;
+	const bool ownTail = tails && tails[0] != '\0';
+	if (ownTail && !parseSampleRange(tails, tailPoints)) return;
+	for (int i = 0; i < grid.nSteps; ++i) endPoints.push_back(grid.edge(i));
+
+	std::vector<int> points = startPoints;
+	points.insert(points.end(), tailPoints.begin(), tailPoints.end());
+	points.insert(points.end(), endPoints.begin(), endPoints.end());
+	std::sort(points.begin(), points.end());
+	points.erase(std::unique(points.begin(), points.end()), points.end());
+
+	const char* files[2] = {fileLocation1, fileLocation2};
+	CumulativeTable tables[2];
+	std::vector<char> readOk(2, 0);
+	parallelFor(2, nThreads, [&](size_t d, unsigned int) {
+		readOk[d] = readCumulativeTable(files[d], branch, points, tables[d]);
+	});
+	if (!readOk[0] || !readOk[1]) return;
+
+	// Axes: start, t1, t2, tail (size 1 without a tail axis)
+	const int dims[4] = {(int)startPoints.size(), grid.nSteps, grid.nSteps,
+						 ownTail ? (int)tailPoints.size() : 1};
+	const size_t nGates = size_t(dims[0]) * dims[1] * dims[2] * dims[3];
+	auto key = [&](const int* ix) { return ((size_t(ix[0]) * dims[1] + ix[1]) * dims[2] + ix[2]) * dims[3] + ix[3]; };
+	auto unkey = [&](size_t k, int* ix) {
+		for (int a = 3; a >= 0; --a) {
+			ix[a] = k % dims[a];
+			k /= dims[a];
+		}
+	};
+	auto sample = [&](const int* ix, int axis) {
+		if (axis == 0) return startPoints[ix[0]];
+		if (axis == 3) return ownTail ? tailPoints[ix[3]] : startPoints[ix[0]];
+		return endPoints[ix[axis]];
+	};
+	auto valid = [&](const int* ix) {
+		int start = sample(ix, 0), t1 = sample(ix, 1), t2 = sample(ix, 2), tail = sample(ix, 3);
+		return start < t1 && t1 < t2 && tail < t2;
+	};
+
+	// FOM and its error of every evaluated gate; queued marks gates evaluated
+	// or about to be
+	std::vector<double> foms(nGates, 0.0), errors(nGates, 0.0);
+	std::vector<char> queued(nGates, 0);
+	std::vector<std::vector<double>> r1(workerCount(nThreads)), r2(workerCount(nThreads));
+	size_t nEvaluated = 0;
+	auto evaluate = [&](const std::vector<std::array<int, 4>>& gates) {
+		parallelFor(gates.size(), nThreads, [&](size_t g, unsigned int t) {
+			const int* ix = gates[g].data();
+			int p[4];
+			for (int a = 0; a < 4; ++a) p[a] = tables[0].index(sample(ix, a));
+			collectRatios(tables[0], p[0], p[1], p[3], p[2], r1[t]);
+			collectRatios(tables[1], p[0], p[1], p[3], p[2], r2[t]);
+			const size_t k = key(ix);
+			if (r1[t].empty() || r2[t].empty()) {
+				foms[k] = errors[k] = 0.0;
+				return;
+			}
+			// pairFom(), keeping the fits for the error
+			double lowRange, highRange;
+			pairRange(r1[t], r2[t], lowRange, highRange);
+			GateStats s1 = fitRatios(r1[t], nBins, lowRange, highRange);
+			GateStats s2 = fitRatios(r2[t], nBins, lowRange, highRange);
+			foms[k] = fom(s1, s2);
+			errors[k] = fomError(s1, s2);
+		});
+		nEvaluated += gates.size();
+	};
+
+	// Coarse pass: every stride-th index on each axis, plus the last one
+	int stride = 1;
+	while (prune > 0 && stride * 2 <= std::max(coarseStride, 1)) stride *= 2;
+	std::vector<std::array<int, 4>> batch;
+	for (size_t k = 0; k < nGates; ++k) {
+		std::array<int, 4> ix;
+		unkey(k, ix.data());
+		bool onGrid = true;
+		for (int a = 0; a < 4; ++a) onGrid = onGrid && (ix[a] % stride == 0 || ix[a] == dims[a] - 1);
+		if (onGrid && valid(ix.data())) {
+			queued[k] = 1;
+			batch.push_back(ix);
+		}
+	}
+	std::cout << "Scanning " << nGates << " gates (" << dims[0] << " starts x " << dims[1] << " x " << dims[2]
+			  << " ends x " << dims[3] << " tails), coarse stride " << stride << ", on "
+			  << workerCount(nThreads) << " threads..." << std::endl;
+	evaluate(batch);
+
+	// Refinement around every gate within prune of the best or within the
+	// fit errors of it (a failed fit has an infinite error: kept, and does
+	// not set the bound)
+	while (prune > 0) {
+		double best = -std::numeric_limits<double>::infinity(), bestLow = best;
+		for (size_t k = 0; k < nGates; ++k) {
+			if (!queued[k]) continue;
+			best = std::max(best, foms[k]);
+			if (std::isfinite(errors[k])) bestLow = std::max(bestLow, foms[k] - nSigma * errors[k]);
+		}
+		double threshold = best - (1.0 - prune) * std::fabs(best);
+		int step = std::max(1, stride / 2);
+
+		std::vector<size_t> survivors;
+		for (size_t k = 0; k < nGates; ++k) {
+			if (queued[k] && (foms[k] >= threshold || !(foms[k] + nSigma * errors[k] < bestLow))) {
+				survivors.push_back(k);
+			}
+		}
+		batch.clear();
+		for (size_t k : survivors) {
+			int ix[4];
+			unkey(k, ix);
+			// All 3^4 neighbours at +-step
+			for (int n = 0; n < 81; ++n) {
+				std::array<int, 4> nb;
+				bool inside = true;
+				for (int a = 0, code = n; a < 4; ++a, code /= 3) {
+					nb[a] = ix[a] + (code % 3 - 1) * step;
+					inside = inside && nb[a] >= 0 && nb[a] < dims[a];
+				}
+				if (!inside || !valid(nb.data())) continue;
+				size_t nk = key(nb.data());
+				if (queued[nk]) continue;
+				queued[nk] = 1;
+				batch.push_back(nb);
+			}
+		}
+		if (batch.empty() && stride == 1) break;
+		std::cout << "Refining " << batch.size() << " gates at step " << step << std::endl;
+		evaluate(batch);
+		stride = step;
+	}
+	if (prune <= 0) {
+		batch.clear();
+		for (size_t k = 0; k < nGates; ++k) {
+			if (queued[k]) continue;
+			std::array<int, 4> ix;
+			unkey(k, ix.data());
+			if (valid(ix.data())) {
+				queued[k] = 1;
+				batch.push_back(ix);
+			}
+		}
+		evaluate(batch);
+	}
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	if (prune > 0) {
+		txtOut << "# pruned search: coarse stride " << coarseStride << ", prune " << prune << ", nSigma " << nSigma
+			   << ", " << nEvaluated << " of " << nGates << " gates evaluated\n";
+	}
+	size_t bestKey = nGates, bestAtCfd = nGates;
+	for (size_t k = 0; k < nGates; ++k) {
+		if (!queued[k]) continue;
+		int ix[4];
+		unkey(k, ix);
+		txtOut << sample(ix, 0) << " " << sample(ix, 1) << " " << sample(ix, 3) << " " << sample(ix, 2) << " "
+			   << foms[k] << "\n";
+		if (bestKey == nGates || foms[k] > foms[bestKey]) bestKey = k;
+		if (sample(ix, 0) == kAlignIndex && sample(ix, 3) == kAlignIndex &&
+			(bestAtCfd == nGates || foms[k] > foms[bestAtCfd])) {
+			bestAtCfd = k;
+		}
+	}
+	txtOut.close();
+
+	std::cout << "Evaluated " << nEvaluated << " of " << nGates << " gates." << std::endl;
+	if (prune > 0) {
+		std::cout << "Pruned search (prune " << prune << ", nSigma " << nSigma
+				  << "): an optimum narrower than the coarse stride can be missed; prune 0 evaluates every gate."
+				  << std::endl;
+	}
+	for (size_t k : {bestKey, bestAtCfd}) {
+		if (k == nGates) continue;
+		int ix[4];
+		unkey(k, ix);
+		std::cout << (k == bestKey ? "Best gate: " : "Best gate starting at the CFD point: ")
+				  << "start " << sample(ix, 0) << ", t1 " << sample(ix, 1) << ", tail " << sample(ix, 3)
+				  << ", t2 " << sample(ix, 2) << ", FOM " << foms[k] << std::endl;
+	}
+}
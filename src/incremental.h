@@ -0,0 +1,261 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TBranch.h"
+#include "TList.h"
+#include "TNamed.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <unistd.h>
+
+#include "pulseproc.h"
+
+// Incremental processing of datasets that grow by appended runs.
+//
+// Per-event stages (t0, qdc, features, spectral, fisher_apply, fits) add
+// branches to adjustedTree. Their watermark is the entry count of their own
+// branches: bslAdjust(..., append) fills only its branches for the new source
+// entries and raises the tree's entry count, leaving the other branches
+// short, and a stage run with incremental set fills its branches from where
+// they end (StageBranches).
+// Each completed run also records that count in the tree's user info
+// (commit()); branches that end elsewhere were left by a run that did not
+// complete and are not resumed. A stage whose branches are missing, were
+// written with another layout or were not committed at their length is
+// recomputed from the start, as without incremental. Branches are matched by
+// name and layout only, so a stage whose code or settings changed without
+// changing its branch names must be rerun without incremental.
+//
+// Summary stages (templates, FOM matrix) keep a state file next to their
+// output: the mergeable sums they are computed from, the number of entries of
+// each input already added, and a key with the settings they were made with
+// (SummaryState). The key includes the identity of each input file
+// (fileIdentity()), so a file recreated at the same path starts the summary
+// over. A rerun adds only the new entries and recomputes the output from the
+// merged sums.
+
+// Output branches of one per-event stage
+class StageBranches {
+public:
+	explicit StageBranches(TTree* tree) : fTree(tree) {}
+
+	void add(const std::string& name, void* address, const std::string& leaflist)
+	{
+		fSpecs.push_back({name, address, leaflist});
+	}
+
+	// Entries filled in all branches, if they all exist with this layout and
+	// the same count (not beyond the tree); -1 otherwise
+	Long64_t watermark() const
+	{
+		Long64_t common = -1;
+		for (const Spec& s : fSpecs) {
+			TBranch* b = fTree->GetBranch(s.name.c_str());
+			if (!b || s.leaflist != b->GetTitle()) return -1;
+			if (common >= 0 && b->GetEntries() != common) return -1;
+			common = b->GetEntries();
+		}
+		return common <= fTree->GetEntries() ? common : -1;
+	}
+
+	// Entry count recorded by the last completed run, or -1
+	Long64_t committed() const
+	{
+		TObject* marker = fTree->GetUserInfo()->FindObject(markerName().c_str());
+		return marker ? std::atoll(marker->GetTitle()) : -1;
+	}
+
+	// Record the current entry count as complete; call just before the tree
+	// is written
+	void commit()
+	{
+		TList* info = fTree->GetUserInfo();
+		if (TObject* old = info->FindObject(markerName().c_str())) {
+			info->Remove(old);
+			delete old;
+		}
+		Long64_t entries = fBranches.empty() ? 0 : fBranches.front()->GetEntries();
+		info->Add(new TNamed(markerName().c_str(), std::to_string(entries).c_str()));
+	}
+
+	// Reattach to the existing branches and return the first entry still to
+	// fill, or -1 if they cannot be resumed
+	Long64_t resume()
+	{
+		Long64_t first = watermark();
+		if (first < 0) return -1;
+		Long64_t done = committed();
+		if (done != first) {
+			std::cerr << "Warning: " << fSpecs.front().name << " holds " << first << " entries but its last "
+					  << "completed run wrote " << done << "; not resuming an incomplete run" << std::endl;
+			return -1;
+		}
+		fBranches.clear();
+		for (const Spec& s : fSpecs) {
+			fBranches.push_back(fTree->GetBranch(s.name.c_str()));
+			fBranches.back()->SetAddress(s.address);
+		}
+		std::cout << "Resuming " << fSpecs.front().name << (fSpecs.size() > 1 ? " ..." : "") << " at entry "
+				  << first << " of " << fTree->GetEntries() << std::endl;
+		return first;
+	}
+
+	// Replace the branches with new empty ones
+	void create()
+	{
+		fBranches.clear();
+		for (const Spec& s : fSpecs) {
+			dropBranch(fTree, s.name.c_str());
+			fBranches.push_back(fTree->Branch(s.name.c_str(), s.address, s.leaflist.c_str()));
+		}
+	}
+
+	// Resume if incremental and possible, else create: the first entry to fill
+	Long64_t open(bool incremental)
+	{
+		Long64_t first = incremental ? resume() : -1;
+		if (first >= 0) return first;
+		create();
+		return 0;
+	}
+
+	void fill()
+	{
+		for (TBranch* b : fBranches) b->Fill();
+	}
+
+private:
+	struct Spec {
+		std::string name;
+		void* address;
+		std::string leaflist;
+	};
+	std::string markerName() const { return "stage_" + fSpecs.front().name; }
+	TTree* fTree;
+	std::vector<Spec> fSpecs;
+	std::vector<TBranch*> fBranches;
+};
+
+// False (with a message) if an input branch holds fewer entries than the
+// tree: its stage has not been rerun since entries were appended
+inline bool branchComplete(TTree* tree, const char* name)
+{
+	TBranch* b = tree->GetBranch(name);
+	if (!b || b->GetEntries() >= tree->GetEntries()) return true;
+	std::cerr << "Error: branch " << name << " holds " << b->GetEntries() << " of " << tree->GetEntries()
+			  << " entries; rerun its stage with incremental first" << std::endl;
+	return false;
+}
+
+// Identity of a ROOT file that changes when it is recreated (its UUID), so
+// a summary is never extended with the entries of another file at the same path
+inline std::string fileIdentity(const char* path)
+{
+	std::unique_ptr<TFile> file(TFile::Open(path, "READ"));
+	if (!file || file->IsZombie()) return "unreadable";
+	return file->GetUUID().AsString();
+}
+
+// Mergeable summary of one or more inputs, saved as text:
+//   summary <key>
+//   watermark <entries> <source>
+//   array <name> <n>
+//   <n values>
+class SummaryState {
+public:
+	explicit SummaryState(const std::string& key) : fKey(key) {}
+
+	// Entries of source already in the summary
+	Long64_t watermark(const std::string& source) const
+	{
+		auto it = fWatermarks.find(source);
+		return it == fWatermarks.end() ? 0 : it->second;
+	}
+	void setWatermark(const std::string& source, Long64_t entries) { fWatermarks[source] = entries; }
+
+	bool has(const std::string& name) const { return fArrays.count(name) != 0; }
+	std::vector<double>& array(const std::string& name) { return fArrays[name]; }
+
+	// Load a saved state; false (and an empty state) if there is none or it
+	// was made with another key
+	bool load(const std::string& path)
+	{
+		fWatermarks.clear();
+		fArrays.clear();
+		std::ifstream in(path.c_str());
+		if (!in.is_open()) return false;
+		std::string line, word;
+		if (!std::getline(in, line) || line != "summary " + fKey) {
+			std::cout << "Summary " << path << " was made with other settings; starting over" << std::endl;
+			return false;
+		}
+		while (in >> word) {
+			if (word == "watermark") {
+				Long64_t n;
+				std::string source;
+				in >> n;
+				std::getline(in >> std::ws, source);
+				fWatermarks[source] = n;
+			} else if (word == "array") {
+				std::string name;
+				size_t n;
+				in >> name >> n;
+				std::vector<double>& a = fArrays[name];
+				a.resize(n);
+				for (size_t k = 0; k < n; ++k) in >> a[k];
+			} else {
+				break;
+			}
+		}
+		if (in.bad() || (!in.eof() && in.fail())) {
+			std::cerr << "Error reading summary " << path << "; starting over" << std::endl;
+			fWatermarks.clear();
+			fArrays.clear();
+			return false;
+		}
+		return true;
+	}
+
+	// Written to a temporary file and renamed over path, so an interrupted
+	// run leaves the previous state
+	bool save(const std::string& path) const
+	{
+		std::string tmp = path + ".tmp." + std::to_string(getpid());
+		{
+			std::ofstream out(tmp.c_str());
+			out << "summary " << fKey << "\n" << std::setprecision(17);
+			for (const auto& w : fWatermarks) out << "watermark " << w.second << " " << w.first << "\n";
+			for (const auto& a : fArrays) {
+				out << "array " << a.first << " " << a.second.size() << "\n";
+				for (size_t k = 0; k < a.second.size(); ++k) out << (k ? " " : "") << a.second[k];
+				out << "\n";
+			}
+			if (!out.good()) {
+				std::cerr << "Error writing summary " << tmp << std::endl;
+				return false;
+			}
+		}
+		if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+			std::cerr << "Error replacing summary " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+private:
+	std::string fKey;
+	std::map<std::string, Long64_t> fWatermarks;
+	std::map<std::string, std::vector<double>> fArrays;
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TH1D.h"
+#include "TF1.h"
+#include "TCanvas.h"
+#include "TGraph.h"
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pulseproc.h"
+#include "prefilter.h"
+#include "fasthist.h"
+#include "gatescan.h"
+
+// Live PSD monitoring while data is being taken.
+//
+// livemonitor() follows a growing input and pushes each event through
+// baseline, CFD (on the pre-filtered pulse if a filter is given) and QDC (on
+// the unfiltered pulse, as t0() stores it) as soon as it arrives. Every
+// updateSeconds it refits and publishes:
+//   live_monitor.png  Q2/Q1 histogram with fit, and the running average template
+//   live_fom.txt      "seconds events rate fom maxLatencyUs" per update (appended)
+//
+// Sources:
+//   "file.root"        raw ROOT file ("tree"/"pulsedata") still being written;
+//                      new entries are picked up with TTree::Refresh()
+//   "unix:/path"       local stream socket
+//   anything else      FIFO or binary file of raw records (10000 doubles each,
+//                      native byte order); a plain file is followed like tail -f
+//
+// With a reference file (adjusted, aligned) the FOM is live vs reference, as
+// qratio() computes it, read from the aligned branch t0() writes for the same
+// cfdFraction and filter without writeFiltered (e.g. t0aligned_cfd0.10_ma8:
+// filtered timing, unfiltered pulses, like the live ones); otherwise a
+// two-Gaussian fit of the live distribution is used. Per-event work is a few
+// passes over one record and all state is fixed-size, so latency and memory
+// stay bounded however long the run is.
+//
+// livemonitor_replay() is a digitizer stand-in that writes a raw file into a
+// FIFO or socket at a given rate, for testing.
+
+static const int kWarmupEvents = 1000;      // events used to fix the histogram range
+static const int kTemplateSamples = 6000;   // samples kept in the average template
+
+struct LiveState {
+	int t1, t2;
+	double cfdFraction;
+	std::unique_ptr<WaveformFilter> prefilter;
+	std::vector<double> adjusted, filtered, aligned;
+
+	std::vector<double> warmup;             // ratios seen before the range is fixed
+	FastHist ratios;
+	bool rangeFixed = false;
+	std::vector<double> templateSum;
+
+	Long64_t nEvents = 0;
+	Long64_t nSinceUpdate = 0;
+	double maxLatencyUs = 0.0;
+
+	GateStats reference;                     // fit of the reference dataset, if any
+	std::vector<double> referenceRatios;
+};
+
+static void fixLiveRange(LiveState& s, int nBins)
+{
+	std::vector<double> all = s.warmup;
+	all.insert(all.end(), s.referenceRatios.begin(), s.referenceRatios.end());
+	double p5, p95, lowRange, highRange;
+	ratioPercentiles(all, p5, p95);
+	paddedRange(p5, p95, lowRange, highRange);
+	s.ratios.reset(nBins, lowRange, highRange);
+	s.ratios.fill(s.warmup);
+	s.warmup.clear();
+	s.warmup.shrink_to_fit();
+	s.rangeFixed = true;
+	if (!s.referenceRatios.empty()) {
+		s.reference = fitRatios(s.referenceRatios, nBins, lowRange, highRange);
+	}
+	std::cout << "Live histogram range fixed to [" << lowRange << ", " << highRange << "]" << std::endl;
+}
+
+static void processLiveEvent(LiveState& s, const double* pd, int nBins)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	double baseline = computeBaseline(pd);
+	subtractBaseline(pd, baseline, s.adjusted.data());
+	// As t0() by default: the CFD times the filtered pulse, the unfiltered one
+	// is aligned and integrated
+	const double* timing = s.adjusted.data();
+	if (s.prefilter->active()) {
+		s.prefilter->apply(s.adjusted.data(), s.filtered.data(), kNSamples);
+		timing = s.filtered.data();
+	}
+	double t0_value = cfdTime(timing, kNSamples, s.cfdFraction);
+	alignPulse(s.adjusted.data(), kNSamples, t0_value, s.aligned.data());
+
+	double Q1 = 0.0, Q2 = 0.0;
+	for (int j = kAlignIndex; j < s.t1; ++j) Q1 += s.aligned[j];
+	for (int j = kAlignIndex; j < s.t2; ++j) Q2 += s.aligned[j];
+	if (Q1 != 0.0) {
+		double r = Q2 / Q1;
+		if (std::isfinite(r)) {
+			if (s.rangeFixed) {
+				s.ratios.fill(&r, 1);
+			} else {
+				s.warmup.push_back(r);
+				if ((int)s.warmup.size() >= kWarmupEvents) fixLiveRange(s, nBins);
+			}
+		}
+	}
+	for (int j = 0; j < kTemplateSamples; ++j) s.templateSum[j] += s.aligned[j];
+
+	++s.nEvents;
+	++s.nSinceUpdate;
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	s.maxLatencyUs = std::max(s.maxLatencyUs, us);
+}
+
+// Fit the live distribution, write live_fom.txt and live_monitor.png
+static void publishLive(LiveState& s, double elapsed, double interval)
+{
+	double fomValue = 0.0;
+	std::unique_ptr<TH1D> h;
+	std::unique_ptr<TF1> fit;
+	if (s.rangeFixed && s.ratios.stats[0] > 0) {
+		h.reset(s.ratios.toTH1D("h_live", "Live Q2/Q1"));
+		if (s.reference.valid) {
+			GateStats live = fitHist(s.ratios);
+			fomValue = fom(live, s.reference);
+			fit.reset(new TF1("f_live", "gaus", s.ratios.low, s.ratios.high));
+			fit->SetParameters(h->GetMaximum(), live.mean, live.sigma);
+		} else {
+			// Two populations in one run: fit two Gaussians seeded either side of the mean
+			double m = s.ratios.mean(), r = s.ratios.rms();
+			fit.reset(new TF1("f_live", "gaus(0)+gaus(3)", s.ratios.low, s.ratios.high));
+			fit->SetParameter(0, h->GetMaximum());
+			fit->SetParameter(1, m - 0.5 * r);
+			fit->SetParameter(2, 0.5 * r);
+			fit->SetParameter(3, 0.3 * h->GetMaximum());
+			fit->SetParameter(4, m + 0.5 * r);
+			fit->SetParameter(5, 0.5 * r);
+			h->Fit(fit.get(), "Q0N");
+			double fwhm1 = 2.355 * std::fabs(fit->GetParameter(2));
+			double fwhm2 = 2.355 * std::fabs(fit->GetParameter(5));
+			if (fwhm1 + fwhm2 > 0) fomValue = std::fabs(fit->GetParameter(4) - fit->GetParameter(1)) / (fwhm1 + fwhm2);
+		}
+	}
+
+	double rate = interval > 0 ? s.nSinceUpdate / interval : 0.0;
+	{
+		std::ofstream txtOut("live_fom.txt", std::ios::app);
+		txtOut << elapsed << " " << s.nEvents << " " << rate << " " << fomValue << " " << s.maxLatencyUs << std::endl;
+	}
+	std::cout << "[" << elapsed << " s] events=" << s.nEvents << " rate=" << rate << "/s FOM=" << fomValue
+			  << " max latency=" << s.maxLatencyUs << " us" << std::endl;
+
+	if (s.nEvents > 0) {
+		TCanvas c("c_live", "Live PSD monitor", 1600, 600);
+		c.Divide(2, 1);
+		c.cd(1);
+		if (h) {
+			h->SetLineColor(kRed);
+			h->Draw();
+			if (fit) {
+				fit->SetLineColor(kBlue);
+				fit->Draw("SAME");
+			}
+		}
+		c.cd(2);
+		std::vector<double> xVals(kTemplateSamples), avg(kTemplateSamples);
+		for (int j = 0; j < kTemplateSamples; ++j) {
+			xVals[j] = j;
+			avg[j] = s.templateSum[j] / s.nEvents;
+		}
+		TGraph g(kTemplateSamples, xVals.data(), avg.data());
+		g.SetTitle("Average template");
+		g.SetLineColor(kRed);
+		g.Draw("AL");
+		c.SaveAs("live_monitor.png");
+	}
+
+	s.nSinceUpdate = 0;
+	s.maxLatencyUs = 0.0;
+}
+
+// Open a FIFO, binary file or unix socket as a non-blocking descriptor
+static int openLiveStream(const std::string& source, bool& follow)
+{
+	follow = false;
+	if (source.compare(0, 5, "unix:") == 0) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, source.c_str() + 5, sizeof(addr.sun_path) - 1);
+		if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+			std::cerr << "Error connecting to " << source << ": " << std::strerror(errno) << std::endl;
+			if (fd >= 0) close(fd);
+			return -1;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		return fd;
+	}
+	// Opening a FIFO blocks until the writer is there; only then go non-blocking,
+	// since a non-blocking read with no writer looks like end of stream
+	int fd = open(source.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Error opening " << source << ": " << std::strerror(errno) << std::endl;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	struct stat st;
+	fstat(fd, &st);
+	follow = S_ISREG(st.st_mode);   // regular files keep growing; EOF on a pipe ends the run
+	return fd;
+}
+
+void livemonitor(const char* source, double updateSeconds = 10, int t1 = 4300, int t2 = 5100,
+				 const char* referenceFile = "", double cfdFraction = 0.1, const char* filter = "",
+				 double maxSeconds = 0, int nBins = 200)
+{
+	if (t1 <= kAlignIndex || t2 <= t1 || t2 > kNSamples) {
+		std::cerr << "Invalid gate t1=" << t1 << " t2=" << t2 << std::endl;
+		return;
+	}
+
+	LiveState s;
+	s.t1 = t1;
+	s.t2 = t2;
+	s.cfdFraction = cfdFraction;
+	s.prefilter.reset(new WaveformFilter(filter));
+	if (!s.prefilter->ok()) return;
+	s.adjusted.resize(kNSamples);
+	s.filtered.resize(kNSamples);
+	s.aligned.resize(kNSamples);
+	s.templateSum.assign(kTemplateSamples, 0.0);
+
+	if (referenceFile && referenceFile[0] != '\0') {
+		GateGrid g;
+		g.tMin = t1;
+		g.tMax = t2;
+		g.nSteps = 2;
+		ChargeTable ref;
+		std::string refBranch = Form("t0aligned_cfd%.2f%s", cfdFraction, s.prefilter->tag().c_str());
+		if (!readChargeTable(referenceFile, refBranch.c_str(), g, ref)) return;
+		collectRatios(ref, 0, 1, s.referenceRatios);
+		std::cout << "Reference: " << s.referenceRatios.size() << " events from " << referenceFile << " (" << refBranch
+				  << ")" << std::endl;
+	}
+
+	std::string src = source;
+	bool isRoot = src.size() > 5 && src.compare(src.size() - 5, 5, ".root") == 0;
+	std::vector<double> pd(kNSamples);
+
+	auto t_start = std::chrono::steady_clock::now();
+	auto lastUpdate = t_start;
+	auto seconds = [](std::chrono::steady_clock::duration d) { return std::chrono::duration<double>(d).count(); };
+
+	// Publish when the interval has passed; returns false once maxSeconds is reached
+	auto tick = [&]() {
+		auto now = std::chrono::steady_clock::now();
+		double sinceUpdate = seconds(now - lastUpdate);
+		if (sinceUpdate >= updateSeconds) {
+			publishLive(s, seconds(now - t_start), sinceUpdate);
+			lastUpdate = now;
+		}
+		return maxSeconds <= 0 || seconds(now - t_start) < maxSeconds;
+	};
+
+	// Cap on events handled between clock checks, so a backlog cannot delay updates
+	const int kMaxBurst = 256;
+
+	if (isRoot) {
+		TFile* file = TFile::Open(src.c_str(), "READ");
+		if (!file || file->IsZombie()) {
+			std::cerr << "Error opening file: " << src << std::endl;
+			return;
+		}
+		TTree* tree = dynamic_cast<TTree*>(file->Get("tree"));
+		if (!tree) {
+			std::cerr << "Error getting tree" << std::endl;
+			file->Close();
+			return;
+		}
+		tree->SetBranchAddress("pulsedata", pd.data());
+
+		Long64_t next = 0;
+		while (tick()) {
+			Long64_t available = tree->GetEntries();
+			if (next >= available) {
+				// Pick up entries the writer has flushed since we last looked
+				std::this_thread::sleep_for(std::chrono::milliseconds(200));
+				tree->Refresh();
+				continue;
+			}
+			for (int k = 0; k < kMaxBurst && next < available; ++k, ++next) {
+				tree->GetEntry(next);
+				processLiveEvent(s, pd.data(), nBins);
+			}
+		}
+		file->Close();
+	} else {
+		bool follow;
+		int fd = openLiveStream(src, follow);
+		if (fd < 0) return;
+
+		const size_t recordBytes = kNSamples * sizeof(double);
+		std::vector<char> buffer(recordBytes);
+		size_t have = 0;
+		bool open = true;
+		while (open && tick()) {
+			pollfd p = {fd, POLLIN, 0};
+			int ready = poll(&p, 1, 100);
+			if (ready < 0 && errno != EINTR) break;
+
+			for (int k = 0; k < kMaxBurst; ++k) {
+				ssize_t n = read(fd, buffer.data() + have, recordBytes - have);
+				if (n > 0) {
+					have += n;
+					if (have == recordBytes) {
+						std::memcpy(pd.data(), buffer.data(), recordBytes);
+						processLiveEvent(s, pd.data(), nBins);
+						have = 0;
+					}
+					continue;
+				}
+				if (n == 0) {
+					if (follow) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+					else open = false;   // writer closed the pipe or socket
+				} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					std::cerr << "Read error: " << std::strerror(errno) << std::endl;
+					open = false;
+				}
+				break;
+			}
+		}
+		close(fd);
+	}
+
+	publishLive(s, seconds(std::chrono::steady_clock::now() - t_start), seconds(std::chrono::steady_clock::now() - lastUpdate));
+	std::cout << "Live monitor stopped after " << s.nEvents << " events." << std::endl;
+}
+
+// Replay a raw ROOT file into a FIFO (or unix:/path socket, served here) at rateHz
+void livemonitor_replay(const char* rawFile, const char* sink, double rateHz = 1000)
+{
+	TFile* file = TFile::Open(rawFile, "READ");
+	if (!file || file->IsZombie()) {
+		std::cerr << "Error opening file: " << rawFile << std::endl;
+		return;
+	}
+	TTree* tree = dynamic_cast<TTree*>(file->Get("tree"));
+	if (!tree) {
+		std::cerr << "Error getting tree" << std::endl;
+		file->Close();
+		return;
+	}
+	std::vector<double> pd(kNSamples);
+	tree->SetBranchAddress("pulsedata", pd.data());
+
+	// A monitor that stops early should end the replay, not kill it
+	signal(SIGPIPE, SIG_IGN);
+
+	std::string dst = sink;
+	int fd = -1;
+	if (dst.compare(0, 5, "unix:") == 0) {
+		int server = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, dst.c_str() + 5, sizeof(addr.sun_path) - 1);
+		unlink(addr.sun_path);
+		if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(server, 1) != 0) {
+			std::cerr << "Error serving " << dst << ": " << std::strerror(errno) << std::endl;
+			file->Close();
+			return;
+		}
+		std::cout << "Waiting for monitor on " << dst << std::endl;
+		fd = accept(server, nullptr, nullptr);
+		close(server);
+	} else {
+		if (access(sink, F_OK) != 0) mkfifo(sink, 0664);
+		fd = open(sink, O_WRONLY);   // blocks until the monitor opens the FIFO
+	}
+	if (fd < 0) {
+		std::cerr << "Error opening " << dst << ": " << std::strerror(errno) << std::endl;
+		file->Close();
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	Long64_t nEntries = tree->GetEntries();
+	for (Long64_t i = 0; i < nEntries; ++i) {
+		tree->GetEntry(i);
+		const char* p = reinterpret_cast<const char*>(pd.data());
+		size_t left = kNSamples * sizeof(double);
+		while (left > 0) {
+			ssize_t n = write(fd, p, left);
+			if (n <= 0) {
+				std::cerr << "Monitor went away after " << i << " events" << std::endl;
+				close(fd);
+				file->Close();
+				return;
+			}
+			p += n;
+			left -= n;
+		}
+		if (rateHz > 0) std::this_thread::sleep_until(start + std::chrono::duration<double>((i + 1) / rateHz));
+	}
+	close(fd);
+	file->Close();
+	std::cout << "Replayed " << nEntries << " events." << std::endl;
+}
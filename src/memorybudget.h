@@ -0,0 +1,310 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include "Rtypes.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Memory budget for the processing stages.
+//
+// The budget defaults to PSD_MEMORY_MB from the environment (4096 MB if
+// unset) and can be changed from the ROOT prompt with setMemoryBudget(mb)
+// before running a stage. Stages size their chunks from it, keep mergeable
+// partial results (FastHist, QuantileSketch, sums) instead of per-event
+// arrays where they can, and keep exact per-event data in SpillArrays,
+// which move to a temporary file once the budget is used up. The TTreeCaches
+// of the read handles (prefetchreader.h) are held against it too.
+
+inline std::atomic<size_t>& memoryBudgetBytes()
+{
+	static std::atomic<size_t> budget([] {
+		const char* env = std::getenv("PSD_MEMORY_MB");
+		double mb = env ? std::atof(env) : 0.0;
+		return static_cast<size_t>((mb > 0 ? mb : 4096.0) * (1 << 20));
+	}());
+	return budget;
+}
+
+inline size_t memoryBudget() { return memoryBudgetBytes(); }
+
+inline void setMemoryBudget(double megabytes)
+{
+	memoryBudgetBytes() = static_cast<size_t>(megabytes * (1 << 20));
+	std::cout << "Memory budget: " << megabytes << " MB" << std::endl;
+}
+
+// Events of bytesPerEvent that fit in share of the budget (at least minEvents)
+inline Long64_t chunkEvents(size_t bytesPerEvent, double share = 0.25, Long64_t minEvents = 1024)
+{
+	Long64_t n = static_cast<Long64_t>(share * memoryBudget() / std::max<size_t>(bytesPerEvent, 1));
+	return std::max(n, minEvents);
+}
+
+// Bytes of the budget currently held by SpillArrays and read caches
+inline std::atomic<size_t>& budgetHeldBytes()
+{
+	static std::atomic<size_t> held(0);
+	return held;
+}
+
+// Claim up to bytes of what is left of the budget (all of it if exact) and
+// return the amount claimed; several threads may claim at once
+inline size_t claimBudget(size_t bytes, bool exact = true)
+{
+	std::atomic<size_t>& held = budgetHeldBytes();
+	size_t current = held.load(), granted;
+	do {
+		size_t left = current < memoryBudget() ? memoryBudget() - current : 0;
+		if (exact && bytes > left) return 0;
+		granted = std::min(bytes, left);
+	} while (!held.compare_exchange_weak(current, current + granted));
+	return granted;
+}
+
+inline void releaseBudget(size_t bytes) { budgetHeldBytes() -= bytes; }
+
+// Share of the budget held for as long as the object lives
+class BudgetReservation {
+public:
+	BudgetReservation() {}
+	~BudgetReservation() { releaseBudget(fBytes); }
+
+	BudgetReservation(const BudgetReservation&) = delete;
+	BudgetReservation& operator=(const BudgetReservation&) = delete;
+	BudgetReservation(BudgetReservation&& other) noexcept { std::swap(fBytes, other.fBytes); }
+	BudgetReservation& operator=(BudgetReservation&& other) noexcept
+	{
+		std::swap(fBytes, other.fBytes);
+		return *this;
+	}
+
+	// Replace the reservation with up to bytes; returns the bytes held
+	size_t reserve(size_t bytes)
+	{
+		releaseBudget(fBytes);
+		fBytes = claimBudget(bytes, false);
+		return fBytes;
+	}
+
+	size_t bytes() const { return fBytes; }
+
+private:
+	size_t fBytes = 0;
+};
+
+// TTreeCache size for one of nHandles read handles open at once: a quarter
+// of the budget shared between them, at most maxBytes each
+inline size_t readCacheBytes(unsigned int nHandles, size_t maxBytes)
+{
+	return std::min(maxBytes, memoryBudget() / 4 / std::max(nHandles, 1u));
+}
+
+// Growable array of doubles with the part of std::vector's interface the
+// tables use. It lives on the heap while all SpillArrays together fit in the
+// budget and is moved to a memory-mapped temporary file (in TMPDIR, unlinked
+// at once) when they do not; the kernel then pages it in and out as scans
+// walk through it.
+class SpillArray {
+public:
+	SpillArray() {}
+	~SpillArray() { release(); }
+
+	SpillArray(const SpillArray& other) { *this = other; }
+	SpillArray& operator=(const SpillArray& other)
+	{
+		if (this != &other) {
+			resize(other.fSize);
+			if (fSize) std::memcpy(fData, other.fData, fSize * sizeof(double));
+		}
+		return *this;
+	}
+
+	SpillArray(SpillArray&& other) noexcept { swap(other); }
+	SpillArray& operator=(SpillArray&& other) noexcept
+	{
+		swap(other);
+		return *this;
+	}
+
+	void swap(SpillArray& other) noexcept
+	{
+		std::swap(fData, other.fData);
+		std::swap(fSize, other.fSize);
+		std::swap(fCapacity, other.fCapacity);
+		std::swap(fMapped, other.fMapped);
+		std::swap(fFd, other.fFd);
+	}
+
+	size_t size() const { return fSize; }
+	bool empty() const { return fSize == 0; }
+	bool spilled() const { return fMapped; }
+	double* data() { return fData; }
+	const double* data() const { return fData; }
+	double& operator[](size_t i) { return fData[i]; }
+	const double& operator[](size_t i) const { return fData[i]; }
+
+	// New elements are zero
+	void resize(size_t n)
+	{
+		reserve(n);
+		if (n > fSize) std::memset(fData + fSize, 0, (n - fSize) * sizeof(double));
+		fSize = n;
+	}
+
+	void assign(size_t n, double value)
+	{
+		resize(n);
+		std::fill(fData, fData + n, value);
+	}
+
+private:
+	double* fData = nullptr;
+	size_t fSize = 0;
+	size_t fCapacity = 0;
+	bool fMapped = false;
+	int fFd = -1;
+
+	void reserve(size_t n)
+	{
+		if (n <= fCapacity) return;
+		size_t capacity = std::max(n, fCapacity + fCapacity / 2);
+		size_t extra = (capacity - fCapacity) * sizeof(double);
+		if (!fMapped && claimBudget(extra) == extra) {
+			double* p = static_cast<double*>(std::realloc(fData, capacity * sizeof(double)));
+			if (!p) {
+				releaseBudget(extra);
+				throw std::bad_alloc();
+			}
+			fData = p;
+		} else {
+			mapFile(capacity);
+		}
+		fCapacity = capacity;
+	}
+
+	void mapFile(size_t capacity)
+	{
+		size_t bytes = capacity * sizeof(double);
+		if (!fMapped) {
+			const char* dir = std::getenv("TMPDIR");
+			std::string path = std::string(dir ? dir : "/tmp") + "/psd_spill_XXXXXX";
+			std::vector<char> name(path.begin(), path.end());
+			name.push_back('\0');
+			fFd = mkstemp(name.data());
+			if (fFd < 0) throw std::bad_alloc();
+			unlink(name.data());
+			std::cout << "Memory budget reached: spilling " << (bytes >> 20) << " MB to " << path.substr(0, path.size() - 6)
+					  << "..." << std::endl;
+		}
+		if (ftruncate(fFd, bytes) != 0) throw std::bad_alloc();
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fFd, 0);
+		if (p == MAP_FAILED) throw std::bad_alloc();
+		if (fData) {
+			std::memcpy(p, fData, fSize * sizeof(double));
+			release(false);
+		}
+		fData = static_cast<double*>(p);
+		fMapped = true;
+	}
+
+	void release(bool closeFile = true)
+	{
+		if (fMapped) {
+			if (fData) munmap(fData, fCapacity * sizeof(double));
+			if (closeFile && fFd >= 0) {
+				close(fFd);
+				fFd = -1;
+			}
+		} else if (fData) {
+			std::free(fData);
+			releaseBudget(fCapacity * sizeof(double));
+		}
+		fData = nullptr;
+	}
+};
+
+// Mergeable quantile sketch (compactor levels as in KLL): level l holds
+// values of weight 2^l; a full level is sorted and every second value moves
+// up. Memory stays O(k log(n/k)) and rank errors are about log2(n/k)/k,
+// plenty for the percentile ranges of the ratio histograms.
+class QuantileSketch {
+public:
+	explicit QuantileSketch(size_t k = 4096) : fK(k), fLevels(1) {}
+
+	void add(double x)
+	{
+		fLevels[0].push_back(x);
+		++fCount;
+		if (fLevels[0].size() >= fK) compact(0);
+	}
+
+	void merge(const QuantileSketch& other)
+	{
+		if (fLevels.size() < other.fLevels.size()) fLevels.resize(other.fLevels.size());
+		for (size_t l = 0; l < other.fLevels.size(); ++l) {
+			fLevels[l].insert(fLevels[l].end(), other.fLevels[l].begin(), other.fLevels[l].end());
+		}
+		fCount += other.fCount;
+		for (size_t l = 0; l < fLevels.size(); ++l) {
+			if (fLevels[l].size() >= fK) compact(l);
+		}
+	}
+
+	Long64_t count() const { return fCount; }
+
+	// Value at quantile q in [0, 1]
+	double quantile(double q) const
+	{
+		std::vector<std::pair<double, double>> items;
+		for (size_t l = 0; l < fLevels.size(); ++l) {
+			for (double v : fLevels[l]) items.emplace_back(v, double(1ULL << l));
+		}
+		if (items.empty()) return 0.0;
+		std::sort(items.begin(), items.end());
+		double total = 0.0;
+		for (const auto& it : items) total += it.second;
+		double target = q * total, cumulative = 0.0;
+		for (const auto& it : items) {
+			cumulative += it.second;
+			if (cumulative > target) return it.first;
+		}
+		return items.back().first;
+	}
+
+private:
+	size_t fK;
+	std::vector<std::vector<double>> fLevels;
+	Long64_t fCount = 0;
+	unsigned int fFlip = 0;
+
+	void compact(size_t l)
+	{
+		if (fLevels.size() == l + 1) fLevels.emplace_back();
+		std::vector<double>& level = fLevels[l];
+		std::sort(level.begin(), level.end());
+		// An odd value out stays; alternate which half survives so that
+		// the result is deterministic but unbiased on average
+		size_t n = level.size() & ~size_t(1);
+		size_t offset = (fFlip++) & 1;
+		for (size_t i = offset; i < n; i += 2) fLevels[l + 1].push_back(level[i]);
+		if (level.size() > n) {
+			level[0] = level[n];
+			level.resize(1);
+		} else {
+			level.clear();
+		}
+		if (fLevels[l + 1].size() >= fK) compact(l + 1);
+	}
+};
+
+#endif
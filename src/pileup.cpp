@@ -0,0 +1,141 @@
+#include "TFile.h"
+#include "TTree.h"
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "pulseproc.h"
+#include "pulsefinder.h"
+#include "pulsefeatures.h"
+#include "prefetchreader.h"
+
+// Split records holding more than one pulse into sub-events.
+//
+// Every baseline-adjusted record is searched with findPulses() (see
+// pulsefinder.h) and each pulse found becomes its own entry of an
+// "adjustedTree" in outputLocation (default: <input>_pulses.root), with its
+// local baseline subtracted, its own CFD time and its part of the record
+// aligned to index 1000 as t0() does it. Samples outside the pulse's range
+// (the previous pulse, and from the next trigger on) are zero, so the
+// sub-event file can go straight into qdc(), features(), the gate scans and
+// func_hist() like any adjusted file. In ROI-cropped input only the stored
+// window is searched, and its first kBaselineSamples give the trigger noise,
+// so the window should start at least that far before the pulse.
+//
+// Branches:
+//   t0_cfd<f>, t0aligned_cfd<f>   as written by t0() (t0 in record samples)
+//   baselines                     local baseline of the pulse
+//   source_entry, pulse_index, n_pulses   where the pulse came from
+//   pileup_flags                  PileupFlag bits; 0 for a clean single pulse
+//   psd_<feature>                 pulse-shape features (pulsefeatures.h)
+// Records without any pulse above the trigger are left out.
+void pileup(const char* fileLocation, double cfdFraction = 0.1, const char* outputLocation = "",
+			double triggerSigma = 6.0, int maxRise = 32, bool fractional = false)
+{
+	PulseFinderConfig cfg;
+	cfg.triggerSigma = triggerSigma;
+	cfg.maxRise = maxRise;
+
+	std::string output = outputLocation;
+	if (output.empty()) {
+		output = fileLocation;
+		size_t dot = output.rfind(".root");
+		output = (dot == std::string::npos ? output : output.substr(0, dot)) + "_pulses.root";
+	}
+
+	PrefetchReader reader(fileLocation, "adjustedTree");
+	int inputIndex = reader.addBranch("baseline_adjusted");
+	int offsetIndex = reader.addBranch("roi_offset", true);
+	if (!reader.start()) return;
+	const int nStored = reader.length(inputIndex);
+	// A pulse starts inside the stored window, so aligning it moves its end
+	// at most kAlignIndex past the window length
+	const int nAligned = std::min(kNSamples, nStored + kAlignIndex);
+
+	TFile* outFile = TFile::Open(output.c_str(), "RECREATE");
+	if (!outFile || outFile->IsZombie()) {
+		std::cerr << "Error opening output file: " << output << std::endl;
+		return;
+	}
+	TTree* outTree = new TTree("adjustedTree", "Pile-up split sub-events");
+
+	std::string tag = fractional ? "_fine" : "";
+	std::string t0BranchName = Form("t0_cfd%.2f%s", cfdFraction, tag.c_str());
+	std::string alignedBranchName = Form("t0aligned_cfd%.2f%s", cfdFraction, tag.c_str());
+	double t0Value = 0.0, baseline = 0.0;
+	std::vector<double> aligned(nAligned);
+	Long64_t sourceEntry = 0;
+	int pulseIndex = 0, nPulses = 0, flags = 0;
+	outTree->Branch(t0BranchName.c_str(), &t0Value, (t0BranchName + "/D").c_str());
+	outTree->Branch(alignedBranchName.c_str(), aligned.data(), Form("%s[%d]/D", alignedBranchName.c_str(), nAligned));
+	outTree->Branch("baselines", &baseline, "baselines/D");
+	outTree->Branch("source_entry", &sourceEntry, "source_entry/L");
+	outTree->Branch("pulse_index", &pulseIndex, "pulse_index/I");
+	outTree->Branch("n_pulses", &nPulses, "n_pulses/I");
+	outTree->Branch("pileup_flags", &flags, "pileup_flags/I");
+
+	FeatureConfig featureCfg;
+	double features[kNFeatures] = {0};
+	for (int f = 0; f < kNFeatures; ++f) {
+		std::string name = std::string("psd_") + kFeatureNames[f];
+		outTree->Branch(name.c_str(), &features[f], (name + "/D").c_str());
+	}
+
+	std::cout << "Finding pulses in " << reader.entries() << " records of " << fileLocation << std::endl;
+
+	std::vector<double> record(kNSamples), segment(kNSamples), shifted(kNSamples);
+	std::vector<FoundPulse> pulses;
+	Long64_t nRecords = 0, nEmpty = 0, nMulti = 0, nSubEvents = 0, nUnresolved = 0;
+	while (const EventBatch* batch = reader.next()) {
+		for (int b = 0; b < batch->size; ++b) {
+			int offset = reader.has(offsetIndex) ? static_cast<int>(*batch->get(offsetIndex, b)) : 0;
+			expandWindow(batch->get(inputIndex, b), nStored, offset, record.data());
+			findPulses(record.data(), kNSamples, cfg, pulses, offset, offset + nStored);
+			++nRecords;
+			if (pulses.empty()) {
+				++nEmpty;
+				continue;
+			}
+			if (pulses.size() > 1) ++nMulti;
+
+			sourceEntry = batch->first + b;
+			nPulses = pulses.size();
+			for (size_t p = 0; p < pulses.size(); ++p) {
+				const FoundPulse& pulse = pulses[p];
+				std::fill(segment.begin(), segment.end(), 0.0);
+				for (int j = pulse.begin; j < pulse.end; ++j) segment[j] = record[j] - pulse.baseline;
+
+				if (fractional) {
+					t0Value = cfdTimeFine(segment.data(), kNSamples, cfdFraction);
+					alignPulseFine(segment.data(), kNSamples, t0Value, shifted.data(), kNSamples);
+				} else {
+					t0Value = cfdTime(segment.data(), kNSamples, cfdFraction);
+					alignPulse(segment.data(), kNSamples, t0Value, shifted.data());
+				}
+				std::copy(shifted.begin(), shifted.begin() + nAligned, aligned.begin());
+				pulseFeatures(shifted.data(), featureCfg, features);
+
+				baseline = pulse.baseline;
+				pulseIndex = p;
+				flags = pulse.flags;
+				if (flags & kPileUnresolved) ++nUnresolved;
+				outTree->Fill();
+				++nSubEvents;
+			}
+		}
+	}
+	if (reader.failed()) {
+		std::cerr << "Error reading " << fileLocation << "; " << output << " removed" << std::endl;
+		outFile->Close();
+		std::remove(output.c_str());
+		return;
+	}
+
+	outTree->Write("", TObject::kOverwrite);
+	outFile->Close();
+
+	std::cout << nRecords << " records: " << nSubEvents << " sub-events, " << nMulti << " records with pile-up, "
+			  << nUnresolved << " unresolved pulses, " << nEmpty << " records without a pulse." << std::endl;
+	std::cout << "Sub-events written to " << output << std::endl;
+}
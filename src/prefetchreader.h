@@ -0,0 +1,310 @@
+#ifndef PREFETCHREADER_H
+#define PREFETCHREADER_H
+
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TROOT.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+#include "memorybudget.h"
+
+// Read-ahead event reader.
+//
+// A background thread owns its own TFile/TTree handle, reads only the
+// requested branches through a TTreeCache sized for several clusters, and
+// lets TTreeCacheUnzip decompress baskets on ROOT's helper threads. Events
+// are copied into fixed-size batches and handed to the compute loop through
+// a bounded queue, so reading and decompression of the next batches overlap
+// with work on the current one. The cache (at most cacheBytes) is taken
+// from the memory budget while the reader runs (see memorybudget.h).
+//
+//   PrefetchReader reader(fileLocation, "adjustedTree");
+//   int wf = reader.addBranch("t0aligned_cfd0.10");
+//   if (!reader.start()) return;
+//   while (const EventBatch* batch = reader.next()) {
+//       for (int k = 0; k < batch->size; ++k) {
+//           const double* pulse = batch->get(wf, k);
+//           ...
+//       }
+//   }
+//
+// All values are delivered as double (Int_t branches such as roi_offset are
+// converted). A batch stays valid until the following call to next().
+
+struct EventBatch {
+	Long64_t first = 0;                          // entry number of event 0
+	int size = 0;                                // events in this batch
+	std::vector<std::vector<double>> values;     // per branch, size x length
+	std::vector<int> lengths;
+
+	const double* get(int branch, int k) const { return &values[branch][(size_t)k * lengths[branch]]; }
+};
+
+class PrefetchReader {
+public:
+	PrefetchReader(const char* fileLocation, const char* treeName = "adjustedTree",
+				   int batchSize = 256, int queueDepth = 4, Long64_t cacheBytes = 256LL << 20)
+		: fFile(fileLocation), fTree(treeName), fBatchSize(batchSize),
+		  fQueueDepth(std::max(2, queueDepth)), fCacheBytes(cacheBytes)
+	{
+	}
+
+	~PrefetchReader() { stop(); }
+
+	PrefetchReader(const PrefetchReader&) = delete;
+	PrefetchReader& operator=(const PrefetchReader&) = delete;
+
+	// Register a branch before start(); returns its index in the batches.
+	// Optional branches that do not exist are reported by has().
+	int addBranch(const char* name, bool optional = false)
+	{
+		fBranches.push_back({name, optional, false, 0, false});
+		return fBranches.size() - 1;
+	}
+
+	bool has(int branch) const { return fBranches[branch].present; }
+	int length(int branch) const { return fBranches[branch].length; }
+	Long64_t entries() const { return fLast - fFirst; }
+
+	// Inspect the tree and start reading entries [first, last) (last < 0: to the end)
+	bool start(Long64_t first = 0, Long64_t last = -1)
+	{
+		ROOT::EnableThreadSafety();
+
+		std::unique_ptr<TFile> file(TFile::Open(fFile.c_str(), "READ"));
+		if (!file || file->IsZombie()) {
+			std::cerr << "Error opening file: " << fFile << std::endl;
+			return false;
+		}
+		TTree* tree = dynamic_cast<TTree*>(file->Get(fTree.c_str()));
+		if (!tree) {
+			std::cerr << "Error getting tree " << fTree << " from " << fFile << std::endl;
+			return false;
+		}
+		for (BranchSpec& b : fBranches) {
+			TLeaf* leaf = tree->GetLeaf(b.name.c_str());
+			b.present = leaf != nullptr;
+			if (!leaf) {
+				if (b.optional) continue;
+				std::cerr << "Error: no branch " << b.name << " in " << fFile << std::endl;
+				return false;
+			}
+			b.length = leaf->GetLenStatic();
+			b.isInt = std::string(leaf->GetTypeName()) == "Int_t";
+		}
+		Long64_t nEntries = tree->GetEntries();
+		fLast = (last < 0 || last > nEntries) ? nEntries : last;
+		fFirst = std::min(first, fLast);
+		file->Close();
+
+		for (int i = 0; i < fQueueDepth; ++i) {
+			std::unique_ptr<EventBatch> b(new EventBatch);
+			for (const BranchSpec& s : fBranches) {
+				b->lengths.push_back(s.length);
+				b->values.emplace_back((size_t)fBatchSize * s.length);
+			}
+			fFree.push_back(std::move(b));
+		}
+
+		fProducer = std::thread(&PrefetchReader::produce, this);
+		return true;
+	}
+
+	// Next batch, or nullptr at the end (or on a read error, see failed())
+	const EventBatch* next()
+	{
+		std::unique_lock<std::mutex> lock(fMutex);
+		if (fCurrent) {
+			fFree.push_back(std::move(fCurrent));
+			fCond.notify_all();
+		}
+		fCond.wait(lock, [this] { return !fReady.empty() || fDone; });
+		if (fReady.empty()) return nullptr;
+		fCurrent = std::move(fReady.front());
+		fReady.pop_front();
+		return fCurrent.get();
+	}
+
+	bool failed() const { return fFailed; }
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(fMutex);
+			fStop = true;
+		}
+		fCond.notify_all();
+		if (fProducer.joinable()) fProducer.join();
+	}
+
+private:
+	struct BranchSpec {
+		std::string name;
+		bool optional;
+		bool present;
+		int length;
+		bool isInt;
+	};
+
+	std::string fFile, fTree;
+	int fBatchSize;
+	int fQueueDepth;
+	Long64_t fCacheBytes;
+	Long64_t fFirst = 0, fLast = 0;
+	std::vector<BranchSpec> fBranches;
+
+	std::thread fProducer;
+	std::mutex fMutex;
+	std::condition_variable fCond;
+	std::deque<std::unique_ptr<EventBatch>> fFree, fReady;
+	std::unique_ptr<EventBatch> fCurrent;
+	bool fDone = false;
+	bool fStop = false;
+	std::atomic<bool> fFailed{false};
+
+	void finish(bool failed)
+	{
+		fFailed = failed;
+		std::lock_guard<std::mutex> lock(fMutex);
+		fDone = true;
+		fCond.notify_all();
+	}
+
+	void produce()
+	{
+		std::unique_ptr<TFile> file(TFile::Open(fFile.c_str(), "READ"));
+		TTree* tree = (file && !file->IsZombie()) ? dynamic_cast<TTree*>(file->Get(fTree.c_str())) : nullptr;
+		if (!tree) {
+			std::cerr << "Prefetch: error reopening " << fFile << std::endl;
+			return finish(true);
+		}
+
+		// Only our branches are read, through a cache covering several clusters,
+		// with basket decompression running ahead on helper threads
+		std::vector<std::vector<double>> dbuf(fBranches.size());
+		std::vector<std::vector<Int_t>> ibuf(fBranches.size());
+		BudgetReservation cache;
+		tree->SetBranchStatus("*", false);
+		tree->SetCacheSize(cache.reserve(readCacheBytes(1, fCacheBytes)));
+		for (size_t b = 0; b < fBranches.size(); ++b) {
+			const BranchSpec& s = fBranches[b];
+			if (!s.present) continue;
+			tree->SetBranchStatus(s.name.c_str(), true);
+			tree->AddBranchToCache(s.name.c_str(), true);
+			if (s.isInt) {
+				ibuf[b].resize(s.length);
+				tree->SetBranchAddress(s.name.c_str(), ibuf[b].data());
+			} else {
+				dbuf[b].resize(s.length);
+				tree->SetBranchAddress(s.name.c_str(), dbuf[b].data());
+			}
+		}
+		tree->StopCacheLearningPhase();
+		tree->SetCacheEntryRange(fFirst, fLast);
+		tree->SetParallelUnzip(true);
+
+		for (Long64_t entry = fFirst; entry < fLast;) {
+			std::unique_ptr<EventBatch> batch;
+			{
+				std::unique_lock<std::mutex> lock(fMutex);
+				fCond.wait(lock, [this] { return !fFree.empty() || fStop; });
+				if (fStop) break;
+				batch = std::move(fFree.front());
+				fFree.pop_front();
+			}
+
+			batch->first = entry;
+			batch->size = 0;
+			for (; batch->size < fBatchSize && entry < fLast; ++batch->size, ++entry) {
+				if (tree->GetEntry(entry) <= 0) {
+					std::cerr << "Prefetch: error reading entry " << entry << std::endl;
+					return finish(true);
+				}
+				for (size_t b = 0; b < fBranches.size(); ++b) {
+					const BranchSpec& s = fBranches[b];
+					if (!s.present) continue;
+					double* dst = &batch->values[b][(size_t)batch->size * s.length];
+					if (s.isInt) std::copy(ibuf[b].begin(), ibuf[b].end(), dst);
+					else std::copy(dbuf[b].begin(), dbuf[b].end(), dst);
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(fMutex);
+			fReady.push_back(std::move(batch));
+			fCond.notify_all();
+		}
+		file->Close();
+		finish(false);
+	}
+};
+
+// Entry ranges [first, last) following the tree's clusters, split so that no
+// range holds more than maxEntries events. Ranges are the work units of the
+// event-parallel stages; keeping them inside clusters means no basket is
+// decompressed by two workers. Entries before firstEntry are left out.
+inline std::vector<std::pair<Long64_t, Long64_t>> clusterRanges(TTree* tree, Long64_t maxEntries,
+																 Long64_t firstEntry = 0)
+{
+	std::vector<std::pair<Long64_t, Long64_t>> ranges;
+	Long64_t nEntries = tree->GetEntries();
+	if (firstEntry >= nEntries) return ranges;
+	auto it = tree->GetClusterIterator(firstEntry);
+	Long64_t start;
+	while ((start = it.Next()) < nEntries) {
+		Long64_t end = std::min(it.GetNextEntry(), nEntries);
+		for (Long64_t s = std::max(start, firstEntry); s < end; s += maxEntries) {
+			ranges.emplace_back(s, std::min(s + maxEntries, end));
+		}
+	}
+	return ranges;
+}
+
+// Read-only handle for one worker thread: its own TFile/TTree, only the
+// selected branches enabled and read through a TTreeCache. The nHandles
+// handles a stage opens share a quarter of the memory budget for their
+// caches (at most 64 MB each), held until the handle is destroyed.
+struct TreeHandle {
+	std::unique_ptr<TFile> file;
+	TTree* tree = nullptr;
+	BudgetReservation cache;
+
+	bool open(const char* fileLocation, const char* treeName, unsigned int nHandles = 1)
+	{
+		file.reset(TFile::Open(fileLocation, "READ"));
+		if (!file || file->IsZombie()) {
+			std::cerr << "Error opening file: " << fileLocation << std::endl;
+			return false;
+		}
+		tree = dynamic_cast<TTree*>(file->Get(treeName));
+		if (!tree) {
+			std::cerr << "Error getting tree " << treeName << " from " << fileLocation << std::endl;
+			return false;
+		}
+		tree->SetBranchStatus("*", false);
+		tree->SetCacheSize(cache.reserve(readCacheBytes(nHandles, 64 << 20)));
+		return true;
+	}
+
+	void select(const char* branchName, void* address)
+	{
+		tree->SetBranchStatus(branchName, true);
+		tree->AddBranchToCache(branchName, true);
+		tree->SetBranchAddress(branchName, address);
+	}
+
+	// Prepare the cache for reading entries [first, last)
+	void range(Long64_t first, Long64_t last) { tree->SetCacheEntryRange(first, last); }
+};
+
+#endif
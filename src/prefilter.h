@@ -0,0 +1,303 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include "TVirtualFFT.h"
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Digital pre-filter applied in memory ahead of CFD and charge integration.
+//
+// A filter is given as a short spec string:
+//   ""            no filtering
+//   "ma:N"        moving average over N samples
+//   "trap:L:G"    trapezoidal shaper, rise L, flat top G
+//   "trap:L:G:M"  same with pole-zero correction for a decay of M samples
+//   "iir:a"       single-pole low pass, y += a * (x - y), 0 < a <= 1
+//   "gauss:s"     zero-phase Gaussian smoothing, sigma s samples
+//   "fir:file"    FIR coefficients from a text file
+//
+// The moving-sum filters are computed from one prefix sum, so each output
+// sample is a couple of subtractions. FIR kernels longer than kDirectTaps
+// are applied by FFT convolution with plans and the kernel spectrum cached
+// for the lifetime of the filter. Use one WaveformFilter per thread.
+//
+// The filters are causal; their output is advanced by the nominal delay
+// (rounded to a sample) so pulse features stay at the same index and CFD
+// times and gate positions keep their meaning. Input beyond the last
+// sample is taken as zero (baseline).
+
+class WaveformFilter {
+public:
+	enum Type { kNone, kMovingAverage, kTrapezoid, kLowPass, kFir };
+
+	explicit WaveformFilter(const std::string& spec = "", int nSamples = 10000)
+		: fSpec(spec), fN(nSamples)
+	{
+		parse(spec);
+	}
+
+	~WaveformFilter()
+	{
+		delete fForward;
+		delete fBackward;
+	}
+
+	WaveformFilter(const WaveformFilter&) = delete;
+	WaveformFilter& operator=(const WaveformFilter&) = delete;
+
+	bool ok() const { return fOk; }
+	bool active() const { return fType != kNone; }
+	const std::string& spec() const { return fSpec; }
+
+	// Branch-name friendly form of the spec, e.g. "_ma8" (empty for no filter)
+	std::string tag() const
+	{
+		if (!active()) return "";
+		std::string t = "_";
+		for (char c : fSpec) {
+			if (std::isalnum(static_cast<unsigned char>(c))) t += c;
+			else if (c == '.') t += 'p';
+		}
+		return t;
+	}
+
+	// Filter n samples of in into out (in and out must not overlap)
+	void apply(const double* in, double* out, int n)
+	{
+		const int d = fAdvance;
+		switch (fType) {
+		case kNone:
+			std::copy(in, in + n, out);
+			break;
+		case kMovingAverage:
+			prefix(in, n);
+			for (int j = 0; j < n; ++j) {
+				int t = j + d;
+				out[j] = (S(t) - S(t - fLength)) * fScale;
+			}
+			break;
+		case kTrapezoid:
+			if (fDecay > 0) {
+				trapezoidPoleZero(in, out, n);
+			} else {
+				prefix(in, n);
+				int l = fLength + fGap;
+				for (int j = 0; j < n; ++j) {
+					int t = j + d;
+					out[j] = ((S(t) - S(t - fLength)) - (S(t - l) - S(t - l - fLength))) * fScale;
+				}
+			}
+			break;
+		case kLowPass: {
+			double y = 0.0;
+			for (int t = 0; t < n + d; ++t) {
+				y += fAlpha * ((t < n ? in[t] : 0.0) - y);
+				if (t >= d) out[t - d] = y;
+			}
+			break;
+		}
+		case kFir:
+			if ((int)fKernel.size() <= kDirectTaps || n != fN) {
+				convolveDirect(in, out, n);
+			} else {
+				convolveFFT(in, out, n);
+			}
+			break;
+		}
+	}
+
+	// Filter a batch of events stored back to back (nEvents x n)
+	void applyBatch(const double* in, double* out, int nEvents, int n)
+	{
+		for (int e = 0; e < nEvents; ++e) {
+			apply(in + (size_t)e * n, out + (size_t)e * n, n);
+		}
+	}
+
+private:
+	static const int kDirectTaps = 64;
+
+	std::string fSpec;
+	int fN;
+	Type fType = kNone;
+	bool fOk = true;
+	int fLength = 1;
+	int fGap = 0;
+	double fDecay = 0.0;
+	double fAlpha = 1.0;
+	double fScale = 1.0;
+	int fAdvance = 0;                 // nominal delay taken out of the output
+	std::vector<double> fKernel;
+	std::vector<double> fPrefix;      // fPrefix[j+1] = sum in[0..j]
+
+	// FFT convolution state
+	int fFFTSize = 0;
+	TVirtualFFT* fForward = nullptr;
+	TVirtualFFT* fBackward = nullptr;
+	std::vector<double> fKernelRe, fKernelIm, fRe, fIm, fPadded;
+
+	// Prefix sum of the input, zero before the record and flat after it
+	double S(int j) const { return j < 0 ? 0.0 : fPrefix[std::min<int>(j + 1, fPrefix.size() - 1)]; }
+
+	void prefix(const double* in, int n)
+	{
+		fPrefix.resize(n + 1);
+		fPrefix[0] = 0.0;
+		for (int j = 0; j < n; ++j) fPrefix[j + 1] = fPrefix[j] + in[j];
+	}
+
+	void fail(const std::string& why)
+	{
+		std::cerr << "Bad filter spec \"" << fSpec << "\": " << why << std::endl;
+		fOk = false;
+		fType = kNone;
+	}
+
+	void parse(const std::string& spec)
+	{
+		if (spec.empty()) return;
+		std::vector<std::string> f;
+		std::stringstream ss(spec);
+		std::string item;
+		while (std::getline(ss, item, ':')) f.push_back(item);
+
+		if (f[0] == "ma" && f.size() == 2) {
+			fType = kMovingAverage;
+			fLength = std::atoi(f[1].c_str());
+			if (fLength < 1) return fail("length must be >= 1");
+			fScale = 1.0 / fLength;
+			fAdvance = (fLength - 1) / 2;
+		} else if (f[0] == "trap" && (f.size() == 3 || f.size() == 4)) {
+			fType = kTrapezoid;
+			fLength = std::atoi(f[1].c_str());
+			fGap = std::atoi(f[2].c_str());
+			if (f.size() == 4) fDecay = std::atof(f[3].c_str());
+			if (fLength < 1 || fGap < 0 || fDecay < 0) return fail("need L >= 1, G >= 0, M >= 0");
+			fScale = fDecay > 0 ? 1.0 / (fLength * fDecay) : 1.0 / fLength;
+			fAdvance = (fLength - 1) / 2;
+		} else if (f[0] == "iir" && f.size() == 2) {
+			fType = kLowPass;
+			fAlpha = std::atof(f[1].c_str());
+			if (!(fAlpha > 0 && fAlpha <= 1)) return fail("need 0 < a <= 1");
+			fAdvance = static_cast<int>(std::lround((1.0 - fAlpha) / fAlpha));
+		} else if (f[0] == "gauss" && f.size() == 2) {
+			fType = kFir;
+			double sigma = std::atof(f[1].c_str());
+			if (!(sigma > 0)) return fail("sigma must be > 0");
+			int half = static_cast<int>(std::ceil(4 * sigma));
+			double sum = 0.0;
+			for (int k = -half; k <= half; ++k) {
+				fKernel.push_back(std::exp(-0.5 * k * k / (sigma * sigma)));
+				sum += fKernel.back();
+			}
+			for (double& c : fKernel) c /= sum;
+		} else if (f[0] == "fir" && f.size() == 2) {
+			fType = kFir;
+			std::ifstream in(f[1].c_str());
+			double c;
+			while (in >> c) fKernel.push_back(c);
+			if (fKernel.empty()) return fail("no coefficients in " + f[1]);
+		} else {
+			return fail("unknown filter");
+		}
+
+		if (fType == kFir) {
+			// Kernel centroid; exactly the centre for a symmetric kernel
+			double sum = 0.0, moment = 0.0;
+			for (size_t k = 0; k < fKernel.size(); ++k) {
+				sum += fKernel[k];
+				moment += k * fKernel[k];
+			}
+			fAdvance = sum != 0.0 ? std::max(0, static_cast<int>(std::lround(moment / sum))) : 0;
+		}
+
+		if (fType == kFir && (int)fKernel.size() > kDirectTaps) setupFFT();
+	}
+
+	// Jordanov's recursive trapezoid with pole-zero correction
+	void trapezoidPoleZero(const double* in, double* out, int n)
+	{
+		int k = fLength, l = fLength + fGap;
+		auto v = [&](int j) { return (j < 0 || j >= n) ? 0.0 : in[j]; };
+		double p = 0.0, s = 0.0;
+		for (int t = 0; t < n + fAdvance; ++t) {
+			double d = v(t) - v(t - k) - v(t - l) + v(t - k - l);
+			p += d;
+			s += p + fDecay * d;
+			if (t >= fAdvance) out[t - fAdvance] = s * fScale;
+		}
+	}
+
+	void convolveDirect(const double* in, double* out, int n)
+	{
+		const int m = fKernel.size();
+		for (int j = 0; j < n; ++j) {
+			int src = j + fAdvance;
+			double acc = 0.0;
+			int kMin = std::max(0, src - (n - 1));
+			int kMax = std::min(m - 1, src);
+			for (int k = kMin; k <= kMax; ++k) {
+				acc += fKernel[k] * in[src - k];
+			}
+			out[j] = acc;
+		}
+	}
+
+	void setupFFT()
+	{
+		// FFTW planning is not thread safe
+		static std::mutex planMutex;
+		std::lock_guard<std::mutex> lock(planMutex);
+
+		fFFTSize = 1;
+		while (fFFTSize < fN + (int)fKernel.size() - 1) fFFTSize <<= 1;
+		int size = fFFTSize;
+		fForward = TVirtualFFT::FFT(1, &size, "R2C M K");
+		fBackward = TVirtualFFT::FFT(1, &size, "C2R M K");
+		if (!fForward || !fBackward) return fail("no FFT backend available");
+
+		int nc = fFFTSize / 2 + 1;
+		fKernelRe.resize(nc);
+		fKernelIm.resize(nc);
+		fRe.resize(nc);
+		fIm.resize(nc);
+		fPadded.assign(fFFTSize, 0.0);
+		std::copy(fKernel.begin(), fKernel.end(), fPadded.begin());
+		fForward->SetPoints(fPadded.data());
+		fForward->Transform();
+		fForward->GetPointsComplex(fKernelRe.data(), fKernelIm.data());
+	}
+
+	void convolveFFT(const double* in, double* out, int n)
+	{
+		std::fill(fPadded.begin(), fPadded.end(), 0.0);
+		std::copy(in, in + n, fPadded.begin());
+		fForward->SetPoints(fPadded.data());
+		fForward->Transform();
+		fForward->GetPointsComplex(fRe.data(), fIm.data());
+
+		const int nc = fRe.size();
+		const double norm = 1.0 / fFFTSize;
+		for (int k = 0; k < nc; ++k) {
+			double re = fRe[k] * fKernelRe[k] - fIm[k] * fKernelIm[k];
+			double im = fRe[k] * fKernelIm[k] + fIm[k] * fKernelRe[k];
+			fRe[k] = re * norm;
+			fIm[k] = im * norm;
+		}
+		fBackward->SetPointsComplex(fRe.data(), fIm.data());
+		fBackward->Transform();
+		fBackward->GetPoints(fPadded.data());
+		for (int j = 0; j < n; ++j) out[j] = fPadded[j + fAdvance];
+	}
+};
+
+#endif
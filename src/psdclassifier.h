@@ -0,0 +1,255 @@
+#ifndef PSDCLASSIFIER_H
+#define PSDCLASSIFIER_H
+
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+
+// Standalone pulse-shape classifier for raw records, without ROOT.
+//
+// It applies the steps bslAdjust(), t0() and qdc()/qratio() (or
+// fisher_apply()) take on the way to a discriminant, straight on one raw
+// record, without building the adjusted or aligned pulse:
+//   baseline  mean of the first baselineSamples samples
+//   t0        first CFD crossing before the peak, both searched only inside
+//             [searchBegin, searchEnd), the record window the training pulses
+//             fall in (the macros search the whole record)
+//   gate      Q1 = [start, t1), Q2 = [tail, t2) in aligned indices (t0 at
+//             alignIndex), discriminant Q2/Q1
+//   weights   discriminant sum_b w[b] Q_b over bins of weightsBin aligned
+//             samples from weightsBegin to weightsEnd (Q_b the charge in bin
+//             b), divided by the charge there if normalise; fisher_train()
+//             weights are constant within each bin, so one weight per bin
+// The discriminant is then scored against the Gaussian each training dataset
+// gave: the class is the more likely one, the confidence its posterior
+// probability with equal priors.
+//
+// All parameters are constants exported by exportclassifier.cpp into a
+// generated header (psdExportedParams()); classifier_bench.cpp measures the
+// rate against its per-event budget. Samples may be any arithmetic type
+// (ADC counts, float or double).
+
+enum PsdKind { kPsdGate = 0, kPsdWeights = 1 };
+
+struct PsdClassifierParams {
+	int kind = kPsdGate;
+	int baselineSamples = 100;
+	double cfdFraction = 0.1;
+	int polarity = 1;             // sign of the pulses
+	int searchBegin = 0;          // record window searched for the peak and CFD crossing
+	int searchEnd = 10000;
+	int alignIndex = 1000;        // aligned index of t0
+
+	int start = 1000, t1 = 1100, tail = 1000, t2 = 6100;   // gate, aligned indices
+
+	const double* weights = nullptr;                       // weights[(a - weightsBegin) / weightsBin]
+	int weightsBegin = 0, weightsEnd = 0, weightsBin = 1;
+	double weightSum = 0.0;                                // sum of the weights over all samples
+	bool normalise = true;
+
+	double mean[2] = {0.0, 0.0};  // discriminant of each class
+	double sigma[2] = {1.0, 1.0};
+};
+
+struct PsdDecision {
+	int cls = -1;                 // 0 or 1; -1 if no CFD crossing was found
+	double confidence = 0.0;      // posterior probability of cls
+	double discriminant = 0.0;
+};
+
+// Sums are kept in independent lanes, so long gates vectorize without
+// reassociating one accumulator (no -ffast-math needed). Within a block the
+// lanes add in the sample type's own precision (exact 64-bit integers for ADC
+// counts, float for float samples) and are then added pairwise, so a block
+// costs one addition in double.
+static const int kPsdLanes = 16;
+static const int kPsdBlock = 512;
+
+template <typename Sample>
+using PsdAccum = typename std::conditional<std::is_integral<Sample>::value, long long,
+	typename std::conditional<std::is_same<Sample, float>::value, float, double>::type>::type;
+
+// Weighted sums add in float unless the samples are double
+template <typename Sample>
+using PsdDotAccum = typename std::conditional<std::is_same<Sample, double>::value, double, float>::type;
+
+template <typename T>
+inline T psdReduceLanes(T* acc)
+{
+	for (int w = kPsdLanes / 2; w > 0; w /= 2) {
+		for (int l = 0; l < w; ++l) acc[l] += acc[l + w];
+	}
+	return acc[0];
+}
+
+template <typename Sample>
+inline double psdSum(const Sample* x, int j0, int j1)
+{
+	double sum = 0.0;
+	int j = j0;
+	while (j + kPsdLanes <= j1) {
+		PsdAccum<Sample> acc[kPsdLanes] = {};
+		const int blockEnd = std::min(j1, j + kPsdBlock);
+		for (; j + kPsdLanes <= blockEnd; j += kPsdLanes) {
+			for (int l = 0; l < kPsdLanes; ++l) acc[l] += x[j + l];
+		}
+		sum += psdReduceLanes(acc);
+	}
+	for (; j < j1; ++j) sum += x[j];
+	return sum;
+}
+
+// acc += w x[j, end) in lanes, the samples short of a full set of lanes in rest
+template <typename Sample>
+inline void psdWeightedAdd(PsdDotAccum<Sample>* acc, PsdDotAccum<Sample>& rest, const Sample* x, int j, int end,
+						   PsdDotAccum<Sample> w)
+{
+	for (; j + kPsdLanes <= end; j += kPsdLanes) {
+		for (int l = 0; l < kPsdLanes; ++l) acc[l] += w * x[j + l];
+	}
+	for (; j < end; ++j) rest += w * x[j];
+}
+
+// Sum of w[b] x over x[j0, j1) in bins of width samples, bin b ending at
+// j0 - phase + (b + 1) width (phase: samples of bin 0 before j0). Each bin's
+// weight multiplies a whole lane set, and consecutive bins alternate between
+// two lane sets, so the additions of neighbouring bins do not wait on each
+// other; the sets are reduced about once per kPsdBlock samples.
+template <typename Sample>
+inline double psdBinnedDot(const Sample* x, int j0, int j1, const double* w, int width, int phase = 0)
+{
+	typedef PsdDotAccum<Sample> Accum;
+	double dot = 0.0;
+	if (phase > 0) {
+		// Partial first bin, so the rest start on bin edges
+		const int e = std::min(j1, j0 - phase + width);
+		dot = w[0] * psdSum(x, j0, e);
+		j0 = e;
+		++w;
+	}
+	const int nBins = (j1 - j0 + width - 1) / width;
+	const int blockBins = std::max(2, kPsdBlock / width) & ~1;
+	for (int b = 0; b < nBins;) {
+		Accum even[kPsdLanes] = {}, odd[kPsdLanes] = {};
+		Accum evenRest = 0, oddRest = 0;
+		const int blockEnd = std::min(nBins, b + blockBins);
+		for (; b + 1 < blockEnd; b += 2) {
+			const int s = j0 + b * width, e0 = std::min(j1, s + width), e1 = std::min(j1, e0 + width);
+			psdWeightedAdd(even, evenRest, x, s, e0, Accum(w[b]));
+			psdWeightedAdd(odd, oddRest, x, e0, e1, Accum(w[b + 1]));
+		}
+		if (b < blockEnd) {
+			const int s = j0 + b * width;
+			psdWeightedAdd(even, evenRest, x, s, std::min(j1, s + width), Accum(w[b]));
+			++b;
+		}
+		for (int l = 0; l < kPsdLanes; ++l) even[l] += odd[l];
+		dot += psdReduceLanes(even) + double(evenRest) + oddRest;
+	}
+	return dot;
+}
+
+// Sum of x[a - shift] - baseline over aligned [a0, a1), samples outside the
+// record counting as zero as alignPulse() fills them
+template <typename Sample>
+inline double psdCharge(const Sample* x, int n, int shift, double baseline, int a0, int a1)
+{
+	int j0 = std::max(0, a0 - shift), j1 = std::min(n, a1 - shift);
+	return j1 > j0 ? psdSum(x, j0, j1) - baseline * (j1 - j0) : 0.0;
+}
+
+// Lowest (negative) or highest sample of x[j0, j1), j1 > j0, in the sample type
+template <bool negative, typename Sample>
+inline Sample psdExtremum(const Sample* x, int j0, int j1)
+{
+	Sample lanes[kPsdLanes];
+	std::fill(lanes, lanes + kPsdLanes, x[j0]);
+	int j = j0;
+	for (; j + kPsdLanes <= j1; j += kPsdLanes) {
+		for (int l = 0; l < kPsdLanes; ++l) {
+			const Sample v = x[j + l];
+			lanes[l] = negative ? (v < lanes[l] ? v : lanes[l]) : (v > lanes[l] ? v : lanes[l]);
+		}
+	}
+	Sample m = lanes[0];
+	for (int l = 1; l < kPsdLanes; ++l) m = negative ? std::min(m, lanes[l]) : std::max(m, lanes[l]);
+	for (; j < j1; ++j) m = negative ? std::min(m, x[j]) : std::max(m, x[j]);
+	return m;
+}
+
+template <typename Sample>
+inline PsdDecision psdClassify(const Sample* x, int n, const PsdClassifierParams& p)
+{
+	PsdDecision d;
+	const int nb = std::min(p.baselineSamples, n);
+	const double baseline = nb > 0 ? psdSum(x, 0, nb) / nb : 0.0;
+
+	// Peak (largest signed sample, first of equals) and first CFD crossing before it
+	const int begin = std::max(0, p.searchBegin), end = std::min(n, p.searchEnd);
+	if (end <= begin) return d;
+	const double sign = p.polarity < 0 ? -1.0 : 1.0;
+	const Sample peakSample = p.polarity < 0 ? psdExtremum<true>(x, begin, end) : psdExtremum<false>(x, begin, end);
+	int peak = begin;
+	while (peak < end - 1 && x[peak] != peakSample) ++peak;
+	const double peakVal = sign * (peakSample - baseline);
+
+	const double threshold = p.cfdFraction * peakVal;
+	int t0 = -1;
+	for (int k = begin; k < peak; ++k) {
+		if (sign * (x[k] - baseline) < threshold && sign * (x[k + 1] - baseline) >= threshold) {
+			t0 = k;
+			break;
+		}
+	}
+	if (t0 < 0 || !(peakVal > 0)) return d;
+	const int shift = p.alignIndex - t0;
+
+	if (p.kind == kPsdGate) {
+		// Each sample is summed once: segments between the sorted gate points
+		int pts[4] = {p.start, p.t1, p.tail, p.t2};
+		std::sort(pts, pts + 4);
+		double seg[3];
+		for (int k = 0; k < 3; ++k) seg[k] = psdCharge(x, n, shift, baseline, pts[k], pts[k + 1]);
+		double q1 = 0.0, q2 = 0.0;
+		for (int k = 0; k < 3; ++k) {
+			if (pts[k] >= p.start && pts[k + 1] <= p.t1) q1 += seg[k];
+			if (pts[k] >= p.tail && pts[k + 1] <= p.t2) q2 += seg[k];
+		}
+		if (q1 == 0.0) return d;
+		d.discriminant = q2 / q1;
+	} else {
+		// Window clipped to the record, samples outside it counting as zero;
+		// sum w (x - baseline) = sum w x - baseline sum w, with the weight sum
+		// baked in unless the record edge clips the window
+		const int a0 = std::max(p.weightsBegin, shift), a1 = std::min(p.weightsEnd, n + shift);
+		double dot = 0.0, total = 0.0;
+		if (a1 > a0) {
+			const int first = (a0 - p.weightsBegin) / p.weightsBin;
+			const int phase = (a0 - p.weightsBegin) % p.weightsBin;
+			double weightSum = p.weightSum;
+			if (a0 != p.weightsBegin || a1 != p.weightsEnd) {
+				weightSum = 0.0;
+				for (int b = first, e = a0 - phase; e < a1; ++b, e += p.weightsBin) {
+					weightSum += p.weights[b] * (std::min(a1, e + p.weightsBin) - std::max(a0, e));
+				}
+			}
+			dot = psdBinnedDot(x, a0 - shift, a1 - shift, p.weights + first, p.weightsBin, phase) - baseline * weightSum;
+			total = psdSum(x, a0 - shift, a1 - shift) - baseline * (a1 - a0);
+		}
+		d.discriminant = p.normalise ? (total != 0.0 ? dot / total : 0.0) : dot;
+	}
+	if (!std::isfinite(d.discriminant)) return d;
+
+	// Gaussian log-likelihoods of the two classes
+	double ll[2];
+	for (int c = 0; c < 2; ++c) {
+		double z = (d.discriminant - p.mean[c]) / p.sigma[c];
+		ll[c] = -0.5 * z * z - std::log(p.sigma[c]);
+	}
+	double p0 = 1.0 / (1.0 + std::exp(std::min(ll[1] - ll[0], 700.0)));
+	d.cls = p0 >= 0.5 ? 0 : 1;
+	d.confidence = d.cls == 0 ? p0 : 1.0 - p0;
+	return d;
+}
+
+#endif
@@ -0,0 +1,192 @@
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include "TROOT.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gatescan.h"
+#include "prefetchreader.h"
+#include "threadpool.h"
+
+// Python module for exploring the gate scan from plotmatrix.ipynb.
+// Build with scripts/build_psdpy.sh, then in the notebook:
+//
+//   import psdpy
+//   c10 = psdpy.read_charges("degrees_10_adjusted.root")
+//   c30 = psdpy.read_charges("degrees_30_adjusted.root")
+//   fom = psdpy.fom_matrix(c10, c30)        # fom[i1, i2], gates edges()[i1] -> edges()[i2]
+//   c10.q                                   # (events, edges) view of the edge charges
+//
+// Charge tables and FOM matrices are handed to NumPy without copying: q is a
+// view of the table (kept alive by the array), and results are written
+// straight into arrays NumPy owns. Reading and scanning release the GIL and
+// run on nThreads workers (0 = one per core), as the macros do.
+
+namespace py = pybind11;
+
+// NumPy array taking ownership of a vector's storage
+template <typename T>
+static py::array_t<T> ownedArray(std::vector<T>&& v)
+{
+	auto* owner = new std::vector<T>(std::move(v));
+	py::capsule release(owner, [](void* p) { delete static_cast<std::vector<T>*>(p); });
+	return py::array_t<T>(owner->size(), owner->data(), release);
+}
+
+static int edgeIndex(const GateGrid& grid, int t)
+{
+	for (int i = 0; i < grid.nSteps; ++i) {
+		if (grid.edge(i) == t) return i;
+	}
+	throw py::value_error("gate end " + std::to_string(t) + " is not on the grid");
+}
+
+// Edge charges of entries [first, last), read in ranges on nThreads workers
+// and assembled in entry order
+static std::shared_ptr<ChargeTable> readCharges(const std::string& fileLocation, const std::string& branch,
+												int tMin, int tMax, int nSteps, Long64_t first, Long64_t last,
+												unsigned int nThreads)
+{
+	GateGrid grid;
+	grid.tMin = tMin;
+	grid.tMax = tMax;
+	grid.nSteps = nSteps;
+	if (nSteps < 2 || tMin <= grid.t0 || tMax > kNSamples || tMin >= tMax) {
+		throw py::value_error("invalid gate grid");
+	}
+
+	TreeHandle probe;
+	if (!probe.open(fileLocation.c_str(), "adjustedTree")) {
+		throw std::runtime_error("cannot read " + fileLocation);
+	}
+	Long64_t nEntries = probe.tree->GetEntries();
+	if (last < 0 || last > nEntries) last = nEntries;
+	if (first > last) first = last;
+	// A few ranges per thread; each is read through its own file handle
+	std::vector<std::pair<Long64_t, Long64_t>> ranges;
+	Long64_t perRange = std::max<Long64_t>(4096, (last - first) / (4 * workerCount(nThreads)) + 1);
+	for (Long64_t a = first; a < last; a += perRange) {
+		ranges.emplace_back(a, std::min(a + perRange, last));
+	}
+
+	auto table = std::make_shared<ChargeTable>();
+	table->grid = grid;
+	table->resize(last - first);
+	std::atomic<bool> failed{false};
+	{
+		py::gil_scoped_release noGil;
+		parallelFor(ranges.size(), nThreads, [&](size_t c, unsigned int) {
+			ChargeTable part;
+			if (!readChargeTable(fileLocation.c_str(), branch.c_str(), grid, part, ranges[c].first, ranges[c].second)) {
+				failed = true;
+				return;
+			}
+			std::copy(part.q.data(), part.q.data() + part.q.size(), table->row(ranges[c].first - first));
+		});
+	}
+	if (failed) throw std::runtime_error("error reading " + branch + " from " + fileLocation);
+	return table;
+}
+
+// FOM of every gate of the grid, fom[i1, i2]; 0 where edge(i1) >= edge(i2)
+static py::array_t<double> fomMatrix(const ChargeTable& c1, const ChargeTable& c2, int nBins, unsigned int nThreads)
+{
+	if (c1.grid.nSteps != c2.grid.nSteps || c1.grid.tMin != c2.grid.tMin || c1.grid.tMax != c2.grid.tMax) {
+		throw py::value_error("charge tables are on different gate grids");
+	}
+	const int nEdges = c1.grid.nSteps;
+	py::array_t<double> result({nEdges, nEdges});
+	double* fom = result.mutable_data();
+	std::fill(fom, fom + nEdges * nEdges, 0.0);
+	{
+		py::gil_scoped_release noGil;
+		parallelFor(nEdges, nThreads, [&](size_t i1, unsigned int) {
+			std::vector<double> r1, r2;
+			for (int i2 = i1 + 1; i2 < nEdges; ++i2) {
+				fom[i1 * nEdges + i2] = gateFom(c1, c2, i1, i2, nBins, r1, r2);
+			}
+		});
+	}
+	return result;
+}
+
+// Stored values of one waveform branch for entries [first, first + count),
+// as (events, samples), with the per-event ROI offsets (zeros if uncropped)
+static py::tuple readWaveforms(const std::string& fileLocation, const std::string& branch,
+							   Long64_t first, Long64_t count)
+{
+	PrefetchReader reader(fileLocation.c_str(), "adjustedTree");
+	int wave = reader.addBranch(branch.c_str());
+	int offset = reader.addBranch("roi_offset", true);
+	if (!reader.start(first, count < 0 ? -1 : first + count)) {
+		throw std::runtime_error("cannot read " + branch + " from " + fileLocation);
+	}
+	const Long64_t n = reader.entries();
+	const int length = reader.length(wave);
+	py::array_t<double> pulses({n, (Long64_t)length});
+	py::array_t<int> offsets(n);
+	double* out = pulses.mutable_data();
+	int* outOffset = offsets.mutable_data();
+	{
+		py::gil_scoped_release noGil;
+		Long64_t row = 0;
+		while (const EventBatch* batch = reader.next()) {
+			std::copy(batch->get(wave, 0), batch->get(wave, 0) + (size_t)batch->size * length, out + row * length);
+			for (int b = 0; b < batch->size; ++b) {
+				outOffset[row + b] = reader.has(offset) ? static_cast<int>(*batch->get(offset, b)) : 0;
+			}
+			row += batch->size;
+		}
+	}
+	if (reader.failed()) throw std::runtime_error("error reading " + fileLocation);
+	return py::make_tuple(pulses, offsets);
+}
+
+PYBIND11_MODULE(psdpy, m)
+{
+	ROOT::EnableThreadSafety();
+	m.doc() = "Gate scan, FOM and waveform access for the PSD analysis";
+
+	py::class_<ChargeTable, std::shared_ptr<ChargeTable>>(m, "ChargeTable")
+		.def_property_readonly("n_events", [](const ChargeTable& t) { return t.nEvents; })
+		.def_property_readonly("spilled", [](const ChargeTable& t) { return t.q.spilled(); })
+		.def("edges", [](const ChargeTable& t) {
+			std::vector<int> e(t.grid.nSteps);
+			for (int i = 0; i < t.grid.nSteps; ++i) e[i] = t.grid.edge(i);
+			return ownedArray(std::move(e));
+		}, "Gate end of every grid edge (samples)")
+		.def_property_readonly("q", [](py::object self) {
+			ChargeTable& t = self.cast<ChargeTable&>();
+			const py::ssize_t n = t.grid.nSteps;
+			return py::array_t<double>({(py::ssize_t)t.nEvents, n}, {n * (py::ssize_t)sizeof(double), (py::ssize_t)sizeof(double)},
+									   t.q.data(), self);
+		}, "Charge from the aligned CFD point to every edge, (events, edges); a view, not a copy")
+		.def("ratios", [](const ChargeTable& t, int t1, int t2) {
+			std::vector<double> r;
+			collectRatios(t, edgeIndex(t.grid, t1), edgeIndex(t.grid, t2), r);
+			return ownedArray(std::move(r));
+		}, py::arg("t1"), py::arg("t2"), "Q2/Q1 of every event for gates ending at t1 and t2, with qratio's cuts");
+
+	m.def("read_charges", &readCharges, "Edge-charge table of an adjusted file",
+		  py::arg("file"), py::arg("branch") = "t0aligned_cfd0.10", py::arg("t_min") = 1100,
+		  py::arg("t_max") = 6100, py::arg("n_steps") = 51, py::arg("first") = 0, py::arg("last") = -1,
+		  py::arg("n_threads") = 0);
+
+	m.def("gate_fom", [](const ChargeTable& c1, const ChargeTable& c2, int t1, int t2, int nBins) {
+		int i1 = edgeIndex(c1.grid, t1), i2 = edgeIndex(c1.grid, t2);
+		std::vector<double> r1, r2;
+		py::gil_scoped_release noGil;
+		return gateFom(c1, c2, i1, i2, nBins, r1, r2);
+	}, "qratio() FOM of one gate pair", py::arg("c1"), py::arg("c2"), py::arg("t1"), py::arg("t2"),
+		  py::arg("n_bins") = 500);
+
+	m.def("fom_matrix", &fomMatrix, "FOM of every gate pair of the grid, fom[i1, i2]",
+		  py::arg("c1"), py::arg("c2"), py::arg("n_bins") = 500, py::arg("n_threads") = 0);
+
+	m.def("read_waveforms", &readWaveforms, "(pulses, roi_offsets) of one waveform branch",
+		  py::arg("file"), py::arg("branch") = "t0aligned_cfd0.10", py::arg("first") = 0, py::arg("count") = -1);
+
+	m.def("set_memory_budget", &setMemoryBudget, "Memory budget in MB (see memorybudget.h)", py::arg("mb"));
+}
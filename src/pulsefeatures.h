@@ -0,0 +1,109 @@
+#ifndef PULSEFEATURES_H
+#define PULSEFEATURES_H
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pulseproc.h"
+
+// Pulse-shape features of an aligned pulse, computed together.
+//
+// One sweep over [start, end) accumulates everything that needs the whole
+// pulse (charge, first moment, tail charge, extrema); the remaining features
+// only walk a few samples around the peak. Polarity is taken from the larger
+// extremum, as in cfdTime(), and all features are for the pulse flipped
+// positive.
+//
+//   amp        peak amplitude
+//   peak       peak position (samples)
+//   rise       10-90% rise time before the peak (samples, interpolated)
+//   tailtotal  charge in [tailStart, end) over charge in [start, end)
+//   meantime   charge-weighted mean time after start (samples)
+//   tot        time the pulse stays above totFraction * amp around the peak
+
+enum PulseFeature { kAmp, kPeak, kRise, kTailTotal, kMeanTime, kTot, kNFeatures };
+
+static const char* const kFeatureNames[kNFeatures] = { "amp", "peak", "rise", "tailtotal", "meantime", "tot" };
+
+struct FeatureConfig {
+	int start = kAlignIndex;    // integration start, as the gates
+	int tailStart = 1300;
+	int end = 6100;
+	double totFraction = 0.2;
+	bool enabled[kNFeatures] = { true, true, true, true, true, true };
+
+	// "all" or a comma separated list of feature names; false on an unknown name
+	bool select(const std::string& list)
+	{
+		if (list == "all") {
+			for (bool& e : enabled) e = true;
+			return true;
+		}
+		for (bool& e : enabled) e = false;
+		std::stringstream ss(list);
+		std::string item;
+		while (std::getline(ss, item, ',')) {
+			int f = 0;
+			while (f < kNFeatures && item != kFeatureNames[f]) ++f;
+			if (f == kNFeatures) return false;
+			enabled[f] = true;
+		}
+		return true;
+	}
+};
+
+// Interpolated index where w (flipped by sign) falls below level walking back from peak
+inline double crossingBefore(const double* w, int peak, double sign, double level)
+{
+	for (int j = peak; j > 0; --j) {
+		double a = sign * w[j - 1], b = sign * w[j];
+		if (a < level) return (j - 1) + (level - a) / (b - a);
+	}
+	return 0.0;
+}
+
+inline void pulseFeatures(const double* w, const FeatureConfig& cfg, double* out)
+{
+	// Single sweep: sums are branch free, extrema use conditional moves
+	double sum = 0.0, moment = 0.0, tail = 0.0;
+	double maxVal = w[cfg.start], minVal = w[cfg.start];
+	int maxIdx = cfg.start, minIdx = cfg.start;
+	for (int j = cfg.start; j < cfg.end; ++j) {
+		double x = w[j];
+		sum += x;
+		moment += (j - cfg.start) * x;
+		tail += (j >= cfg.tailStart) ? x : 0.0;
+		maxIdx = x > maxVal ? j : maxIdx;
+		maxVal = x > maxVal ? x : maxVal;
+		minIdx = x < minVal ? j : minIdx;
+		minVal = x < minVal ? x : minVal;
+	}
+
+	double sign = std::fabs(minVal) > std::fabs(maxVal) ? -1.0 : 1.0;
+	int peak = sign > 0 ? maxIdx : minIdx;
+	double amp = sign * w[peak];
+
+	out[kAmp] = amp;
+	out[kPeak] = peak;
+	out[kTailTotal] = sum != 0.0 ? tail / sum : 0.0;
+	out[kMeanTime] = sum != 0.0 ? moment / sum : 0.0;
+
+	if (cfg.enabled[kRise]) {
+		out[kRise] = crossingBefore(w, peak, sign, 0.9 * amp) - crossingBefore(w, peak, sign, 0.1 * amp);
+	}
+	if (cfg.enabled[kTot]) {
+		double level = cfg.totFraction * amp;
+		int last = peak;
+		while (last + 1 < cfg.end && sign * w[last + 1] >= level) ++last;
+		double fall = last;
+		if (last + 1 < cfg.end) {
+			double a = sign * w[last], b = sign * w[last + 1];
+			fall += (a - level) / (a - b);
+		}
+		out[kTot] = fall - crossingBefore(w, peak, sign, level);
+	}
+}
+
+#endif
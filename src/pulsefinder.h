@@ -0,0 +1,140 @@
+#ifndef PULSEFINDER_H
+#define PULSEFINDER_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "pulseproc.h"
+
+// Pulse finding for records that may hold more than one pulse.
+//
+// The trigger is a k-sample difference x[j] - x[j-k] (x the record flipped to
+// positive polarity) against triggerSigma times its noise, estimated from the
+// first kBaselineSamples of the record. Only the stored samples [first, last)
+// of an ROI-cropped record are searched, and the noise is taken from the
+// first of those, not from the zero fill of expandWindow(). After a trigger the peak is the first
+// maximum (within peakSearch samples); the trigger re-arms holdoff samples
+// after the peak, so a second pulse on the falling edge or tail of the first
+// is found as soon as it rises. Each pulse spans the record from preSamples
+// before its trigger (but not before the previous peak) up to the next trigger.
+//
+// Pulses are flagged (PileupFlag) when their baseline had to be taken from
+// the previous pulse's tail, when the next pulse starts inside their long
+// gate, or when two pulses are too close to separate at all: triggers less
+// than minSeparation apart, or a second pulse arriving during the rise of the
+// first, which shows as a rise longer than maxRise (set it from clean pulses).
+
+enum PileupFlag {
+	kPileOnTail = 1,        // starts on the tail of the previous pulse (baseline is local)
+	kPileTruncated = 2,     // next pulse starts within gateLength after this trigger
+	kPileUnresolved = 4     // next pulse within minSeparation of this peak; both are suspect
+};
+
+struct PulseFinderConfig {
+	int diffSpan = 4;          // k of the trigger difference
+	double triggerSigma = 6.0; // trigger threshold in units of the difference noise
+	int peakSearch = 100;      // samples after the trigger searched for the peak
+	int maxRise = 32;          // longer trigger-to-peak rises are two merged pulses (0: no check)
+	int holdoff = 8;           // samples after the peak before re-arming
+	int preSamples = 100;      // samples before the trigger kept with the pulse (baseline region)
+	int baselineGuard = 4;     // samples just before the trigger left out of the baseline
+	int minSeparation = 30;    // closer triggers are not resolvable
+	int gateLength = 5100;     // long gate after the pulse start (6100 - 1000)
+};
+
+struct FoundPulse {
+	int trigger = 0;           // start of the triggering rise
+	int peak = 0;
+	int begin = 0;             // record range of the pulse
+	int end = 0;
+	double baseline = 0.0;     // local baseline, in the record's polarity
+	double amplitude = 0.0;    // peak above the local baseline, positive
+	int flags = 0;
+};
+
+// RMS of w[0, n) about its mean
+inline double recordNoise(const double* w, int n)
+{
+	if (n <= 1) return 0.0;
+	double sum = 0.0, sum2 = 0.0;
+	for (int j = 0; j < n; ++j) {
+		sum += w[j];
+		sum2 += w[j] * w[j];
+	}
+	double mean = sum / n;
+	double var = sum2 / n - mean * mean;
+	return var > 0 ? std::sqrt(var) : 0.0;
+}
+
+// last < 0 means n
+inline void findPulses(const double* w, int n, const PulseFinderConfig& cfg, std::vector<FoundPulse>& pulses,
+					   int first = 0, int last = -1)
+{
+	pulses.clear();
+	first = std::max(0, first);
+	last = last < 0 ? n : std::min(n, last);
+	if (last - first <= cfg.diffSpan) return;
+
+	// Polarity from the larger extremum, as in cfdTime()
+	double maxVal = w[first], minVal = w[first];
+	for (int j = first + 1; j < last; ++j) {
+		maxVal = std::max(maxVal, w[j]);
+		minVal = std::min(minVal, w[j]);
+	}
+	const double sign = std::fabs(minVal) > std::fabs(maxVal) ? -1.0 : 1.0;
+
+	const double noise = recordNoise(w + first, std::min(last - first, kBaselineSamples));
+	const double threshold = std::max(cfg.triggerSigma * noise * std::sqrt(2.0), 1e-12);
+
+	const int k = cfg.diffSpan;
+	int j = first + k;
+	while (j < last) {
+		if (sign * (w[j] - w[j - k]) <= threshold) {
+			++j;
+			continue;
+		}
+		FoundPulse p;
+		p.trigger = j - k;
+		// First maximum: stop once the pulse has fallen by the trigger threshold
+		int searchEnd = std::min(last, j + cfg.peakSearch);
+		p.peak = j;
+		for (int i = j; i < searchEnd; ++i) {
+			if (sign * w[i] > sign * w[p.peak]) p.peak = i;
+			else if (sign * (w[p.peak] - w[i]) > threshold) break;
+		}
+		if (cfg.maxRise > 0 && p.peak - p.trigger > cfg.maxRise) p.flags |= kPileUnresolved;
+		pulses.push_back(p);
+		j = p.peak + cfg.holdoff + k;
+	}
+
+	for (size_t i = 0; i < pulses.size(); ++i) {
+		FoundPulse& p = pulses[i];
+		int previousEnd = i > 0 ? pulses[i - 1].peak : first - 1;
+
+		// Baseline from the quiet samples before the trigger; on the tail of
+		// the previous pulse only the last few samples before the rise
+		int baseEnd = std::max(first, p.trigger - cfg.baselineGuard);
+		int baseBegin = std::max(first, p.trigger - cfg.preSamples);
+		if (baseBegin <= previousEnd) {
+			p.flags |= kPileOnTail;
+			baseBegin = std::max(previousEnd + 1, baseEnd - cfg.baselineGuard * 4);
+		}
+		double sum = 0.0;
+		for (int s = baseBegin; s < baseEnd; ++s) sum += w[s];
+		p.baseline = baseEnd > baseBegin ? sum / (baseEnd - baseBegin) : w[std::max(0, p.trigger)];
+		p.amplitude = sign * (w[p.peak] - p.baseline);
+
+		p.begin = std::max(p.trigger - cfg.preSamples, previousEnd + 1);
+		p.end = i + 1 < pulses.size() ? pulses[i + 1].trigger : last;
+		if (i + 1 < pulses.size()) {
+			if (pulses[i + 1].trigger - p.peak < cfg.minSeparation) {
+				p.flags |= kPileUnresolved;
+				pulses[i + 1].flags |= kPileUnresolved;
+			}
+			if (pulses[i + 1].trigger < p.trigger + cfg.gateLength) p.flags |= kPileTruncated;
+		}
+	}
+}
+
+#endif
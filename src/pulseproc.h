@@ -0,0 +1,268 @@
+#ifndef PULSEPROC_H
+#define PULSEPROC_H
+
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TBranch.h"
+#include "TObjArray.h"
+#include "TList.h"
+#include "TNamed.h"
+#include "TString.h"
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Per-event pulse processing shared by the in-memory pipelines.
+// These are the same steps as the loops in bsl_adjust.cpp and t0.cpp,
+// so a pulse processed here matches the baseline_adjusted / t0aligned branches.
+
+static const int kNSamples = 10000;        // samples per stored waveform
+static const int kBaselineSamples = 100;   // leading samples used for the baseline
+static const int kAlignIndex = 1000;       // index the CFD time is shifted to
+
+// Mean of the first baselineSamples samples
+inline double computeBaseline(const double* pd, int baselineSamples = kBaselineSamples)
+{
+	double baseline = 0.0;
+	for (int j = 0; j < baselineSamples; ++j) {
+		baseline += pd[j];
+	}
+	return baseline / baselineSamples;
+}
+
+inline void subtractBaseline(const double* pd, double baseline, double* out, int n = kNSamples)
+{
+	for (int k = 0; k < n; ++k) {
+		out[k] = pd[k] - baseline;
+	}
+}
+
+// First threshold crossing before the absolute maximum: index j with w[j]
+// short of the threshold and w[j+1] at or past it, or -1 if none.
+// Polarity is taken from the sign of the maximum, as in t0().
+inline int cfdCrossing(const double* w, int n, double cfdFraction, double& threshold)
+{
+	double maxAmplitude = 0.0;
+	int maxIndex = 0;
+	for (int j = 0; j < n; ++j) {
+		if (std::fabs(w[j]) > maxAmplitude) {
+			maxAmplitude = std::fabs(w[j]);
+			maxIndex = j;
+		}
+	}
+
+	bool isNegativePulse = w[maxIndex] < 0;
+	threshold = cfdFraction * maxAmplitude;
+	if (isNegativePulse) threshold = -threshold;
+
+	for (int j = 0; j < maxIndex; ++j) {
+		if ((isNegativePulse && w[j] > threshold && w[j+1] <= threshold) ||
+			(!isNegativePulse && w[j] < threshold && w[j+1] >= threshold)) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+// CFD time as t0() stores it: the sample before the crossing, or -1
+inline double cfdTime(const double* w, int n, double cfdFraction)
+{
+	double threshold;
+	return cfdCrossing(w, n, cfdFraction, threshold);
+}
+
+// Sub-sample CFD time: the crossing interpolated linearly between w[j] and w[j+1]
+inline double cfdTimeFine(const double* w, int n, double cfdFraction)
+{
+	double threshold;
+	int j = cfdCrossing(w, n, cfdFraction, threshold);
+	if (j < 0) return -1;
+	double step = w[j+1] - w[j];
+	return step != 0.0 ? j + (threshold - w[j]) / step : j;
+}
+
+// Integer shift moving t0 to kAlignIndex; samples shifted in are zero.
+// If t0 was not found the pulse is copied unchanged, as in t0().
+inline void alignPulse(const double* w, int n, double t0_value, double* out)
+{
+	if (t0_value < 0) {
+		for (int j = 0; j < n; ++j) out[j] = w[j];
+		return;
+	}
+	int shift = kAlignIndex - static_cast<int>(t0_value);
+	for (int j = 0; j < n; ++j) {
+		int sourceIdx = j - shift;
+		out[j] = (sourceIdx >= 0 && sourceIdx < n) ? w[sourceIdx] : 0.0;
+	}
+}
+
+// Fractional delay kernel: taps[k + kSincHalfWidth - 1] weights sample i + k
+// when interpolating the pulse at i + frac (k = 1 - kSincHalfWidth .. kSincHalfWidth).
+// Lanczos-windowed sinc, normalised to unit gain at DC; frac = 0 is a pure copy.
+static const int kSincHalfWidth = 8;
+static const int kSincTaps = 2 * kSincHalfWidth;
+
+inline void sincKernel(double frac, double* taps)
+{
+	double sum = 0.0;
+	for (int k = 1 - kSincHalfWidth; k <= kSincHalfWidth; ++k) {
+		double x = frac - k;
+		double h = 1.0;
+		if (x != 0.0) {
+			double px = M_PI * x;
+			h = kSincHalfWidth * std::sin(px) * std::sin(px / kSincHalfWidth) / (px * px);
+		}
+		taps[k + kSincHalfWidth - 1] = h;
+		sum += h;
+	}
+	for (int k = 0; k < kSincTaps; ++k) taps[k] /= sum;
+}
+
+// Shift moving a sub-sample t0 exactly to kAlignIndex, out[j] = w(j - kAlignIndex + t0),
+// for j in [0, nOut). With add the shifted pulse is added to out instead, so
+// averages can be accumulated without storing the aligned pulse. Samples
+// outside the record are zero; if t0 was not found the pulse is used as is.
+inline void alignPulseFine(const double* w, int n, double t0_value, double* out, int nOut, bool add = false)
+{
+	int base = 0;
+	double frac = 0.0;
+	if (t0_value >= 0) {
+		base = static_cast<int>(std::floor(t0_value));
+		frac = t0_value - base;
+		base -= kAlignIndex;
+	}
+
+	if (frac == 0.0) {
+		for (int j = 0; j < nOut; ++j) {
+			int k = j + base;
+			double v = (k >= 0 && k < n) ? w[k] : 0.0;
+			out[j] = add ? out[j] + v : v;
+		}
+		return;
+	}
+
+	double taps[kSincTaps];
+	sincKernel(frac, taps);
+	// Output samples whose whole kernel lies inside the record
+	int inBegin = std::max(0, kSincHalfWidth - 1 - base);
+	int inEnd = std::min(nOut, n - kSincHalfWidth - base);
+	for (int j = 0; j < nOut; ++j) {
+		const int first = j + base + 1 - kSincHalfWidth;
+		double v = 0.0;
+		if (j >= inBegin && j < inEnd) {
+			const double* x = w + first;
+			for (int k = 0; k < kSincTaps; ++k) v += taps[k] * x[k];
+		} else {
+			for (int k = 0; k < kSincTaps; ++k) {
+				int i = first + k;
+				if (i >= 0 && i < n) v += taps[k] * w[i];
+			}
+		}
+		out[j] = add ? out[j] + v : v;
+	}
+}
+
+// Put a stored window of length samples starting at record index offset
+// back into an n-sample record, zero outside the window
+inline void expandWindow(const double* stored, int length, int offset, double* out, int n = kNSamples)
+{
+	for (int j = 0; j < n; ++j) {
+		int k = j - offset;
+		out[j] = (k >= 0 && k < length) ? stored[k] : 0.0;
+	}
+}
+
+// Region of interest bslAdjust() cropped the records to, kept in the tree's
+// user info as "cfd <start>" (window from the CFD time + start) or
+// "record <start>", so later stages know where the stored samples can land.
+inline void recordRoi(TTree* tree, bool fromCfd, int start)
+{
+	TList* info = tree->GetUserInfo();
+	if (TObject* old = info->FindObject("roi")) {
+		info->Remove(old);
+		delete old;
+	}
+	info->Add(new TNamed("roi", Form("%s %d", fromCfd ? "cfd" : "record", start)));
+}
+
+inline std::string recordedRoi(TTree* tree)
+{
+	TObject* roi = tree->GetUserInfo()->FindObject("roi");
+	return roi ? roi->GetTitle() : "";
+}
+
+// Samples, from record index 0, an aligned branch needs to hold every stored
+// sample of the requested window once t0 is at kAlignIndex. A CFD window lands
+// at kAlignIndex + start; a fixed one moves by up to kAlignIndex samples, the
+// shift of a pulse at index 0. Unknown windows keep the full record.
+inline int alignedLength(TTree* tree, int nStored)
+{
+	if (!tree->GetBranch("roi_offset")) return nStored;
+	char kind[16] = "";
+	int start = 0;
+	if (std::sscanf(recordedRoi(tree).c_str(), "%15s %d", kind, &start) != 2) return kNSamples;
+	int end = std::string(kind) == "cfd" ? kAlignIndex + start + nStored : start + nStored + kAlignIndex;
+	return std::max(1, std::min(end, kNSamples));
+}
+
+// Waveform branch that may be stored cropped to a region of interest.
+// bslAdjust() can store only a window of each record; the leaf length says
+// how many samples are stored and the optional offset branch (roi_offset)
+// says where the window starts in the 10000-sample record (aligned branches
+// have no offset: they start at record index 0 and are alignedLength() long,
+// enough to hold the aligned window). expand() puts the
+// window back in place with zeros around it, so readers keep using record
+// indices (t0 at 1000, gates up to 6100) whether or not the data is cropped.
+struct WaveformBranch {
+	std::vector<double> stored;
+	int offset = 0;
+	bool hasOffset = false;
+
+	bool attach(TTree* tree, const char* branchName, const char* offsetBranch = nullptr)
+	{
+		TLeaf* leaf = tree->GetLeaf(branchName);
+		if (!leaf) {
+			std::cerr << "Error: no waveform branch " << branchName << std::endl;
+			return false;
+		}
+		stored.assign(leaf->GetLenStatic(), 0.0);
+		tree->SetBranchAddress(branchName, stored.data());
+		hasOffset = offsetBranch && tree->GetBranch(offsetBranch);
+		if (hasOffset) tree->SetBranchAddress(offsetBranch, &offset);
+		return true;
+	}
+
+	int length() const { return stored.size(); }
+
+	// Number of record samples covered, counted from index 0
+	int extent() const { return std::min<int>(offset + length(), kNSamples); }
+
+	void expand(double* out, int n = kNSamples) const
+	{
+		expandWindow(stored.data(), length(), offset, out, n);
+	}
+};
+
+// Remove a branch and its leaves from the tree, so that rerunning a stage
+// replaces its output branch instead of adding a second one of the same name.
+// The old baskets stay in the file (as unused space) until it is rewritten.
+inline bool dropBranch(TTree* tree, const char* name)
+{
+	TBranch* branch = tree->GetBranch(name);
+	if (!branch) return false;
+	std::cout << "Replacing existing branch " << name << std::endl;
+	TObjArray* leaves = branch->GetListOfLeaves();
+	for (int i = 0; i < leaves->GetEntriesFast(); ++i) {
+		tree->GetListOfLeaves()->Remove(leaves->At(i));
+	}
+	tree->GetListOfLeaves()->Compress();
+	tree->GetListOfBranches()->Remove(branch);
+	tree->GetListOfBranches()->Compress();
+	delete branch;
+	return true;
+}
+
+#endif
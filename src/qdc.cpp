@@ -4,54 +4,90 @@
 #include <iostream>
 #include <string>  // Add string header
 #include <cmath>
+#include <algorithm>
 
-void qdc(const char* fileLocation, int t1, int t2)
+#include "pulseproc.h"
+#include "prefilter.h"
+#include "prefetchreader.h"
+#include "incremental.h"
+
+// filter: optional pre-filter spec (see prefilter.h) applied to the aligned
+// pulse in memory before integration; its tag is added to the branch names.
+// incremental: if the branches exist, integrate only the entries after the
+// ones they already hold (see incremental.h).
+void qdc(const char* fileLocation, int t1, int t2, const char* filter = "", bool incremental = false)
 {
+    WaveformFilter prefilter(filter);
+    if (!prefilter.ok()) return;
+
     TFile* file0 = TFile::Open(fileLocation, "UPDATE");
         TTree* tree = dynamic_cast<TTree*>(file0->Get("adjustedTree"));
     
     const int nSamples = 10000;              // length of the waveform array
     double pulse[nSamples]; 
-
-    tree->SetBranchAddress("t0aligned_cfd0.10", pulse);
+    double filtered[nSamples];
 
     // Use std::string for branch names
-    std::string Q1BranchName = Form("Q1_%d_%d_val", t1, t2);
-    std::string Q2BranchName = Form("Q2_%d_%d_val", t1, t2);
+    std::string Q1BranchName = Form("Q1_%d_%d%s_val", t1, t2, prefilter.tag().c_str());
+    std::string Q2BranchName = Form("Q2_%d_%d%s_val", t1, t2, prefilter.tag().c_str());
     
     // Print branch names for debugging
     std::cout << "Creating branches: " << Q1BranchName << " and " << Q2BranchName << std::endl;
     
     double Q1val = 0.0, Q2val = 0.0;  // Initialize both values
     
-    // Use c_str() to convert std::string to const char*
-    TBranch* Q1Branch = tree->Branch(Q1BranchName.c_str(), &Q1val, Form("%s/D", Q1BranchName.c_str()));
-    TBranch* Q2Branch = tree->Branch(Q2BranchName.c_str(), &Q2val, Form("%s/D", Q2BranchName.c_str()));
+    if (!branchComplete(tree, "t0aligned_cfd0.10")) {
+        file0->Close();
+        return;
+    }
+    StageBranches outputs(tree);
+    outputs.add(Q1BranchName, &Q1val, Q1BranchName + "/D");
+    outputs.add(Q2BranchName, &Q2val, Q2BranchName + "/D");
+    Long64_t firstEntry = outputs.open(incremental);
+
+    // Aligned pulses are read ahead on a separate read-only handle; they may
+    // be stored cropped, expandWindow() restores record indices
+    PrefetchReader reader(fileLocation, "adjustedTree");
+    int alignedIndex = reader.addBranch("t0aligned_cfd0.10");
+    if (!reader.start(firstEntry)) {
+        file0->Close();
+        return;
+    }
     
     int t0 = 1000;
     double Q1 = 0.0;
     double Q2 = 0.0;
 
-    Long64_t nEntries = tree->GetEntries();
-    for (Long64_t i = 0; i < nEntries; ++i) {
-        tree->GetEntry(i);
+    while (const EventBatch* batch = reader.next()) {
+        for (int b = 0; b < batch->size; ++b) {
+            expandWindow(batch->get(alignedIndex, b), reader.length(alignedIndex), 0, pulse);
+            if (prefilter.active()) {
+                prefilter.apply(pulse, filtered, nSamples);
+                std::copy(filtered, filtered + nSamples, pulse);
+            }
 
-        Q1 = 0.0;
-        Q2 = 0.0;
+            Q1 = 0.0;
+            Q2 = 0.0;
 
-        for (int j = t0; j < t1; ++j) {
-            Q1 += pulse[j];
-        }
+            for (int j = t0; j < t1; ++j) {
+                Q1 += pulse[j];
+            }
 
-        for (int j = t0; j < t2; ++j) {
-            Q2 += pulse[j];
+            for (int j = t0; j < t2; ++j) {
+                Q2 += pulse[j];
+            }
+            Q1val = Q1;
+            Q2val = Q2;
+            outputs.fill();
         }
-        Q1val = Q1;
-        Q2val = Q2;
-        Q1Branch->Fill();
-        Q2Branch->Fill();
+    }
+    if (reader.failed()) {
+        std::cerr << "Error reading " << fileLocation << "; no branches written" << std::endl;
+        file0->Close();
+        return;
     }
 
+    outputs.commit();
     tree->Write();
     file0->Close();
     
@@ -12,6 +12,9 @@
 #include "TCanvas.h"
 #include "TLegend.h"
 
+#include "fasthist.h"
+#include "memorybudget.h"
+
 void qratio(const char* fileLocation1, const char* fileLocation2,
 			const char* Q1BranchAddress, const char* Q2BranchAddress,
 			bool plot = false,
@@ -59,43 +62,68 @@ void qratio(const char* fileLocation1, const char* fileLocation2,
 	tree2->SetBranchAddress(Q2BranchAddress, &Q2);
 	Long64_t nEntries2 = tree2->GetEntries();
 
-	std::vector<double> ratios1, ratios2;
-	ratios1.reserve(nEntries1);
-	ratios2.reserve(nEntries2);
-
-	// Calculate Q2/Q1 ratios for file1
-	for (Long64_t i = 0; i < nEntries1; ++i) {
-		tree1->GetEntry(i);
-		if (Q1 != 0.0) {
-			double r = Q2 / Q1;
-			if (std::isfinite(r)) {
-				ratios1.push_back(r);
-			}
-		}
-	}
-	
-	// Calculate Q2/Q1 ratios for file2
-	for (Long64_t i = 0; i < nEntries2; ++i) {
-		tree2->GetEntry(i);
-		if (Q1 != 0.0) {
-			double r = Q2 / Q1;
-			if (std::isfinite(r)) {
-				ratios2.push_back(r);
+	// Ratios of both files are kept in memory when they fit in the budget
+	// (exact percentiles); otherwise the trees are streamed in chunks, the
+	// range comes from a quantile sketch and the histograms are filled chunk
+	// by chunk.
+	bool inMemory = 2 * (nEntries1 + nEntries2) * sizeof(double) <= memoryBudget();
+	Long64_t chunk = inMemory ? std::max<Long64_t>(std::max(nEntries1, nEntries2), 1) : chunkEvents(sizeof(double), 0.1);
+	bool autoRange = lowRange < 0 || highRange < 0;
+
+	// Q2/Q1 ratios of entries [first, first + chunk)
+	auto readRatios = [&](TTree* tree, Long64_t first, Long64_t nEntries, std::vector<double>& ratios) {
+		ratios.clear();
+		Long64_t last = std::min(first + chunk, nEntries);
+		for (Long64_t i = first; i < last; ++i) {
+			tree->GetEntry(i);
+			if (Q1 != 0.0) {
+				double r = Q2 / Q1;
+				if (std::isfinite(r)) {
+					ratios.push_back(r);
+				}
 			}
 		}
+	};
+
+	std::vector<double> ratios1, ratios2;
+	if (inMemory) {
+		ratios1.reserve(nEntries1);
+		ratios2.reserve(nEntries2);
+		readRatios(tree1, 0, nEntries1, ratios1);
+		readRatios(tree2, 0, nEntries2, ratios2);
+	} else {
+		std::cout << "Ratios exceed the memory budget, streaming " << chunk << " events at a time" << std::endl;
 	}
 
 	// Determine range if not provided
-	if (lowRange < 0 || highRange < 0) {
-		if (!ratios1.empty() && !ratios2.empty()) {
+	if (autoRange) {
+		double p5 = 0.0, p95 = 0.0;
+		bool found = false;
+		if (inMemory && !ratios1.empty() && !ratios2.empty()) {
 			std::vector<double> allRatios = ratios1;	
 			allRatios.insert(allRatios.end(), ratios2.begin(), ratios2.end());
 			std::sort(allRatios.begin(), allRatios.end());
 			// Calculate 5th and 95th percentile
 			size_t i5 = static_cast<size_t>(0.05 * allRatios.size());
 			size_t i95 = static_cast<size_t>(0.95 * allRatios.size());
-			double p5 = allRatios[i5];
-			double p95 = allRatios[i95];
+			p5 = allRatios[i5];
+			p95 = allRatios[i95];
+			found = true;
+		} else if (!inMemory) {
+			QuantileSketch sketch;
+			for (Long64_t first = 0; first < nEntries1; first += chunk) {
+				readRatios(tree1, first, nEntries1, ratios1);
+				for (double r : ratios1) sketch.add(r);
+			}
+			for (Long64_t first = 0; first < nEntries2; first += chunk) {
+				readRatios(tree2, first, nEntries2, ratios2);
+				for (double r : ratios2) sketch.add(r);
+			}
+			p5 = sketch.quantile(0.05);
+			p95 = sketch.quantile(0.95);
+			found = sketch.count() > 0;
+		}
+		if (found) {
 			// Set range with 20% padding
 			lowRange = p5;
 			highRange = p95;
@@ -106,19 +134,26 @@ void qratio(const char* fileLocation1, const char* fileLocation2,
 		std::cout << "Range determined [" << lowRange << ", " << highRange << "]" << std::endl;
 	}
 
-	// Create histograms with the determined range
-	TH1D* h1 = new TH1D("h1", "", nBins, lowRange, highRange);
-	TH1D* h2 = new TH1D("h2", "", nBins, lowRange, highRange);
-	
-	// Fill histograms with the calculated ratios
-	for (double r : ratios1) {
-		h1->Fill(r);
-	}
-	
-	for (double r : ratios2) {
-		h2->Fill(r);
+	// Bin the ratios with the batched kernel, then hand ROOT histograms to the fit
+	FastHist f1(nBins, lowRange, highRange);
+	FastHist f2(nBins, lowRange, highRange);
+	if (inMemory) {
+		fillParallel(f1, ratios1.data(), ratios1.size());
+		fillParallel(f2, ratios2.data(), ratios2.size());
+	} else {
+		for (Long64_t first = 0; first < nEntries1; first += chunk) {
+			readRatios(tree1, first, nEntries1, ratios1);
+			fillParallel(f1, ratios1.data(), ratios1.size());
+		}
+		for (Long64_t first = 0; first < nEntries2; first += chunk) {
+			readRatios(tree2, first, nEntries2, ratios2);
+			fillParallel(f2, ratios2.data(), ratios2.size());
+		}
 	}
 
+	TH1D* h1 = f1.toTH1D("h1");
+	TH1D* h2 = f2.toTH1D("h2");
+
 	// Fit Gaussians to calculate parameters
 	TF1* g1 = new TF1("g1", "gaus", lowRange, highRange);
 	g1->SetParameters(h1->GetMaximum(), h1->GetMean(), h1->GetRMS());
@@ -0,0 +1,135 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+#include "threadpool.h"
+
+// Reductions whose result does not depend on the thread count.
+//
+// Floating-point sums change with the order they are added in, so a reduction
+// that splits its input per thread gives different bits on 4 and 8 cores.
+// Here the input is cut into chunks of a fixed size, whatever the number of
+// threads, each chunk is reduced serially, and the chunk results are combined
+// pairwise in a fixed tree. The tree also keeps the rounding error growing
+// with log(chunks) rather than with the number of values.
+
+// Pairwise combine of partial results pushed in order: a binary counter of
+// partials, where two partials of the same level merge into one of the next.
+// combine(a, b) folds b (the later partial) into a.
+template <typename T, typename Combine>
+class PairwiseReducer {
+public:
+	explicit PairwiseReducer(Combine combine) : fCombine(combine) {}
+
+	void push(T partial)
+	{
+		size_t level = 0;
+		while (level < fLevels.size() && fFull[level]) {
+			fCombine(fLevels[level], partial);
+			partial = std::move(fLevels[level]);
+			fFull[level] = 0;
+			++level;
+		}
+		if (level == fLevels.size()) {
+			fLevels.emplace_back();
+			fFull.push_back(0);
+		}
+		fLevels[level] = std::move(partial);
+		fFull[level] = 1;
+	}
+
+	bool empty() const { return std::find(fFull.begin(), fFull.end(), 1) == fFull.end(); }
+
+	// Combined result, earliest partials first; empty() must be false
+	T result() const
+	{
+		T total;
+		bool first = true;
+		for (size_t level = fLevels.size(); level-- > 0;) {
+			if (!fFull[level]) continue;
+			if (first) {
+				total = fLevels[level];
+				first = false;
+			} else {
+				fCombine(total, fLevels[level]);
+			}
+		}
+		return total;
+	}
+
+private:
+	Combine fCombine;
+	std::vector<T> fLevels;
+	std::vector<char> fFull;
+};
+
+// Reduce [0, n) in chunks of chunkSize: reduceChunk(begin, end) gives the
+// partial of one chunk (on any of nThreads workers), and the partials are
+// combined in the fixed pairwise order. Returns false if n is 0.
+template <typename T, typename ReduceChunk, typename Combine>
+bool deterministicReduce(size_t n, size_t chunkSize, unsigned int nThreads, ReduceChunk reduceChunk,
+						 Combine combine, T& result)
+{
+	if (n == 0) return false;
+	chunkSize = std::max<size_t>(chunkSize, 1);
+	size_t nChunks = (n + chunkSize - 1) / chunkSize;
+	std::vector<T> partials(nChunks);
+	parallelFor(nChunks, nThreads, [&](size_t c, unsigned int) {
+		partials[c] = reduceChunk(c * chunkSize, std::min(n, (c + 1) * chunkSize));
+	});
+
+	PairwiseReducer<T, Combine> tree(combine);
+	for (T& p : partials) tree.push(std::move(p));
+	result = tree.result();
+	return true;
+}
+
+// Per-sample sum of equal-length rows (e.g. waveforms), added one at a time
+// in event order: rows are summed serially in blocks of kBlockRows and the
+// block sums combined pairwise, so a parallel producer feeding rows in order
+// gets the same bits as a serial one.
+class VectorSum {
+public:
+	static const size_t kBlockRows = 256;
+
+	explicit VectorSum(size_t length)
+		: fBlock(length, 0.0), fTree(addInto)
+	{
+	}
+
+	void add(const double* row)
+	{
+		for (size_t j = 0; j < fBlock.size(); ++j) fBlock[j] += row[j];
+		if (++fRows % kBlockRows == 0) {
+			fTree.push(fBlock);
+			std::fill(fBlock.begin(), fBlock.end(), 0.0);
+		}
+	}
+
+	long long rows() const { return fRows; }
+
+	std::vector<double> result() const
+	{
+		Tree tree = fTree;
+		if (fRows % kBlockRows != 0) tree.push(fBlock);
+		return tree.empty() ? std::vector<double>(fBlock.size(), 0.0) : tree.result();
+	}
+
+private:
+	typedef PairwiseReducer<std::vector<double>, void (*)(std::vector<double>&, const std::vector<double>&)> Tree;
+
+	static void addInto(std::vector<double>& a, const std::vector<double>& b)
+	{
+		for (size_t j = 0; j < a.size(); ++j) a[j] += b[j];
+	}
+
+	std::vector<double> fBlock;
+	Tree fTree;
+	long long fRows = 0;
+};
+
+#endif
@@ -1,18 +1,52 @@
 #include "TFile.h"
 #include "TTree.h"
 #include "TH1D.h"
+#include "TLeaf.h"
+#include "TROOT.h"
 #include <iostream>
 #include <cmath>
+#include <atomic>
+#include <memory>
+#include <vector>
 
-void t0(const char* fileLocation, double cfdFraction = 0.1)
+#include "pulseproc.h"
+#include "prefilter.h"
+#include "prefetchreader.h"
+#include "threadpool.h"
+#include "memorybudget.h"
+#include "incremental.h"
+
+// Output of one entry range, filled by a worker and written in order
+struct T0Chunk {
+	std::vector<double> t0;
+	std::vector<double> aligned;      // nEvents x aligned length
+};
+
+// filter: optional pre-filter spec (see prefilter.h), e.g. "ma:8". The CFD
+// runs on the filtered pulse; the aligned branch holds the unfiltered pulse
+// unless writeFiltered is set. Filtered runs get the filter tag in their
+// branch names, e.g. t0_cfd0.10_ma8.
+// fractional: interpolate the crossing and shift by the sub-sample t0 with a
+// windowed-sinc delay (alignPulseFine), so t0 lands exactly on index 1000;
+// the branches get a "_fine" tag, e.g. t0aligned_cfd0.10_fine.
+// nThreads: worker threads (0 = one per core). Entry ranges follow the tree's
+// clusters and are processed in parallel on separate read-only handles; the
+// new branches are filled on this thread in the original event order.
+// incremental: if the branches exist, process only the entries after the ones
+// they already hold (after bslAdjust(..., append), see incremental.h).
+void t0(const char* fileLocation, double cfdFraction = 0.1, const char* filter = "", bool writeFiltered = false,
+		unsigned int nThreads = 0, bool fractional = false, bool incremental = false)
 {
+	if (!WaveformFilter(filter).ok()) return;
+	ROOT::EnableThreadSafety();
+
 	// Open the ROOT file using the provided file location
 	TFile* file = TFile::Open(fileLocation, "UPDATE");
 	if (!file || file->IsZombie()) {
 		std::cerr << "Error opening file: " << fileLocation << std::endl;
 		return;
 	}
-	
+
 	TTree* tree = dynamic_cast<TTree*>(file->Get("adjustedTree"));
 	if (!tree) {
 		std::cerr << "Error getting tree" << std::endl;
@@ -20,104 +54,141 @@ void t0(const char* fileLocation, double cfdFraction = 0.1)
 		return;
 	}
 
-	// Set up variables and branch addresses
+	// Baseline adjusted data, possibly cropped by bslAdjust
+	TLeaf* inputLeaf = tree->GetLeaf("baseline_adjusted");
+	if (!inputLeaf) {
+		std::cerr << "Error: no waveform branch baseline_adjusted" << std::endl;
+		file->Close();
+		return;
+	}
+	// Aligned pulses are stored from record index 0, far enough to hold the
+	// whole stored window once aligned (all of it without a crop)
+	const int nStored = inputLeaf->GetLenStatic();
+	const bool hasOffset = tree->GetBranch("roi_offset") != nullptr;
+	const int nAligned = alignedLength(tree, nStored);
+
+	// Per-worker read handle, input buffers and filter
 	static const int nSamples = 10000;
-	double baselineAdjusted[nSamples];
-	double t0_value;
-	double t0_aligned[nSamples];
-	
-	// Get the branch with baseline adjusted data
-	tree->SetBranchAddress("baseline_adjusted", baselineAdjusted);
+	nThreads = workerCount(nThreads);
+	struct Worker {
+		TreeHandle input;
+		std::vector<double> stored;
+		int offset = 0;
+		std::unique_ptr<WaveformFilter> prefilter;
+	};
+	std::vector<Worker> workers(nThreads);
+	for (Worker& w : workers) {
+		if (!w.input.open(fileLocation, "adjustedTree", nThreads)) {
+			file->Close();
+			return;
+		}
+		w.stored.resize(nStored);
+		w.input.select("baseline_adjusted", w.stored.data());
+		if (hasOffset) w.input.select("roi_offset", &w.offset);
+		w.prefilter.reset(new WaveformFilter(filter));
+	}
+	const bool filtering = workers[0].prefilter->active();
+	const std::string tag = workers[0].prefilter->tag() + (fractional ? "_fine" : "");
 
 	// Create new branches for t0 and t0_aligned
 	// Use branch names that include the cfdFraction value to distinguish them
-	std::string t0BranchName = Form("t0_cfd%.2f", cfdFraction);
-	std::string t0AlignedBranchName = Form("t0aligned_cfd%.2f", cfdFraction);
-	
-	TBranch* t0Branch = tree->Branch(t0BranchName.c_str(), &t0_value, (t0BranchName+"/D").c_str());
-	TBranch* t0AlignedBranch = tree->Branch(t0AlignedBranchName.c_str(), t0_aligned, 
-										   (t0AlignedBranchName+"[10000]/D").c_str());
+	double t0_value;
+	double t0_aligned[nSamples];
+	std::string t0BranchName = Form("t0_cfd%.2f%s", cfdFraction, tag.c_str());
+	std::string t0AlignedBranchName = Form("t0aligned_cfd%.2f%s", cfdFraction, tag.c_str());
+
+	StageBranches outputs(tree);
+	outputs.add(t0BranchName, &t0_value, t0BranchName + "/D");
+	outputs.add(t0AlignedBranchName, t0_aligned, Form("%s[%d]/D", t0AlignedBranchName.c_str(), nAligned));
+	Long64_t firstEntry = outputs.open(incremental);
 
 	std::cout << "Using CFD fraction: " << cfdFraction << std::endl;
+	if (fractional) {
+		std::cout << "Using fractional (sub-sample) alignment" << std::endl;
+	}
+	if (filtering) {
+		std::cout << "Using pre-filter: " << filter << std::endl;
+	}
 	std::cout << "Created branches: " << t0BranchName << " and " << t0AlignedBranchName << std::endl;
+	if (nAligned < kNSamples) {
+		std::cout << "Aligned pulses cover record indices [0, " << nAligned << ")" << std::endl;
+	}
 
-	// Loop over entries in the TTree
-	Long64_t nEntries = tree->GetEntries();
-	for (Long64_t i = 0; i < nEntries; ++i) {
-		tree->GetEntry(i);
-
-		// Find the maximum amplitude of the pulse
-		double maxAmplitude = 0.0;
-		int maxIndex = 0;
-		for (int j = 0; j < nSamples; ++j) {
-			if (fabs(baselineAdjusted[j]) > maxAmplitude) {
-				maxAmplitude = fabs(baselineAdjusted[j]);
-				maxIndex = j;
-			}
-		}
+	// Entry ranges of at most 256 events
+	std::vector<std::pair<Long64_t, Long64_t>> ranges = clusterRanges(workers[0].input.tree, 256, firstEntry);
+	std::vector<T0Chunk> chunks(ranges.size());
+
+	std::atomic<bool> readError{false};
+	// Chunks in flight: up to two per thread, fewer if the memory budget is tight
+	size_t window = std::max<size_t>(1, std::min<size_t>(2 * nThreads, chunkEvents(256 * nAligned * sizeof(double), 0.25, 1)));
+	orderedParallel(ranges.size(), nThreads, window, [&](size_t c, unsigned int t) {
+		if (readError) return;   // the run is abandoned
+		Worker& w = workers[t];
+		T0Chunk& out = chunks[c];
+		Long64_t first = ranges[c].first, last = ranges[c].second;
+		size_t n = last - first;
+		out.t0.resize(n);
+		out.aligned.resize(n * nAligned);
+		std::vector<double> baselineAdjusted(nSamples), filtered(nSamples), shifted(nSamples);
+		// CFD input, and the pulse that gets shifted into the aligned branch
+		const double* timing = filtering ? filtered.data() : baselineAdjusted.data();
+		const double* source = (filtering && writeFiltered) ? filtered.data() : baselineAdjusted.data();
 
-		// Determine pulse polarity
-		bool isNegativePulse = baselineAdjusted[maxIndex] < 0;
-		
-		// Calculate threshold for CFD using the provided fraction
-		double threshold = cfdFraction * maxAmplitude;
-		if (isNegativePulse) threshold = -threshold;
-		
-		// Find t0 - where the pulse crosses the threshold
-		t0_value = -1; // Default value if threshold not found
-		
-		// Look for threshold crossing before the maximum
-		for (int j = 0; j < maxIndex; ++j) {
-			if ((isNegativePulse && baselineAdjusted[j] > threshold && baselineAdjusted[j+1] <= threshold) ||
-				(!isNegativePulse && baselineAdjusted[j] < threshold && baselineAdjusted[j+1] >= threshold)) {
-				// Simply use the first index where we cross threshold
-				t0_value = j;
-				break;
+		w.input.range(first, last);
+		for (size_t e = 0; e < n; ++e) {
+			if (w.input.tree->GetEntry(first + e) <= 0) {
+				readError = true;
+				out.t0.resize(e);
+				return;
 			}
-		}
-		
-		// Very simple alignment approach - just integer shift
-		if (t0_value >= 0) {
-			// Initialize with zeros
-			for (int j = 0; j < nSamples; ++j) {
-				t0_aligned[j] = 0.0;
+			expandWindow(w.stored.data(), nStored, hasOffset ? w.offset : 0, baselineAdjusted.data());
+			if (filtering) {
+				w.prefilter->apply(baselineAdjusted.data(), filtered.data(), nSamples);
 			}
-			
-			// Calculate simple integer shift
-			int t0_int = static_cast<int>(t0_value); // truncate to integer
-			int shift = 1000 - t0_int;  // shift amount to move t0 to index 1000
-			
-			// Plain shift - copy each value to its new position
-			for (int j = 0; j < nSamples; ++j) {
-				int sourceIdx = j - shift;
-				if (sourceIdx >= 0 && sourceIdx < nSamples) {
-					t0_aligned[j] = baselineAdjusted[sourceIdx];
-				}
-				// else leave as zero
+
+			// First threshold crossing before the maximum, then t0 is shifted
+			// to index 1000 by whole samples, or exactly with fractional
+			// (the pulse is copied unchanged if no crossing was found)
+			if (fractional) {
+				out.t0[e] = cfdTimeFine(timing, nSamples, cfdFraction);
+				alignPulseFine(source, nSamples, out.t0[e], shifted.data(), nSamples);
+			} else {
+				out.t0[e] = cfdTime(timing, nSamples, cfdFraction);
+				alignPulse(source, nSamples, out.t0[e], shifted.data());
 			}
-			
-			if (i < 5) {
-				std::cout << "Event " << i << ": t0=" << t0_value 
+			std::copy(shifted.begin(), shifted.begin() + nAligned, &out.aligned[e * nAligned]);
+		}
+	}, [&](size_t c) {
+		// Fill the branches in event order and release the chunk
+		T0Chunk& out = chunks[c];
+		for (size_t e = 0; e < out.t0.size(); ++e) {
+			Long64_t i = ranges[c].first + e;
+			t0_value = out.t0[e];
+			std::copy(&out.aligned[e * nAligned], &out.aligned[e * nAligned] + nAligned, t0_aligned);
+			if (i < 5 && t0_value >= 0) {
+				int t0_int = static_cast<int>(t0_value);
+				std::cout << "Event " << i << ": t0=" << t0_value
 						  << ", t0_int=" << t0_int
-						  << ", shift=" << shift << std::endl;
-			}
-		} else {
-			// If t0 not found, just copy the original data
-			for (int j = 0; j < nSamples; ++j) {
-				t0_aligned[j] = baselineAdjusted[j];
+						  << ", shift=" << kAlignIndex - t0_int << std::endl;
 			}
+			outputs.fill();
 		}
-		
-		// Fill the branches
-		t0Branch->Fill();
-		t0AlignedBranch->Fill();
+		std::vector<double>().swap(out.aligned);
+	});
+	// Entries after a failed chunk would be misaligned with the other
+	// branches: leave the file as it was
+	if (readError) {
+		std::cerr << "Error reading " << fileLocation << "; no branches written" << std::endl;
+		file->Close();
+		return;
 	}
 
 	// Write the updated tree
+	outputs.commit();
 	tree->Write("", TObject::kOverwrite);
 
 	// Close the file
 	file->Close();
-	
+
 	std::cout << "T0 alignment completed successfully with CFD fraction: " << cfdFraction << std::endl;
-}
\ No newline at end of file
+}
@@ -7,6 +7,8 @@
 #include <iostream>
 #include <cmath>
 
+#include "pulseproc.h"
+
 void plot(){
 
     TFile* file0 = TFile::Open("degrees_10.root", "READ");
@@ -19,10 +21,12 @@ void plot(){
     double pulse05[nSamples];
     double pulse03[nSamples];
 
-    tree->SetBranchAddress("t0aligned_cfd0.20", pulse20);
-    tree->SetBranchAddress("t0aligned_cfd0.10", pulse10);
-    tree->SetBranchAddress("t0aligned_cfd0.05", pulse05);
-    tree->SetBranchAddress("t0aligned_cfd0.03", pulse03);
+    // Stored length may differ from nSamples (full or cropped records)
+    WaveformBranch aligned20, aligned10, aligned05, aligned03;
+    aligned20.attach(tree, "t0aligned_cfd0.20");
+    aligned10.attach(tree, "t0aligned_cfd0.10");
+    aligned05.attach(tree, "t0aligned_cfd0.05");
+    aligned03.attach(tree, "t0aligned_cfd0.03");
 
     double sum20[nSamples] = {0};
     double sum10[nSamples] = {0};
@@ -31,6 +35,10 @@ void plot(){
 
     for (int i = 0; i < nEntries; ++i) {
         tree->GetEntry(i);
+        aligned20.expand(pulse20, nSamples);
+        aligned10.expand(pulse10, nSamples);
+        aligned05.expand(pulse05, nSamples);
+        aligned03.expand(pulse03, nSamples);
         for (int j = 0; j < nSamples; ++j) {
             sum20[j] += pulse20[j];
             sum10[j] += pulse10[j];
@@ -0,0 +1,110 @@
+#ifndef TAILBIN_H
+#define TAILBIN_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+// Log-spaced compression of the post-peak tail for the decay fits.
+//
+// The first nLinear tail samples keep one bin each (the peak and the fast
+// component); after that bin widths grow in proportion to the distance from
+// the peak (width = pos * (growth - 1)), so a 9000-sample tail becomes
+// ~100 bins. Each bin holds the mean of its samples with error
+// noiseSigma / sqrt(width).
+//
+// The fit model is evaluated as the exact mean of the exponential over the
+// samples of each bin (expBinMean), so wide bins do not bias Tau. Bin b is
+// fitted at x = b + 0.5 in a histogram of unit-width bins; TailModel maps it
+// back to the sample range of that bin.
+
+struct TailBins {
+	std::vector<int> start;       // first tail sample of each bin
+	std::vector<int> width;       // samples in each bin
+	std::vector<double> mean;
+	std::vector<double> error;
+
+	int size() const { return start.size(); }
+};
+
+// Bin layout for a tail of nTail samples. growth <= 1 keeps every sample.
+inline void tailEdges(int nTail, int nLinear, double growth, TailBins& bins)
+{
+	bins.start.clear();
+	bins.width.clear();
+	int pos = 0;
+	while (pos < nTail) {
+		int width = 1;
+		if (pos >= nLinear && growth > 1.0) {
+			width = std::max(1, static_cast<int>(pos * (growth - 1.0)));
+		}
+		width = std::min(width, nTail - pos);
+		bins.start.push_back(pos);
+		bins.width.push_back(width);
+		pos += width;
+	}
+}
+
+// RMS of w[begin, end) about its mean, skipping exact zeros (samples shifted
+// in by the alignment, or outside a cropped window). Returns 0 if too few.
+inline double noiseRms(const double* w, int begin, int end)
+{
+	double sum = 0.0, sum2 = 0.0;
+	int n = 0;
+	for (int j = begin; j < end; ++j) {
+		if (w[j] == 0.0) continue;
+		sum += w[j];
+		sum2 += w[j] * w[j];
+		++n;
+	}
+	if (n < 10) return 0.0;
+	double mean = sum / n;
+	return std::sqrt(std::max(0.0, sum2 / n - mean * mean));
+}
+
+// Fill bin means and errors for tail[0, nTail) using the layout in bins.
+// Without a noise estimate all samples get unit error, which keeps the
+// relative weights (and so the fitted parameters) correct.
+inline void compressTail(const double* tail, double noiseSigma, TailBins& bins)
+{
+	if (!(noiseSigma > 0)) noiseSigma = 1.0;
+	const int n = bins.size();
+	bins.mean.resize(n);
+	bins.error.resize(n);
+	for (int b = 0; b < n; ++b) {
+		double sum = 0.0;
+		const double* s = tail + bins.start[b];
+		for (int k = 0; k < bins.width[b]; ++k) sum += s[k];
+		bins.mean[b] = sum / bins.width[b];
+		bins.error[b] = noiseSigma / std::sqrt(static_cast<double>(bins.width[b]));
+	}
+}
+
+// Exact mean of amp * exp(-k / tau) over samples k = a .. a + w - 1
+inline double expBinMean(double amp, double tau, int a, int w)
+{
+	if (!(tau > 0)) return 0.0;
+	double first = amp * std::exp(-a / tau);
+	if (w == 1) return first;
+	double r = std::exp(-1.0 / tau);
+	return first * (1.0 - std::pow(r, w)) / (w * (1.0 - r));
+}
+
+// Sum of nExp exponentials, parameters (amp, tau) per component, averaged
+// over the samples of tail bin floor(x). Used as a TF1 functor.
+struct TailModel {
+	const TailBins* bins;
+	int nExp;
+
+	double operator()(double* x, double* p) const
+	{
+		int b = std::min(std::max(0, static_cast<int>(x[0])), bins->size() - 1);
+		double v = 0.0;
+		for (int c = 0; c < nExp; ++c) {
+			v += expBinMean(p[2 * c], p[2 * c + 1], bins->start[b], bins->width[b]);
+		}
+		return v;
+	}
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include "TFile.h"
+#include "TTree.h"
+#include "TLeaf.h"
+#include "TROOT.h"
+#include "TCanvas.h"
+#include "TGraph.h"
+#include "TLegend.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "pulseproc.h"
+#include "prefetchreader.h"
+#include "threadpool.h"
+#include "reduce.h"
+#include "incremental.h"
+
+// Average pulse templates for several CFD fractions in one read of the
+// baseline-adjusted pulses, without writing or storing aligned pulses.
+//
+// Each pulse is timed once per CFD fraction and added, shifted so its t0 is
+// at index 1000, straight into the running template. With fractional the
+// crossing is interpolated and the shift is an exact sub-sample delay
+// (alignPulseFine), which removes the up-to-one-sample jitter that smears the
+// leading edges of the averages made from t0()'s integer-aligned branches
+// (averageplot.cpp, t0params.cpp). Pulses without a CFD crossing are left out.
+//
+// Entry ranges are summed in parallel on separate read handles and combined
+// pairwise in entry order (reduce.h), so the templates do not depend on the
+// thread count.
+//
+// Writes outputName ("sample avg_<fraction>..." per line) and plotName, the
+// 900-1100 zoom t0params.cpp draws. The sums are kept in outputName.state;
+// with incremental, only the entries added to the file since that state was
+// written are read and summed into it (see incremental.h).
+
+// Per-range sums: nFractions x length, and the number of pulses in each
+struct TemplateSums {
+	std::vector<double> sum;
+	std::vector<double> count;
+
+	void merge(const TemplateSums& other)
+	{
+		for (size_t j = 0; j < sum.size(); ++j) sum[j] += other.sum[j];
+		for (size_t f = 0; f < count.size(); ++f) count[f] += other.count[f];
+	}
+};
+
+void templates(const char* fileLocation, const char* cfdFractions = "0.20,0.10,0.05,0.03",
+			   bool fractional = true, int length = 6000,
+			   const char* outputName = "templates.txt", const char* plotName = "average_waveforms_zoom.png",
+			   unsigned int nThreads = 0, bool incremental = false)
+{
+	std::vector<double> fractions;
+	std::stringstream ss(cfdFractions);
+	std::string item;
+	while (std::getline(ss, item, ',')) fractions.push_back(std::atof(item.c_str()));
+	if (fractions.empty() || length <= kAlignIndex || length > kNSamples) {
+		std::cerr << "Invalid template settings: fractions \"" << cfdFractions << "\", length " << length << std::endl;
+		return;
+	}
+	const size_t nFractions = fractions.size();
+	ROOT::EnableThreadSafety();
+
+	// Per-worker read handle on the baseline adjusted data (possibly cropped)
+	nThreads = workerCount(nThreads);
+	struct Worker {
+		TreeHandle input;
+		std::vector<double> stored;
+		int offset = 0;
+	};
+	std::vector<Worker> workers(nThreads);
+	int nStored = 0;
+	bool hasOffset = false;
+	for (Worker& w : workers) {
+		if (!w.input.open(fileLocation, "adjustedTree", nThreads)) return;
+		TLeaf* leaf = w.input.tree->GetLeaf("baseline_adjusted");
+		if (!leaf) {
+			std::cerr << "Error: no waveform branch baseline_adjusted" << std::endl;
+			return;
+		}
+		nStored = leaf->GetLenStatic();
+		hasOffset = w.input.tree->GetBranch("roi_offset") != nullptr;
+		w.stored.resize(nStored);
+		w.input.select("baseline_adjusted", w.stored.data());
+		if (hasOffset) w.input.select("roi_offset", &w.offset);
+	}
+
+	// Sums of the entries already processed
+	const Long64_t nEntries = workers[0].input.tree->GetEntries();
+	const std::string statePath = std::string(outputName) + ".state";
+	SummaryState state(Form("templates %s %s fractions %s fractional %d length %d", fileLocation,
+							fileIdentity(fileLocation).c_str(), cfdFractions, (int)fractional, length));
+	TemplateSums previous;
+	Long64_t firstEntry = 0;
+	if (incremental && state.load(statePath) && state.array("sum").size() == nFractions * length &&
+		state.array("count").size() == nFractions && state.watermark(fileLocation) <= nEntries) {
+		firstEntry = state.watermark(fileLocation);
+		previous.sum = state.array("sum");
+		previous.count = state.array("count");
+		std::cout << "Adding to the templates of the first " << firstEntry << " pulses" << std::endl;
+	}
+
+	std::vector<std::pair<Long64_t, Long64_t>> ranges = clusterRanges(workers[0].input.tree, 256, firstEntry);
+	std::vector<TemplateSums> chunks(ranges.size());
+	std::cout << "Building " << nFractions << " templates (" << (fractional ? "fractional" : "integer")
+			  << " alignment) from " << nEntries - firstEntry << " pulses on " << nThreads
+			  << " threads..." << std::endl;
+
+	auto combine = [](TemplateSums& a, const TemplateSums& b) { a.merge(b); };
+	PairwiseReducer<TemplateSums, decltype(combine)> total(combine);
+	std::atomic<bool> readError{false};
+	orderedParallel(ranges.size(), nThreads, 2 * nThreads, [&](size_t c, unsigned int t) {
+		Worker& w = workers[t];
+		TemplateSums& out = chunks[c];
+		out.sum.assign(nFractions * length, 0.0);
+		out.count.assign(nFractions, 0.0);
+		std::vector<double> pulse(kNSamples);
+
+		w.input.range(ranges[c].first, ranges[c].second);
+		for (Long64_t i = ranges[c].first; i < ranges[c].second; ++i) {
+			if (w.input.tree->GetEntry(i) <= 0) {
+				readError = true;
+				return;
+			}
+			expandWindow(w.stored.data(), nStored, hasOffset ? w.offset : 0, pulse.data());
+			for (size_t f = 0; f < nFractions; ++f) {
+				double* sum = &out.sum[f * length];
+				if (fractional) {
+					double t = cfdTimeFine(pulse.data(), kNSamples, fractions[f]);
+					if (t < 0) continue;
+					alignPulseFine(pulse.data(), kNSamples, t, sum, length, true);
+				} else {
+					double t = cfdTime(pulse.data(), kNSamples, fractions[f]);
+					if (t < 0) continue;
+					int shift = kAlignIndex - static_cast<int>(t);
+					for (int j = std::max(0, shift); j < std::min(length, kNSamples + shift); ++j) {
+						sum[j] += pulse[j - shift];
+					}
+				}
+				out.count[f] += 1.0;
+			}
+		}
+	}, [&](size_t c) {
+		total.push(std::move(chunks[c]));
+	});
+	if (readError) {
+		std::cerr << "Error reading " << fileLocation << std::endl;
+		return;
+	}
+	if (total.empty() && previous.sum.empty()) {
+		std::cerr << "No pulses in " << fileLocation << std::endl;
+		return;
+	}
+	TemplateSums sums = previous;
+	if (!total.empty()) {
+		if (sums.sum.empty()) {
+			sums = total.result();
+		} else {
+			sums.merge(total.result());
+		}
+	}
+	state.setWatermark(fileLocation, nEntries);
+	state.array("sum") = sums.sum;
+	state.array("count") = sums.count;
+	state.save(statePath);
+
+	std::vector<std::vector<double>> avg(nFractions, std::vector<double>(length, 0.0));
+	for (size_t f = 0; f < nFractions; ++f) {
+		std::cout << "CFD fraction " << fractions[f] << ": " << sums.count[f] << " pulses" << std::endl;
+		if (sums.count[f] == 0) continue;
+		for (int j = 0; j < length; ++j) avg[f][j] = sums.sum[f * length + j] / sums.count[f];
+	}
+
+	std::ofstream txtOut(outputName);
+	if (!txtOut.is_open()) {
+		std::cerr << "Failed to open " << outputName << std::endl;
+		return;
+	}
+	txtOut << "sample";
+	for (double fr : fractions) txtOut << " " << Form("avg_%.2f", fr);
+	txtOut << "\n";
+	for (int j = 0; j < length; ++j) {
+		txtOut << j;
+		for (size_t f = 0; f < nFractions; ++f) txtOut << " " << avg[f][j];
+		txtOut << "\n";
+	}
+	txtOut.close();
+
+	// Leading edges, as t0params.cpp draws them
+	std::vector<double> xVals(length);
+	for (int j = 0; j < length; ++j) xVals[j] = j;
+	static const int colors[] = {kAzure + 1, kOrange + 1, kTeal + 2, kViolet - 3, kRed + 1, kGray + 2};
+	TCanvas* c1 = new TCanvas("c_templates", "Average Waveforms", 1600, 1200);
+	TLegend* leg = new TLegend(0.7, 0.7, 0.9, 0.9);
+	leg->SetBorderSize(0);
+	leg->SetFillStyle(0);
+	for (size_t f = 0; f < nFractions; ++f) {
+		TGraph* g = new TGraph(length, xVals.data(), avg[f].data());
+		g->SetLineColor(colors[f % 6]);
+		g->SetLineWidth(4);
+		if (f == 0) {
+			g->Draw("AL");
+			g->GetXaxis()->SetLimits(900, 1100);
+			g->GetHistogram()->SetAxisRange(900, 1100, "X");
+		} else {
+			g->Draw("L SAME");
+		}
+		leg->AddEntry(g, Form("CFD Fraction: %.2f", fractions[f]), "l");
+	}
+	leg->Draw();
+	c1->SaveAs(plotName);
+
+	std::cout << "Templates written to " << outputName << " and " << plotName << std::endl;
+}
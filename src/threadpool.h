@@ -0,0 +1,112 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// Number of worker threads to use; 0 means "one per core", as in gatematrix2.
+inline unsigned int workerCount(unsigned int requested = 0)
+{
+	unsigned int n = requested;
+	if (n == 0) n = std::thread::hardware_concurrency();
+	if (n == 0) n = 4;  // Fallback if hardware_concurrency() is undefined.
+	return n;
+}
+
+// Run job(index, threadId) for every index in [0, nJobs) on nThreads workers.
+// Jobs are handed out one at a time from a shared counter, so uneven jobs
+// (e.g. datasets of different size) still balance.
+template <typename Job>
+void parallelFor(size_t nJobs, unsigned int nThreads, Job job)
+{
+	nThreads = std::min<size_t>(workerCount(nThreads), std::max<size_t>(nJobs, 1));
+	if (nThreads <= 1) {
+		for (size_t i = 0; i < nJobs; ++i) job(i, 0u);
+		return;
+	}
+
+	std::mutex jobMutex;
+	size_t nextJob = 0;
+	auto worker = [&](unsigned int threadId) {
+		while (true) {
+			size_t current;
+			{
+				std::lock_guard<std::mutex> lock(jobMutex);
+				if (nextJob >= nJobs) break;
+				current = nextJob++;
+			}
+			job(current, threadId);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < nThreads; ++t) {
+		threads.emplace_back(worker, t);
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+// Run produce(chunk, threadId) for every chunk in [0, nChunks) on nThreads
+// workers and consume(chunk) on the calling thread strictly in chunk order,
+// as soon as that chunk is produced. Workers stay at most window chunks ahead
+// of the last consumed one, which bounds the memory held in chunk buffers;
+// no more than window workers are started, so a small window is honoured.
+// Used where per-event work is parallel but output must keep event order.
+template <typename Produce, typename Consume>
+void orderedParallel(size_t nChunks, unsigned int nThreads, size_t window, Produce produce, Consume consume)
+{
+	window = std::max<size_t>(window, 1);
+	nThreads = std::min<size_t>(workerCount(nThreads), std::min(std::max<size_t>(nChunks, 1), window));
+	if (nThreads <= 1) {
+		for (size_t c = 0; c < nChunks; ++c) {
+			produce(c, 0u);
+			consume(c);
+		}
+		return;
+	}
+
+	std::mutex chunkMutex;
+	std::condition_variable chunkCond;
+	std::vector<char> done(nChunks, 0);
+	size_t nextChunk = 0, consumed = 0;
+	auto worker = [&](unsigned int threadId) {
+		while (true) {
+			size_t current;
+			{
+				std::unique_lock<std::mutex> lock(chunkMutex);
+				chunkCond.wait(lock, [&] { return nextChunk >= nChunks || nextChunk < consumed + window; });
+				if (nextChunk >= nChunks) break;
+				current = nextChunk++;
+			}
+			produce(current, threadId);
+			std::lock_guard<std::mutex> lock(chunkMutex);
+			done[current] = 1;
+			chunkCond.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < nThreads; ++t) {
+		threads.emplace_back(worker, t);
+	}
+	for (size_t c = 0; c < nChunks; ++c) {
+		{
+			std::unique_lock<std::mutex> lock(chunkMutex);
+			chunkCond.wait(lock, [&] { return done[c] != 0; });
+		}
+		consume(c);
+		std::lock_guard<std::mutex> lock(chunkMutex);
+		consumed = c + 1;
+		chunkCond.notify_all();
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+#endif